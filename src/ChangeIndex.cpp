@@ -0,0 +1,364 @@
+#include "ChangeIndex.h"
+
+#include "Errors.h"
+#include "Util.h"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace fmerge {
+
+    constexpr char CHANGE_INDEX_MAGIC[4] = {'F', 'M', 'C', 'I'};
+    constexpr size_t MIN_SLOT_COUNT{64};
+    constexpr size_t MIN_ENTRY_CAPACITY{1024};
+
+
+    // All fields are little endian
+    struct ChangeIndex::Header {
+        char magic[4];
+        unsigned int version;
+        unsigned long log_ino;
+        unsigned long log_length;
+        unsigned long slot_count; // Power of two
+        unsigned long path_count;
+        unsigned long entry_count;
+        unsigned long entry_capacity;
+    } __attribute__((packed));
+
+
+    // The hash 0 marks an empty slot
+    struct ChangeIndex::Slot {
+        unsigned long path_hash;
+        unsigned long last_entry;
+        unsigned long entry_count;
+    } __attribute__((packed));
+
+
+    struct ChangeIndex::Entry {
+        unsigned long offset;
+        // Number of the previous entry of the same path plus one, or 0 for its first record
+        unsigned long previous;
+    } __attribute__((packed));
+
+
+    static unsigned long path_hash(std::string_view path) {
+        unsigned long hash = fnv1a_hash(path);
+        return hash == 0 ? 1 : hash;
+    }
+
+
+    static size_t slot_count_for(size_t paths) {
+        // The table is kept at most half full
+        size_t slot_count{MIN_SLOT_COUNT};
+        while(slot_count < 2 * paths) {
+            slot_count *= 2;
+        }
+        return slot_count;
+    }
+
+
+    // Index of the slot of the path, or of the empty slot it belongs into. path_of(entry) returns the
+    // path of the record of an entry.
+    template<typename Slot, typename PathOf>
+    static size_t probe(const Slot* slots, size_t slot_count, unsigned long hash, std::string_view path, PathOf&& path_of) {
+        size_t mask = slot_count - 1;
+        for(size_t i = hash & mask;; i = (i + 1) & mask) {
+            unsigned long slot_hash = le64toh(slots[i].path_hash);
+            if(slot_hash == 0 || (slot_hash == hash && path_of(le64toh(slots[i].last_entry)) == path)) {
+                return i;
+            }
+        }
+    }
+
+
+    // Moves the slots into a table of slot_count slots. Distinct slots never hold the same path, so their
+    // paths are not compared.
+    template<typename Slot>
+    static std::vector<Slot> rehash(const Slot* slots, size_t old_slot_count, size_t slot_count) {
+        std::vector<Slot> table(slot_count, Slot{});
+        size_t mask = slot_count - 1;
+        for(size_t i = 0; i < old_slot_count; i++) {
+            unsigned long hash = le64toh(slots[i].path_hash);
+            if(hash == 0) {
+                continue;
+            }
+            size_t j = hash & mask;
+            while(table[j].path_hash != 0) {
+                j = (j + 1) & mask;
+            }
+            table[j] = slots[i];
+        }
+        return table;
+    }
+
+
+    template<typename Header, typename Slot, typename Entry>
+    static bool write_index(const std::string& index_path, Header header, const std::vector<Slot>& slots, const std::vector<Entry>& entries) {
+        std::string buffer{};
+        buffer.reserve(sizeof(header) + slots.size() * sizeof(Slot) + le64toh(header.entry_capacity) * sizeof(Entry));
+        buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        buffer.append(reinterpret_cast<const char*>(slots.data()), slots.size() * sizeof(Slot));
+        buffer.append(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(Entry));
+        buffer.append((le64toh(header.entry_capacity) - entries.size()) * sizeof(Entry), '\0');
+
+        // The index must be complete on disk before it replaces the old one, since its header marks it as valid
+        std::string tmp_path = index_path + ".tmp";
+        int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd == -1) {
+            print_clib_error("open");
+            return false;
+        }
+        size_t written{0};
+        while(written < buffer.length()) {
+            ssize_t n = write(fd, buffer.data() + written, buffer.length() - written);
+            if(n == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                print_clib_error("write");
+                close(fd);
+                return false;
+            }
+            written += static_cast<size_t>(n);
+        }
+        if(fsync(fd) == -1) {
+            print_clib_error("fsync");
+            close(fd);
+            return false;
+        }
+        close(fd);
+        if(rename(tmp_path.c_str(), index_path.c_str()) == -1) {
+            print_clib_error("rename");
+            return false;
+        }
+        return true;
+    }
+
+
+    ChangeIndex::ChangeIndex(ChangeIndex&& other) noexcept :
+            index_path(std::move(other.index_path)), fd(other.fd), data(other.data), length(other.length) {
+        other.fd = -1;
+        other.data = nullptr;
+    }
+
+
+    ChangeIndex::~ChangeIndex() {
+        if(data != nullptr) {
+            munmap(data, length);
+        }
+        if(fd != -1) {
+            close(fd);
+        }
+    }
+
+
+    ChangeIndex::Header& ChangeIndex::header() const {
+        return *reinterpret_cast<Header*>(data);
+    }
+
+
+    ChangeIndex::Slot* ChangeIndex::slots() const {
+        return reinterpret_cast<Slot*>(data + sizeof(Header));
+    }
+
+
+    ChangeIndex::Entry* ChangeIndex::entries() const {
+        return reinterpret_cast<Entry*>(data + sizeof(Header) + le64toh(header().slot_count) * sizeof(Slot));
+    }
+
+
+    std::optional<ChangeIndex> ChangeIndex::open(const std::string& index_path, unsigned long log_ino, unsigned long log_length) {
+        int fd = ::open(index_path.c_str(), O_RDWR | O_CLOEXEC);
+        if(fd == -1) {
+            return std::nullopt;
+        }
+        struct stat stats{};
+        Header header{};
+        if(fstat(fd, &stats) == -1 || static_cast<size_t>(stats.st_size) < sizeof(header) ||
+                pread(fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header))) {
+            close(fd);
+            return std::nullopt;
+        }
+
+        unsigned long slot_count = le64toh(header.slot_count);
+        unsigned long entry_capacity = le64toh(header.entry_capacity);
+        bool valid = memcmp(header.magic, CHANGE_INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+            le32toh(header.version) == FORMAT_VERSION &&
+            le64toh(header.log_ino) == log_ino && le64toh(header.log_length) == log_length &&
+            slot_count >= MIN_SLOT_COUNT && (slot_count & (slot_count - 1)) == 0 &&
+            le64toh(header.entry_count) <= entry_capacity && le64toh(header.path_count) <= slot_count / 2 &&
+            static_cast<unsigned long>(stats.st_size) == sizeof(header) + slot_count * sizeof(Slot) + entry_capacity * sizeof(Entry);
+        if(!valid) {
+            close(fd);
+            return std::nullopt;
+        }
+
+        size_t length = static_cast<size_t>(stats.st_size);
+        void* data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(data == MAP_FAILED) {
+            print_clib_error("mmap");
+            close(fd);
+            return std::nullopt;
+        }
+        return ChangeIndex(index_path, fd, static_cast<char*>(data), length);
+    }
+
+
+    bool ChangeIndex::build(const std::string& index_path, unsigned long log_ino, unsigned long log_length, const std::vector<Record>& records) {
+        // Sized for the worst case of one path per record first, and shrunk once the paths are counted
+        size_t slot_count = slot_count_for(records.size());
+        std::vector<Slot> slots(slot_count, Slot{});
+        std::vector<Entry> entries(records.size());
+        size_t path_count{0};
+        auto path_of = [&records](unsigned long entry) { return records[entry].path; };
+        for(size_t i = 0; i < records.size(); i++) {
+            unsigned long hash = path_hash(records[i].path);
+            auto& slot = slots[probe(slots.data(), slot_count, hash, records[i].path, path_of)];
+            entries[i].offset = htole64(records[i].offset);
+            if(slot.path_hash == 0) {
+                slot = Slot{.path_hash = htole64(hash), .last_entry = htole64(i), .entry_count = htole64(1)};
+                path_count++;
+            } else {
+                entries[i].previous = htole64(le64toh(slot.last_entry) + 1);
+                slot.last_entry = htole64(i);
+                slot.entry_count = htole64(le64toh(slot.entry_count) + 1);
+            }
+        }
+        if(slot_count_for(path_count) < slot_count) {
+            slots = rehash(slots.data(), slot_count, slot_count_for(path_count));
+        }
+
+        Header header{
+            .magic = {},
+            .version = htole32(FORMAT_VERSION),
+            .log_ino = htole64(log_ino),
+            .log_length = htole64(log_length),
+            .slot_count = htole64(slots.size()),
+            .path_count = htole64(path_count),
+            .entry_count = htole64(entries.size()),
+            .entry_capacity = htole64(std::max(MIN_ENTRY_CAPACITY, entries.size() + entries.size() / 2)),
+        };
+        memcpy(header.magic, CHANGE_INDEX_MAGIC, sizeof(header.magic));
+        return write_index(index_path, header, slots, entries);
+    }
+
+
+    bool ChangeIndex::grow(size_t paths, size_t records) {
+        Header new_header = header();
+        size_t slot_count = le64toh(header().slot_count);
+        size_t entry_count = le64toh(header().entry_count);
+        size_t new_slot_count = slot_count_for(paths);
+        size_t entry_capacity = std::max(le64toh(header().entry_capacity), MIN_ENTRY_CAPACITY);
+        while(entry_capacity < records) {
+            entry_capacity *= 2;
+        }
+        new_header.slot_count = htole64(new_slot_count);
+        new_header.entry_capacity = htole64(entry_capacity);
+
+        auto new_slots = new_slot_count != slot_count ?
+            rehash(slots(), slot_count, new_slot_count) : std::vector<Slot>(slots(), slots() + slot_count);
+        std::vector<Entry> new_entries(entries(), entries() + entry_count);
+        if(!write_index(index_path, new_header, new_slots, new_entries)) {
+            return false;
+        }
+
+        auto reopened = open(index_path, le64toh(new_header.log_ino), le64toh(new_header.log_length));
+        if(!reopened.has_value()) {
+            return false;
+        }
+        std::swap(fd, reopened->fd);
+        std::swap(data, reopened->data);
+        std::swap(length, reopened->length);
+        return true;
+    }
+
+
+    bool ChangeIndex::append(const std::vector<Record>& records, unsigned long new_log_length, const PathReader& read_path) {
+        size_t entry_count = le64toh(header().entry_count);
+        size_t path_count = le64toh(header().path_count);
+        if(2 * (path_count + records.size()) > le64toh(header().slot_count) || entry_count + records.size() > le64toh(header().entry_capacity)) {
+            if(!grow(path_count + records.size(), entry_count + records.size())) {
+                return false;
+            }
+        }
+
+        // Paths of this append are still at hand. Older ones are read from the log.
+        size_t first_entry = entry_count;
+        auto path_of = [&](unsigned long entry) -> std::string {
+            if(entry >= first_entry) {
+                return std::string(records[entry - first_entry].path);
+            }
+            return read_path(le64toh(entries()[entry].offset));
+        };
+        size_t slot_count = le64toh(header().slot_count);
+        for(const auto& record : records) {
+            unsigned long hash = path_hash(record.path);
+            auto& slot = slots()[probe(slots(), slot_count, hash, record.path, path_of)];
+            auto& entry = entries()[entry_count];
+            entry.offset = htole64(record.offset);
+            if(slot.path_hash == 0) {
+                entry.previous = 0;
+                slot = Slot{.path_hash = htole64(hash), .last_entry = htole64(entry_count), .entry_count = htole64(1)};
+                path_count++;
+            } else {
+                entry.previous = htole64(le64toh(slot.last_entry) + 1);
+                slot.last_entry = htole64(entry_count);
+                slot.entry_count = htole64(le64toh(slot.entry_count) + 1);
+            }
+            entry_count++;
+        }
+        header().entry_count = htole64(entry_count);
+        header().path_count = htole64(path_count);
+
+        if(msync(data, length, MS_SYNC) == -1) {
+            print_clib_error("msync");
+            return false;
+        }
+        header().log_length = htole64(new_log_length);
+        return true;
+    }
+
+
+    std::vector<unsigned long> ChangeIndex::history_offsets(const Slot& slot) const {
+        std::vector<unsigned long> offsets(le64toh(slot.entry_count));
+        unsigned long entry = le64toh(slot.last_entry) + 1;
+        for(size_t i = offsets.size(); i-- > 0 && entry != 0;) {
+            offsets[i] = le64toh(entries()[entry - 1].offset);
+            entry = le64toh(entries()[entry - 1].previous);
+        }
+        return offsets;
+    }
+
+
+    std::vector<unsigned long> ChangeIndex::find(std::string_view path, const PathReader& read_path) const {
+        size_t slot_count = le64toh(header().slot_count);
+        const auto& slot = slots()[probe(slots(), slot_count, path_hash(path), path, [&](unsigned long entry) {
+            return read_path(le64toh(entries()[entry].offset));
+        })];
+        if(slot.path_hash == 0) {
+            return {};
+        }
+        return history_offsets(slot);
+    }
+
+
+    void ChangeIndex::for_each_history(const std::function<void(const std::vector<unsigned long>&)>& visit) const {
+        size_t slot_count = le64toh(header().slot_count);
+        for(size_t i = 0; i < slot_count; i++) {
+            if(slots()[i].path_hash != 0) {
+                visit(history_offsets(slots()[i]));
+            }
+        }
+    }
+
+
+    size_t ChangeIndex::path_count() const {
+        return le64toh(header().path_count);
+    }
+
+}
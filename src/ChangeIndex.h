@@ -0,0 +1,75 @@
+#pragma once
+
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+namespace fmerge {
+
+    // Index of the change log by path, stored in .fmerge/filechanges.idx.
+    //
+    // The index file is mapped into memory. It holds an open addressing hash table (linear probing) from the
+    // hash of each path to the newest record of the path, followed by one entry per record of the log, in log
+    // order. An entry holds the offset of its record and links to the previous record of the same path, so the
+    // history of a path is found without reading any other part of the log. Paths with the same hash are told
+    // apart by the path of their newest record, which is read from the log.
+    //
+    // The index is only valid for the log file (inode and length) it was built for. Appends to the log update
+    // it in place, and rewrites of the log replace it. Its length is only advanced once all other updates are
+    // on disk, so an index whose update was interrupted no longer matches the log and is rebuilt.
+    class ChangeIndex {
+    public:
+        // Returns the path of the record at the given offset of the log
+        using PathReader = std::function<std::string(unsigned long offset)>;
+
+        struct Record {
+            std::string_view path;
+            unsigned long offset;
+        };
+
+        ChangeIndex() = delete;
+        ChangeIndex(const ChangeIndex&) = delete;
+        ChangeIndex& operator=(const ChangeIndex&) = delete;
+        ChangeIndex(ChangeIndex&& other) noexcept;
+        ~ChangeIndex();
+
+        // Maps the index at index_path, if it describes the log with the given inode and length
+        static std::optional<ChangeIndex> open(const std::string& index_path, unsigned long log_ino, unsigned long log_length);
+        // Replaces the index at index_path by one of the records of the whole log, in log order
+        static bool build(const std::string& index_path, unsigned long log_ino, unsigned long log_length, const std::vector<Record>& records);
+
+        // Adds the records of an append, after which the log is new_log_length bytes long
+        bool append(const std::vector<Record>& records, unsigned long new_log_length, const PathReader& read_path);
+
+        // Offsets of the records of the path, oldest first. Empty if the path has no history.
+        std::vector<unsigned long> find(std::string_view path, const PathReader& read_path) const;
+        // Calls visit(offsets) with the record offsets of each path, oldest first
+        void for_each_history(const std::function<void(const std::vector<unsigned long>&)>& visit) const;
+        size_t path_count() const;
+
+        static constexpr unsigned int FORMAT_VERSION = 1;
+    private:
+        ChangeIndex(std::string _index_path, int _fd, char* _data, size_t _length) :
+            index_path(std::move(_index_path)), fd(_fd), data(_data), length(_length) {};
+
+        struct Header;
+        struct Slot;
+        struct Entry;
+
+        Header& header() const;
+        Slot* slots() const;
+        Entry* entries() const;
+        std::vector<unsigned long> history_offsets(const Slot& slot) const;
+        // Rewrites the index with room for at least the given number of paths and records
+        bool grow(size_t paths, size_t records);
+
+        std::string index_path;
+        int fd;
+        char* data;
+        size_t length;
+    };
+
+}
@@ -0,0 +1,732 @@
+#include "ChangeLog.h"
+
+#include "ChangeIndex.h"
+#include "Errors.h"
+#include "Terminal.h"
+#include "Util.h"
+
+#include <algorithm>
+#include <endian.h>
+#include <fcntl.h>
+#include <fstream>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace fmerge {
+
+    constexpr char CHANGE_LOG_MAGIC[4] = {'F', 'M', 'C', 'L'};
+
+
+    struct LogHeader {
+        char magic[4];
+        unsigned int version;
+    } __attribute__((packed));
+
+
+    // Fixed part of a record (all fields little endian). It is preceded by the length of the
+    // record and, since version 2, its checksum. It is followed by the path and, for moves, the old path.
+    // Since version 3, the time at which the change was logged follows the paths, and since version 4
+    // the distance of the record whose path the path is coded against (16 bit, 0 if it is stored completely).
+    struct SerializedChange {
+        unsigned char type;
+        unsigned char file_type;
+        // Length of the stored part of the path
+        unsigned short path_length;
+        unsigned short moved_from_length;
+        // Since version 4, number of leading bytes the path shares with the path of the base record
+        unsigned short shared_path_length;
+        long earliest_change_time;
+        long latest_change_time;
+        long mtime_ns;
+        unsigned long size;
+        unsigned long ino;
+        unsigned long dev;
+        unsigned long content_hash;
+    } __attribute__((packed));
+
+
+    static std::string change_log_path(const std::string& base_dir) {
+        return join_path(base_dir, ".fmerge/filechanges.db");
+    }
+
+
+    static std::string change_index_path(const std::string& base_dir) {
+        return join_path(base_dir, ".fmerge/filechanges.idx");
+    }
+
+
+    static unsigned int record_checksum(const char* record, size_t length) {
+        unsigned long hash = fnv1a_hash(std::string_view(record, length));
+        return static_cast<unsigned int>(hash ^ (hash >> 32));
+    }
+
+
+    static void encode_header(std::string& buffer) {
+        LogHeader header{.magic = {}, .version = htole32(CHANGE_LOG_VERSION)};
+        memcpy(header.magic, CHANGE_LOG_MAGIC, sizeof(header.magic));
+        buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+
+
+    // Reference of a front-coded path to the record it is coded against
+    struct PathCoding {
+        size_t shared_length{0};
+        // Distance in bytes back to the base record, 0 if the path is stored completely
+        size_t base_distance{0};
+    };
+
+
+    // Changes that were not logged before are stamped with log_time_ns. Only the part of the path after
+    // the shared length given by coding is stored.
+    static bool encode_change(std::string& buffer, const Change& change, long log_time_ns, const PathCoding& coding) {
+        if(change.file.path.length() > 0xFFFF || change.moved_from.length() > 0xFFFF) {
+            std::cerr << "[Error] Path is too long for the change log: " << change.file.path << std::endl;
+            return false;
+        }
+        std::string_view stored_path = std::string_view(change.file.path).substr(coding.shared_length);
+        unsigned int record_length = htole32(static_cast<unsigned int>(
+            sizeof(SerializedChange) + stored_path.length() + change.moved_from.length() + sizeof(long) + sizeof(unsigned short)));
+        SerializedChange record{
+            .type = static_cast<unsigned char>(change.type),
+            .file_type = static_cast<unsigned char>(change.file.type),
+            .path_length = htole16(static_cast<unsigned short>(stored_path.length())),
+            .moved_from_length = htole16(static_cast<unsigned short>(change.moved_from.length())),
+            .shared_path_length = htole16(static_cast<unsigned short>(coding.shared_length)),
+            .earliest_change_time = static_cast<long>(htole64(change.earliest_change_time)),
+            .latest_change_time = static_cast<long>(htole64(change.latest_change_time)),
+            .mtime_ns = static_cast<long>(htole64(change.mtime_ns)),
+            .size = htole64(change.size),
+            .ino = htole64(change.ino),
+            .dev = htole64(change.dev),
+            .content_hash = htole64(change.content_hash),
+        };
+        buffer.append(reinterpret_cast<const char*>(&record_length), sizeof(record_length));
+        size_t checksum_offset = buffer.length();
+        buffer.append(sizeof(unsigned int), '\0');
+        size_t record_offset = buffer.length();
+        buffer.append(reinterpret_cast<const char*>(&record), sizeof(record));
+        buffer.append(stored_path);
+        buffer.append(change.moved_from);
+        long logged_at = static_cast<long>(htole64(change.log_time_ns != 0 ? change.log_time_ns : log_time_ns));
+        buffer.append(reinterpret_cast<const char*>(&logged_at), sizeof(logged_at));
+        unsigned short base_distance = htole16(static_cast<unsigned short>(coding.base_distance));
+        buffer.append(reinterpret_cast<const char*>(&base_distance), sizeof(base_distance));
+
+        unsigned int checksum = htole32(record_checksum(buffer.data() + record_offset, buffer.length() - record_offset));
+        memcpy(buffer.data() + checksum_offset, &checksum, sizeof(checksum));
+        return true;
+    }
+
+
+    // Checks the record at the start of data, written in the given version of the format. Returns the number
+    // of bytes it takes up, or 0 if it is incomplete or damaged. On success, record holds its fixed part and
+    // strings points to the strings that follow it. The checksum is only checked if verify is set.
+    static size_t parse_record(const char* data, size_t length, unsigned int version, bool verify, SerializedChange& record,
+            const char*& strings, size_t& strings_length) {
+        unsigned int record_length{};
+        unsigned int checksum{};
+        size_t prefix_length = version >= 2 ? sizeof(record_length) + sizeof(checksum) : sizeof(record_length);
+        if(length < prefix_length + sizeof(record)) {
+            return 0;
+        }
+        memcpy(&record_length, data, sizeof(record_length));
+        record_length = le32toh(record_length);
+        if(length - prefix_length < record_length) {
+            return 0;
+        }
+        if(version >= 2 && verify) {
+            memcpy(&checksum, data + sizeof(record_length), sizeof(checksum));
+            if(le32toh(checksum) != record_checksum(data + prefix_length, record_length)) {
+                return 0;
+            }
+        }
+        memcpy(&record, data + prefix_length, sizeof(record));
+
+        // Later versions may add fields after the paths, which are skipped
+        if(record_length < sizeof(record) + le16toh(record.path_length) + le16toh(record.moved_from_length)) {
+            return 0;
+        }
+        strings = data + prefix_length + sizeof(record);
+        strings_length = record_length - sizeof(record);
+        return prefix_length + record_length;
+    }
+
+
+    // Decodes the record at the start of data, written in the given version of the format. Returns
+    // the number of bytes it takes up, or 0 if it is incomplete or damaged. The strings of the
+    // decoded record point into data. If the path is front-coded, only the stored part is decoded,
+    // and coding refers to the rest.
+    static size_t decode_record(const char* data, size_t length, unsigned int version, bool verify, ChangeRecord& change,
+            PathCoding& coding) {
+        SerializedChange record{};
+        const char* strings{nullptr};
+        size_t strings_length{0};
+        size_t total_length = parse_record(data, length, version, verify, record, strings, strings_length);
+        if(total_length == 0) {
+            return 0;
+        }
+
+        size_t path_length = le16toh(record.path_length);
+        size_t moved_from_length = le16toh(record.moved_from_length);
+        change.type = static_cast<ChangeType>(record.type);
+        change.file_type = static_cast<FileType>(record.file_type);
+        change.path = std::string_view(strings, path_length);
+        change.moved_from = std::string_view(strings + path_length, moved_from_length);
+        change.earliest_change_time = static_cast<long>(le64toh(record.earliest_change_time));
+        change.latest_change_time = static_cast<long>(le64toh(record.latest_change_time));
+        change.mtime_ns = static_cast<long>(le64toh(record.mtime_ns));
+        change.size = le64toh(record.size);
+        change.ino = le64toh(record.ino);
+        change.dev = le64toh(record.dev);
+        change.content_hash = le64toh(record.content_hash);
+        change.log_time_ns = 0;
+        if(strings_length >= path_length + moved_from_length + sizeof(long)) {
+            long logged_at{};
+            memcpy(&logged_at, strings + path_length + moved_from_length, sizeof(logged_at));
+            change.log_time_ns = static_cast<long>(le64toh(logged_at));
+        }
+        coding = PathCoding{};
+        if(version >= 4) {
+            unsigned short base_distance{};
+            if(strings_length < path_length + moved_from_length + sizeof(long) + sizeof(base_distance)) {
+                return 0;
+            }
+            memcpy(&base_distance, strings + path_length + moved_from_length + sizeof(long), sizeof(base_distance));
+            coding.shared_length = le16toh(record.shared_path_length);
+            coding.base_distance = le16toh(base_distance);
+            if((coding.base_distance == 0) != (coding.shared_length == 0)) {
+                return 0;
+            }
+        }
+        return total_length;
+    }
+
+
+    // Encodes the changes, which start at log_offset in the log. The index records of the changes are added to records.
+    static void encode_changes(std::string& buffer, const std::vector<Change>& changes, unsigned long log_offset,
+            std::vector<ChangeIndex::Record>& records) {
+        records.reserve(records.size() + changes.size());
+        long log_time_ns = get_timestamp_now_ns();
+        // Record with a complete path that the following paths are coded against
+        size_t base_offset{0};
+        std::string_view base_path{};
+        size_t coded_records{PATH_RESTART_INTERVAL};
+        for(const auto& change : changes) {
+            size_t offset = buffer.length();
+            PathCoding coding{};
+            if(coded_records + 1 < PATH_RESTART_INTERVAL && offset - base_offset <= 0xFFFF) {
+                auto mismatch = std::mismatch(base_path.begin(), base_path.end(), change.file.path.begin(), change.file.path.end());
+                coding.shared_length = mismatch.first - base_path.begin();
+                coding.base_distance = coding.shared_length != 0 ? offset - base_offset : 0;
+            }
+            if(!encode_change(buffer, change, log_time_ns, coding)) {
+                continue;
+            }
+            records.push_back(ChangeIndex::Record{.path = change.file.path, .offset = log_offset + offset});
+            if(coding.base_distance == 0) {
+                base_offset = offset;
+                base_path = change.file.path;
+                coded_records = 0;
+            } else {
+                coded_records++;
+            }
+        }
+    }
+
+
+    static bool write_all(int fd, const std::string& data) {
+        size_t written{0};
+        while(written < data.length()) {
+            ssize_t n = write(fd, data.data() + written, data.length() - written);
+            if(n == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                print_clib_error("write");
+                return false;
+            }
+            written += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+
+    // Makes a new or renamed file in the directory durable
+    static void sync_directory(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(fd == -1) {
+            print_clib_error("open");
+            return;
+        }
+        if(fsync(fd) == -1) {
+            print_clib_error("fsync");
+        }
+        close(fd);
+    }
+
+
+    // Whether the file at path is a change log in the current binary format
+    static bool is_current_log(const std::string& path) {
+        LogHeader header{};
+        std::ifstream log_file(path, std::ios_base::binary);
+        log_file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        return log_file && memcmp(header.magic, CHANGE_LOG_MAGIC, sizeof(header.magic)) == 0 &&
+            le32toh(header.version) == CHANGE_LOG_VERSION;
+    }
+
+
+    // Reads the record at the given offset of a log in the current format into buffer
+    static bool read_record(int fd, unsigned long offset, std::string& buffer) {
+        unsigned int record_length{};
+        if(pread(fd, &record_length, sizeof(record_length), static_cast<off_t>(offset)) != sizeof(record_length)) {
+            return false;
+        }
+        buffer.resize(2 * sizeof(unsigned int) + le32toh(record_length));
+        return pread(fd, buffer.data(), buffer.length(), static_cast<off_t>(offset)) == static_cast<ssize_t>(buffer.length());
+    }
+
+
+    // Reads the change at the given offset of a log in the current format, and the base record of its path if needed
+    static bool read_change(int fd, unsigned long offset, std::string& buffer, Change& change) {
+        ChangeRecord record{};
+        PathCoding coding{};
+        if(!read_record(fd, offset, buffer) || decode_record(buffer.data(), buffer.length(), CHANGE_LOG_VERSION, true, record, coding) == 0) {
+            return false;
+        }
+        record.copy_to(change);
+        if(coding.base_distance == 0) {
+            return true;
+        }
+
+        ChangeRecord base{};
+        PathCoding base_coding{};
+        std::string base_buffer{};
+        if(coding.base_distance > offset || !read_record(fd, offset - coding.base_distance, base_buffer) ||
+                decode_record(base_buffer.data(), base_buffer.length(), CHANGE_LOG_VERSION, true, base, base_coding) == 0 ||
+                base_coding.base_distance != 0 || coding.shared_length > base.path.length()) {
+            return false;
+        }
+        change.file.path.assign(base.path.substr(0, coding.shared_length));
+        change.file.path.append(record.path);
+        return true;
+    }
+
+
+    Change ChangeRecord::to_change() const {
+        Change change{};
+        copy_to(change);
+        return change;
+    }
+
+
+    void ChangeRecord::copy_to(Change& change) const {
+        change.type = type;
+        change.file.type = file_type;
+        change.file.path.assign(path);
+        change.moved_from.assign(moved_from);
+        change.earliest_change_time = earliest_change_time;
+        change.latest_change_time = latest_change_time;
+        change.mtime_ns = mtime_ns;
+        change.size = size;
+        change.ino = ino;
+        change.dev = dev;
+        change.content_hash = content_hash;
+        change.log_time_ns = log_time_ns;
+    }
+
+
+    MappedChangeLog::MappedChangeLog(const std::string& base_dir) {
+        std::string path = change_log_path(base_dir);
+        if(!map(path)) {
+            return;
+        }
+
+        if(mapped_length < sizeof(LogHeader) || memcmp(data, CHANGE_LOG_MAGIC, sizeof(CHANGE_LOG_MAGIC)) != 0) {
+            // Written by a version that stored the log as CSV. It is encoded in memory, and only
+            // replaced on disk by repair_change_log.
+            bool complete{};
+            auto changes = deserialize_changes(std::string_view(data, mapped_length), &complete);
+            unmap();
+            std::vector<ChangeIndex::Record> records{};
+            encode_header(converted_log);
+            encode_changes(converted_log, changes, 0, records);
+            data = converted_log.data();
+            mapped_length = converted_log.length();
+            csv_log = true;
+            intact_log = complete;
+        }
+
+        LogHeader header{};
+        memcpy(&header, data, sizeof(header));
+        version = le32toh(header.version);
+        if(version > CHANGE_LOG_VERSION) {
+            LOG("[Error] Unsupported change log version " << version << std::endl);
+            exit(1);
+        }
+
+        // The records are only checked once here, so that accessing them later does not have to
+        ChangeRecord record{};
+        PathCoding coding{};
+        size_t position{sizeof(LogHeader)};
+        while(position < mapped_length) {
+            size_t record_length = decode_record(data + position, mapped_length - position, version, true, record, coding);
+            if(record_length == 0) {
+                break;
+            }
+            if(coding.base_distance != 0) {
+                // The base record must be an earlier record with a complete path
+                auto base = std::lower_bound(offsets.begin(), offsets.end(), position - coding.base_distance);
+                ChangeRecord base_record{};
+                PathCoding base_coding{};
+                if(coding.base_distance > position || base == offsets.end() || *base != position - coding.base_distance ||
+                        decode_record(data + *base, position - *base, version, false, base_record, base_coding) == 0 ||
+                        base_coding.base_distance != 0 || coding.shared_length > base_record.path.length()) {
+                    break;
+                }
+                decoded_path_offsets.push_back(decoded_paths.length());
+                decoded_paths.append(base_record.path.substr(0, coding.shared_length));
+                decoded_paths.append(record.path);
+            } else if(version >= 4) {
+                decoded_path_offsets.push_back(NO_DECODED_PATH);
+            }
+            offsets.push_back(position);
+            position += record_length;
+        }
+        // A crash during an append leaves a partial record at the end. Everything from the first damaged
+        // record on is skipped.
+        intact_length = position;
+        intact_log = intact_log && position == mapped_length;
+    }
+
+
+    MappedChangeLog::~MappedChangeLog() {
+        unmap();
+    }
+
+
+    bool MappedChangeLog::map(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd == -1) {
+            // Note: A missing log is not an error
+            return false;
+        }
+        struct stat stats{};
+        if(fstat(fd, &stats) == -1) {
+            print_clib_error("fstat");
+            close(fd);
+            return false;
+        }
+        if(stats.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void* mapping = mmap(nullptr, static_cast<size_t>(stats.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(mapping == MAP_FAILED) {
+            print_clib_error("mmap");
+            LOG("[Error] Could not read the change log " << path << std::endl);
+            exit(1);
+        }
+        // The log is almost always read from front to back
+        madvise(mapping, static_cast<size_t>(stats.st_size), MADV_SEQUENTIAL);
+        data = static_cast<const char*>(mapping);
+        mapped_length = static_cast<size_t>(stats.st_size);
+        log_ino = stats.st_ino;
+        return true;
+    }
+
+
+    void MappedChangeLog::unmap() {
+        if(data != nullptr && !csv_log) {
+            munmap(const_cast<char*>(data), mapped_length);
+            data = nullptr;
+            mapped_length = 0;
+        }
+    }
+
+
+    ChangeRecord MappedChangeLog::operator[](size_t i) const {
+        ChangeRecord record{};
+        PathCoding coding{};
+        decode_record(data + offsets[i], intact_length - offsets[i], version, false, record, coding);
+        if(coding.base_distance != 0) {
+            record.path = std::string_view(decoded_paths).substr(decoded_path_offsets[i], coding.shared_length + record.path.length());
+        }
+        return record;
+    }
+
+
+    bool MappedChangeLog::record_at(unsigned long offset, ChangeRecord& record) const {
+        auto position = std::lower_bound(offsets.begin(), offsets.end(), offset);
+        if(position == offsets.end() || *position != offset) {
+            return false;
+        }
+        record = (*this)[position - offsets.begin()];
+        return true;
+    }
+
+
+    // Opens the index of the change log, and rebuilds it from log if it does not match the log. Only logs in
+    // the current format are indexed. Returns nullopt for all others.
+    static std::optional<ChangeIndex> open_index(const std::string& base_dir, const MappedChangeLog& log) {
+        auto stats = get_file_stats(change_log_path(base_dir));
+        if(!stats.has_value() || log.empty() || log.csv() || log.format_version() != CHANGE_LOG_VERSION || stats->fsize != log.length()) {
+            return std::nullopt;
+        }
+        auto index = ChangeIndex::open(change_index_path(base_dir), stats->ino, stats->fsize);
+        if(index.has_value()) {
+            return index;
+        }
+
+        std::vector<ChangeIndex::Record> records{};
+        records.reserve(log.size());
+        for(size_t i = 0; i < log.size(); i++) {
+            records.push_back(ChangeIndex::Record{.path = log[i].path, .offset = log.offset(i)});
+        }
+        if(!ChangeIndex::build(change_index_path(base_dir), stats->ino, stats->fsize, records)) {
+            return std::nullopt;
+        }
+        return ChangeIndex::open(change_index_path(base_dir), stats->ino, stats->fsize);
+    }
+
+
+    // Like open_index above, but only maps the log if the index has to be rebuilt
+    static std::optional<ChangeIndex> open_index(const std::string& base_dir) {
+        auto stats = get_file_stats(change_log_path(base_dir));
+        if(!stats.has_value() || stats->fsize == 0) {
+            return std::nullopt;
+        }
+        if(auto index = ChangeIndex::open(change_index_path(base_dir), stats->ino, stats->fsize); index.has_value()) {
+            return index;
+        }
+        MappedChangeLog log(base_dir);
+        return open_index(base_dir, log);
+    }
+
+
+    bool repair_change_log(std::string base_dir) {
+        std::string path = change_log_path(base_dir);
+        std::vector<Change> csv_changes{};
+        bool csv{false};
+        bool intact{true};
+        size_t change_count{0};
+        unsigned long intact_length{0};
+        {
+            // The view is closed before the log is changed
+            MappedChangeLog log(base_dir);
+            csv = log.csv();
+            intact = log.intact();
+            change_count = log.size();
+            intact_length = log.length();
+            if(csv) {
+                csv_changes.reserve(log.size());
+                for(size_t i = 0; i < log.size(); i++) {
+                    csv_changes.push_back(log[i].to_change());
+                }
+            }
+        }
+
+        if(!intact) {
+            // The next scan records the files that were affected as changes again
+            LOG("[Warning] The change log ends in a damaged entry after " << change_count <<
+                " changes, probably from an interrupted write. It is dropped." << std::endl);
+        }
+        if(csv) {
+            LOG("Converting the change log to the binary format" << std::endl);
+            if(!write_changes(base_dir, csv_changes)) {
+                LOG("[Error] Could not convert the change log " << path << std::endl);
+                return false;
+            }
+        } else if(!intact && truncate(path.c_str(), static_cast<off_t>(intact_length)) == -1) {
+            print_clib_error("truncate");
+            return false;
+        }
+        return true;
+    }
+
+
+    std::vector<Change> read_changes(std::string base_dir) {
+        // Note: This function fails silently and returns an empty vector if the file is not found
+        MappedChangeLog log(base_dir);
+        std::vector<Change> changes{};
+        changes.reserve(log.size());
+        for(size_t i = 0; i < log.size(); i++) {
+            changes.push_back(log[i].to_change());
+        }
+        return changes;
+    }
+
+
+    SortedChangeSet read_sorted_changes(std::string base_dir) {
+        MappedChangeLog log(base_dir);
+        auto index = open_index(base_dir, log);
+        if(!index.has_value()) {
+            return sort_changes_by_file(read_changes(base_dir));
+        }
+
+        SortedChangeSet sorted_changes{};
+        sorted_changes.reserve(index->path_count());
+        bool consistent{true};
+        ChangeRecord record{};
+        index->for_each_history([&](const std::vector<unsigned long>& offsets) {
+            std::vector<Change> history(offsets.size());
+            for(size_t i = 0; i < offsets.size() && consistent; i++) {
+                consistent = log.record_at(offsets[i], record);
+                if(consistent) {
+                    record.copy_to(history[i]);
+                }
+            }
+            if(consistent) {
+                std::string file_path = history.front().file.path;
+                sorted_changes.emplace(std::move(file_path), std::move(history));
+            }
+        });
+        if(!consistent) {
+            LOG("[Warning] The change log index is damaged. Reading the whole log instead." << std::endl);
+            return sort_changes_by_file(read_changes(base_dir));
+        }
+        return sorted_changes;
+    }
+
+
+    std::vector<Change> read_file_history(std::string base_dir, const std::string& file_path) {
+        auto index = open_index(base_dir);
+        int fd = index.has_value() ? open(change_log_path(base_dir).c_str(), O_RDONLY | O_CLOEXEC) : -1;
+        if(fd == -1) {
+            std::vector<Change> history{};
+            for(auto& change : read_changes(base_dir)) {
+                if(change.file.path == file_path) {
+                    history.push_back(std::move(change));
+                }
+            }
+            return history;
+        }
+
+        std::string buffer{};
+        auto read_path = [&fd, &buffer](unsigned long offset) {
+            Change change{};
+            return read_change(fd, offset, buffer, change) ? change.file.path : std::string{};
+        };
+        std::vector<Change> history{};
+        for(auto offset : index->find(file_path, read_path)) {
+            Change change{};
+            if(!read_change(fd, offset, buffer, change)) {
+                std::cerr << "[Error] The change log index is damaged" << std::endl;
+                break;
+            }
+            history.push_back(std::move(change));
+        }
+        close(fd);
+        return history;
+    }
+
+
+    bool write_changes(std::string base_dir, std::vector<Change> changes) {
+        std::string buffer{};
+        std::vector<ChangeIndex::Record> records{};
+        encode_header(buffer);
+        encode_changes(buffer, changes, 0, records);
+
+        // Written to a temporary file first, so that an interrupted write never leaves a truncated log
+        std::string path = change_log_path(base_dir);
+        std::string tmp_path = path + ".tmp";
+        int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd == -1) {
+            print_clib_error("open");
+            std::cerr << "[Error] Failed to write the change log " << tmp_path << std::endl;
+            return false;
+        }
+        bool written = write_all(fd, buffer);
+        if(written && fsync(fd) == -1) {
+            print_clib_error("fsync");
+            written = false;
+        }
+        close(fd);
+        if(!written) {
+            std::cerr << "[Error] Failed to write the change log " << tmp_path << std::endl;
+            return false;
+        }
+        if(rename(tmp_path.c_str(), path.c_str()) == -1) {
+            print_clib_error("rename");
+            return false;
+        }
+        sync_directory(join_path(base_dir, ".fmerge"));
+
+        // An index that is missing or outdated is rebuilt when it is needed
+        auto stats = get_file_stats(path);
+        if(stats.has_value()) {
+            ChangeIndex::build(change_index_path(base_dir), stats->ino, stats->fsize, records);
+        }
+        return true;
+    }
+
+
+    bool append_changes(std::string base_dir, std::vector<Change> new_changes) {
+        if(new_changes.empty()) {
+            return true;
+        }
+        std::string path = change_log_path(base_dir);
+        auto stats = get_file_stats(path);
+        if(stats.has_value() && stats->fsize > 0 && !is_current_log(path)) {
+            // Records can only be appended to a log in the current format
+            if(!write_changes(base_dir, read_changes(base_dir)) || !is_current_log(path)) {
+                std::cerr << "[Error] Could not convert the change log " << path << " before appending to it" << std::endl;
+                return false;
+            }
+        }
+
+        // Also opened for reading, since the index update reads older records
+        int fd = open(path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if(fd == -1) {
+            print_clib_error("open");
+            return false;
+        }
+        std::string buffer{};
+        auto log_length = static_cast<unsigned long>(lseek(fd, 0, SEEK_END));
+        bool new_log = log_length == 0;
+        if(new_log) {
+            encode_header(buffer);
+        }
+        // The first record stores its complete path, so the append never refers to older records
+        std::vector<ChangeIndex::Record> records{};
+        encode_changes(buffer, new_changes, log_length, records);
+        // All records of the append are made durable by a single sync. A crash before it completes
+        // leaves a torn tail, which read_changes drops.
+        bool written = write_all(fd, buffer);
+        if(written && fdatasync(fd) == -1) {
+            print_clib_error("fdatasync");
+            written = false;
+        }
+        if(!written) {
+            close(fd);
+            std::cerr << "[Error] Failed to append to the change log " << path << std::endl;
+            return false;
+        }
+        if(new_log) {
+            sync_directory(join_path(base_dir, ".fmerge"));
+        }
+
+        // The index is only updated in place if it matched the log before the append. Otherwise it is rebuilt.
+        std::string record_buffer{};
+        auto read_path = [&fd, &record_buffer](unsigned long offset) {
+            Change change{};
+            return read_change(fd, offset, record_buffer, change) ? change.file.path : std::string{};
+        };
+        bool indexed{false};
+        struct stat log_stats{};
+        if(!new_log && fstat(fd, &log_stats) == 0) {
+            if(auto index = ChangeIndex::open(change_index_path(base_dir), log_stats.st_ino, log_length); index.has_value()) {
+                indexed = index->append(records, log_length + buffer.length(), read_path);
+            }
+        }
+        if(!indexed) {
+            open_index(base_dir);
+        }
+        close(fd);
+        return true;
+    }
+
+}
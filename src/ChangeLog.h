@@ -0,0 +1,130 @@
+#pragma once
+
+#include "FileTree.h"
+#include "MergeAlgorithms.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+namespace fmerge {
+
+    // The change log of a folder, stored in .fmerge/filechanges.db.
+    //
+    // The log is a binary file with a short header, followed by one length-prefixed record per
+    // change. New changes are appended to the end of the file, so recording a scan only costs as
+    // much as the new changes themselves. Only a sync rewrites the whole log, through a temporary
+    // file that replaces the log once it is complete.
+    //
+    // Each record carries a checksum. Every append and rewrite is synced to disk once, so a crash can
+    // at most leave a partially written append at the end of the log. Readers skip it, and
+    // repair_change_log cuts it off before the next write.
+    //
+    // The log is indexed by path in .fmerge/filechanges.idx (see ChangeIndex), which is kept up to date by every
+    // append and rewrite.
+    //
+    // Logs in the CSV format of older versions are read as they are, and converted once by repair_change_log.
+    // Version 2 adds the record checksums, version 3 the time at which each change was logged (see
+    // compact_history), version 4 front coding of the paths.
+    //
+    // Since version 4, most records only store the part of their path that differs from the path of a
+    // recent record with a complete path (see PATH_RESTART_INTERVAL), and refer to that record by its
+    // distance. Any record can therefore be decoded with at most one other read.
+    constexpr unsigned int CHANGE_LOG_VERSION = 4;
+    // Every this many records, and at the start of every write and append, a record stores its complete path
+    constexpr size_t PATH_RESTART_INTERVAL = 16;
+
+    // A change as it is stored in the change log. The strings point into the MappedChangeLog it was read from.
+    struct ChangeRecord {
+        ChangeType type{ChangeType::Unknown};
+        FileType file_type{FileType::Unknown};
+        std::string_view path{};
+        std::string_view moved_from{};
+        long earliest_change_time{};
+        long latest_change_time{};
+        long mtime_ns{};
+        unsigned long size{};
+        unsigned long ino{};
+        unsigned long dev{};
+        unsigned long content_hash{};
+        long log_time_ns{};
+
+        Change to_change() const;
+        // Like to_change, but reuses the strings of an existing change
+        void copy_to(Change& change) const;
+    };
+
+
+    // Read-only view of the change log, mapped into memory. Records are decoded when they are accessed,
+    // without copying their strings, so the log can be iterated without allocating anything per record.
+    // Front-coded paths are decoded once, when the log is opened, into a single buffer.
+    //
+    // The view never changes the log file. A damaged end is skipped, and a log in the CSV format is encoded
+    // in memory (see repair_change_log). The view stays valid if the log is replaced in the meantime, but
+    // the log must not be truncated.
+    class MappedChangeLog {
+    public:
+        MappedChangeLog() = delete;
+        // A missing log is an empty view
+        explicit MappedChangeLog(const std::string& base_dir);
+        MappedChangeLog(const MappedChangeLog&) = delete;
+        MappedChangeLog& operator=(const MappedChangeLog&) = delete;
+        ~MappedChangeLog();
+
+        size_t size() const { return offsets.size(); }
+        bool empty() const { return offsets.empty(); }
+        ChangeRecord operator[](size_t i) const;
+        // Offset of record i in the log file
+        unsigned long offset(size_t i) const { return offsets[i]; }
+        // Decodes the record at the given offset of the log file. Returns false if no record starts there.
+        bool record_at(unsigned long offset, ChangeRecord& record) const;
+        // Length of the intact part of the log file
+        unsigned long length() const { return intact_length; }
+        // Inode of the log file
+        unsigned long ino() const { return log_ino; }
+        // Version of the format the log was written in
+        unsigned int format_version() const { return version; }
+        // True if the log file is in the CSV format of older versions
+        bool csv() const { return csv_log; }
+        // False if the log file ends in a damaged record or an incomplete CSV entry
+        bool intact() const { return intact_log; }
+    private:
+        // Maps the log file. Returns false if it is missing or empty.
+        bool map(const std::string& path);
+        void unmap();
+
+        const char* data{nullptr};
+        size_t mapped_length{0};
+        unsigned int version{0};
+        unsigned long intact_length{0};
+        unsigned long log_ino{0};
+        bool csv_log{false};
+        bool intact_log{true};
+        // Encoded contents of a log in the CSV format, which data points to
+        std::string converted_log{};
+        std::vector<unsigned long> offsets{};
+        // Offsets of the front-coded paths in decoded_paths, or NO_DECODED_PATH if the path is stored completely
+        std::vector<size_t> decoded_path_offsets{};
+        std::string decoded_paths{};
+
+        static constexpr size_t NO_DECODED_PATH = ~0ul;
+    };
+
+
+    // Converts a log in the CSV format and cuts off a damaged end, so that records can be appended again.
+    // Must be called with .fmerge/filechanges.lock held, before the log is written. Returns false if the
+    // log could not be repaired.
+    bool repair_change_log(std::string base_dir);
+    // Returns an empty list if there is no change log yet. A damaged end of the log is skipped.
+    std::vector<Change> read_changes(std::string base_dir);
+    // Same as sort_changes_by_file(read_changes(base_dir)), but each history is read directly through the index
+    // of the log (see ChangeIndex), without looking up the path of every change.
+    SortedChangeSet read_sorted_changes(std::string base_dir);
+    // Only reads the records of the given path, through the index. Empty if the path has no history.
+    std::vector<Change> read_file_history(std::string base_dir, const std::string& file_path);
+    // Replaces the whole change log
+    bool write_changes(std::string base_dir, std::vector<Change> changes);
+    bool append_changes(std::string base_dir, std::vector<Change> new_changes);
+
+}
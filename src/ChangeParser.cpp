@@ -0,0 +1,221 @@
+#include "ChangeParser.h"
+
+#include "Terminal.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <future>
+#include <iterator>
+
+
+namespace fmerge {
+
+    // Lists that are shorter than this are parsed on the calling thread
+    constexpr size_t PARALLEL_MIN_BYTES{1 << 20};
+    // Number of chunks per thread, so that threads that finish early can take over the rest
+    constexpr size_t CHUNKS_PER_THREAD{4};
+
+
+    enum class ParseResult {
+        Parsed,
+        Terminator,
+        Invalid,
+    };
+
+
+    // Parses the number at position, which must be followed by a comma, and moves position past the comma
+    template<typename T>
+    static bool parse_field(const char*& position, const char* end, T& value) {
+        auto [field_end, error] = std::from_chars(position, end, value);
+        if(error != std::errc() || field_end == end || *field_end != ',') {
+            return false;
+        }
+        position = field_end + 1;
+        return true;
+    }
+
+
+    // Parses the entry at position and moves position to the start of the next one. Front-coded paths
+    // are left incomplete: only the stored part is set, after the shared_length bytes it shares with the
+    // path of the previous entry.
+    static ParseResult parse_change(const char*& position, const char* end, int version, Change& change, size_t& shared_length) {
+        int type{};
+        int file_type{};
+        if(!parse_field(position, end, type) || !parse_field(position, end, change.earliest_change_time) ||
+                !parse_field(position, end, change.latest_change_time) || !parse_field(position, end, file_type)) {
+            return ParseResult::Invalid;
+        }
+        change.type = static_cast<ChangeType>(type);
+        change.file.type = static_cast<FileType>(file_type);
+
+        if(version >= 2) {
+            if(!parse_field(position, end, change.mtime_ns) || !parse_field(position, end, change.size) ||
+                    !parse_field(position, end, change.ino) || !parse_field(position, end, change.dev)) {
+                return ParseResult::Invalid;
+            }
+        } else {
+            // Version 1 only knows whole seconds
+            change.mtime_ns = change.earliest_change_time * 1000000000L;
+        }
+        if(version >= 4 && !parse_field(position, end, change.content_hash)) {
+            return ParseResult::Invalid;
+        }
+
+        if(change.type == ChangeType::Move) {
+            // Length-prefixed, since paths may contain commas
+            size_t moved_from_length{};
+            if(!parse_field(position, end, moved_from_length) || static_cast<size_t>(end - position) <= moved_from_length) {
+                return ParseResult::Invalid;
+            }
+            change.moved_from.assign(position, moved_from_length);
+            position += moved_from_length + 1;
+        }
+        shared_length = 0;
+        if(version >= 6 && !parse_field(position, end, shared_length)) {
+            return ParseResult::Invalid;
+        }
+
+        // memchr scans for the line break with vector instructions
+        auto line_end = static_cast<const char*>(memchr(position, '\n', end - position));
+        if(change.type == ChangeType::TerminateList) {
+            position = line_end != nullptr ? line_end + 1 : end;
+            return ParseResult::Terminator;
+        }
+        if(line_end == nullptr) {
+            // The list was cut off within the path
+            return ParseResult::Invalid;
+        }
+        change.file.path.assign(position, line_end - position);
+        position = line_end + 1;
+        return ParseResult::Parsed;
+    }
+
+
+    struct ParsedChunk {
+        std::vector<Change> changes{};
+        // Shared lengths of the first changes, whose paths depend on the path before the chunk. Their paths
+        // only hold the stored part.
+        std::vector<size_t> unresolved{};
+        // Position after the last entry that was parsed
+        size_t end{0};
+        ParseResult result{ParseResult::Parsed};
+    };
+
+
+    // Parses the entries that start before stop. The last one may extend beyond it.
+    static ParsedChunk parse_chunk(std::string_view lines, size_t start, size_t stop, int version) {
+        ParsedChunk chunk{};
+        // Rough estimate of the number of entries
+        chunk.changes.reserve((stop - start) / 96);
+        const char* position = lines.data() + start;
+        const char* end = lines.data() + lines.length();
+        // Only the first chunk knows the path before its first entry, which is empty
+        bool resolved = start == 0;
+        while(position < lines.data() + stop) {
+            Change change{};
+            size_t shared_length{};
+            chunk.result = parse_change(position, end, version, change, shared_length);
+            if(chunk.result != ParseResult::Parsed) {
+                break;
+            }
+            if(shared_length == 0) {
+                resolved = true;
+            } else if(!resolved) {
+                chunk.unresolved.push_back(shared_length);
+            } else {
+                const std::string* previous_path = chunk.changes.empty() ? nullptr : &chunk.changes.back().file.path;
+                if(previous_path == nullptr || shared_length > previous_path->length()) {
+                    chunk.result = ParseResult::Invalid;
+                    break;
+                }
+                change.file.path.insert(0, *previous_path, 0, shared_length);
+            }
+            chunk.changes.push_back(std::move(change));
+        }
+        chunk.end = position - lines.data();
+        return chunk;
+    }
+
+
+    std::vector<Change> parse_changes(std::string_view lines, int version, bool* complete) {
+        if(complete) {
+            *complete = false;
+        }
+
+        // Chunk boundaries are moved to the start of the next line
+        size_t chunk_count{1};
+        if(lines.length() >= PARALLEL_MIN_BYTES && ThreadPool::shared().size() > 1) {
+            chunk_count = ThreadPool::shared().size() * CHUNKS_PER_THREAD;
+        }
+        std::vector<size_t> starts{0};
+        for(size_t i = 1; i < chunk_count; i++) {
+            size_t boundary = std::max(lines.length() * i / chunk_count, starts.back() + 1);
+            size_t line_end = lines.find('\n', boundary - 1);
+            if(line_end == std::string_view::npos) {
+                break;
+            }
+            starts.push_back(line_end + 1);
+        }
+        starts.push_back(lines.length());
+
+        std::vector<ParsedChunk> chunks{};
+        if(starts.size() == 2) {
+            chunks.push_back(parse_chunk(lines, 0, lines.length(), version));
+        } else {
+            std::vector<std::future<ParsedChunk>> parsed_chunks{};
+            for(size_t i = 0; i + 1 < starts.size(); i++) {
+                parsed_chunks.push_back(ThreadPool::shared().submit([lines, start = starts[i], stop = starts[i + 1], version]() {
+                    return parse_chunk(lines, start, stop, version);
+                }));
+            }
+            for(auto& parsed_chunk : parsed_chunks) {
+                chunks.push_back(parsed_chunk.get());
+            }
+        }
+
+        std::vector<Change> changes{};
+        size_t change_count{0};
+        for(const auto& chunk : chunks) {
+            change_count += chunk.changes.size();
+        }
+        changes.reserve(change_count);
+        size_t position{0};
+        for(size_t i = 0; i < chunks.size(); i++) {
+            if(position >= starts[i + 1]) {
+                // The previous chunk already parsed the entry that this one started in
+                continue;
+            }
+            if(position != starts[i]) {
+                // The chunk started within an entry
+                chunks[i] = parse_chunk(lines, position, starts[i + 1], version);
+            }
+            auto& chunk = chunks[i];
+            for(size_t j = 0; j < chunk.unresolved.size(); j++) {
+                const std::string* previous_path = j > 0 ? &chunk.changes[j - 1].file.path :
+                    changes.empty() ? nullptr : &changes.back().file.path;
+                if(previous_path == nullptr || chunk.unresolved[j] > previous_path->length()) {
+                    chunk.changes.resize(j);
+                    chunk.result = ParseResult::Invalid;
+                    break;
+                }
+                chunk.changes[j].file.path.insert(0, *previous_path, 0, chunk.unresolved[j]);
+            }
+            changes.insert(changes.end(), std::make_move_iterator(chunk.changes.begin()), std::make_move_iterator(chunk.changes.end()));
+            position = chunk.end;
+            if(chunk.result == ParseResult::Terminator) {
+                if(complete) {
+                    *complete = true;
+                }
+                return changes;
+            }
+            if(chunk.result == ParseResult::Invalid) {
+                break;
+            }
+        }
+        DEBUG("Could not parse change in line " << (changes.size()+1) << std::endl);
+        return changes;
+    }
+
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "FileTree.h"
+
+#include <string_view>
+#include <vector>
+
+
+namespace fmerge {
+
+    // Parses the entries of a change list in the text form written by serialize_changes, after the header line
+    // that gives the version of the format (see deserialize_changes).
+    //
+    // Large lists are split into chunks that start at line boundaries, which are parsed on the shared thread pool
+    // and concatenated in order. The old path of a move may contain a line break, so a chunk can start inside an
+    // entry. Such a chunk does not begin where the previous one ended and is parsed again from the right position.
+    // The front-coded paths at the start of a chunk, up to the first complete one, are completed once the
+    // previous chunk is known.
+    //
+    // Parsing stops at the first entry that cannot be parsed. complete tells whether
+    // the list was read up to its terminator.
+    std::vector<Change> parse_changes(std::string_view lines, int version, bool* complete = nullptr);
+
+}
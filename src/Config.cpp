@@ -5,6 +5,7 @@
 #include "Util.h"
 
 #include <fstream>
+#include <limits>
 #include <uuid/uuid.h>
 
 
@@ -50,4 +51,38 @@ namespace fmerge {
         return std::nullopt;
     }
 
+
+
+    void set_remote_checkpoint(json &config, const std::string& peer_uuid, long checkpoint_ns) {
+        if(!config.contains("remotes") || !config["remotes"].is_array()) {
+            config["remotes"] = json::array();
+        }
+        for(json& remote : config["remotes"]) {
+            if(remote.value("uuid", "") == peer_uuid) {
+                remote["checkpoint"] = checkpoint_ns;
+                return;
+            }
+        }
+        config["remotes"].push_back(json {
+            {"uuid", peer_uuid},
+            {"checkpoint", checkpoint_ns}
+        });
+    }
+
+
+    optional<long> get_compaction_checkpoint(const json &config) {
+        if(!config.contains("remotes") || !config["remotes"].is_array() || config["remotes"].empty()) {
+            return std::nullopt;
+        }
+        long checkpoint_ns{std::numeric_limits<long>::max()};
+        for(const json& remote : config["remotes"]) {
+            if(!remote.contains("checkpoint")) {
+                // A remote that never completed a sync
+                return std::nullopt;
+            }
+            checkpoint_ns = std::min(checkpoint_ns, remote["checkpoint"].get<long>());
+        }
+        return checkpoint_ns;
+    }
+
 }
\ No newline at end of file
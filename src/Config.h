@@ -12,4 +12,9 @@ namespace fmerge {
     void save_config(std::string path, const json &config);
 
     optional<json> get_remote_config(json config, std::array<unsigned char, 16> peer_uuid);
+
+    // Records that the peer has acknowledged every change that entered the local change log up to checkpoint_ns
+    void set_remote_checkpoint(json &config, const std::string& peer_uuid, long checkpoint_ns);
+    // Changes that were logged up to the returned time are known to all remotes. nullopt if there are none yet.
+    optional<long> get_compaction_checkpoint(const json &config);
 }
\ No newline at end of file
@@ -46,10 +46,15 @@ namespace fmerge {
             listener_thread_handle.join();
         }
         join_finished_workers();
-        
-        if(resp_handler_workers.size() != 0) {
-            std::cerr << "[Error] Connection terminated with " << resp_handler_workers.size() << " living threads!" << std::endl;
-        }   
+
+        // Workers that are still completing their callback have not been added to finished_workers
+        // yet. They must be joined before their std::thread objects are destroyed.
+        for(auto& worker : resp_handler_workers) {
+            if(worker.second.joinable()) {
+                worker.second.join();
+            }
+        }
+        resp_handler_workers.clear();
     }
 
 
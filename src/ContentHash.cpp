@@ -0,0 +1,87 @@
+#include "ContentHash.h"
+
+#include "Errors.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// The hash is compiled into this file, so that it can be inlined
+#define XXH_INLINE_ALL
+#include <xxhash/xxhash.h>
+
+
+namespace fmerge {
+
+    // 0 is reserved for unknown hashes
+    static unsigned long known_hash(XXH64_hash_t hash) {
+        return hash == 0 ? 1 : static_cast<unsigned long>(hash);
+    }
+
+
+    const char* content_hash_kernel() {
+        switch(XXH_VECTOR) {
+        case XXH_SSE2:
+            return "sse2";
+        case XXH_AVX2:
+            return "avx2";
+        case XXH_AVX512:
+            return "avx512";
+        case XXH_NEON:
+            return "neon";
+        default:
+            return "scalar";
+        }
+    }
+
+
+    unsigned long hash_content(const void* data, size_t length) {
+        return known_hash(XXH3_64bits(data, length));
+    }
+
+
+    std::optional<unsigned long> hash_file(const std::string& path, long expected_mtime_ns) {
+        constexpr size_t READ_SIZE{1024 * 1024};
+        // Each hashing thread keeps its buffer, since most files are small
+        thread_local std::vector<unsigned char> read_buffer(READ_SIZE);
+
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if(fd == -1) {
+            print_clib_error("open");
+            return std::nullopt;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        XXH3_state_t state;
+        XXH3_64bits_reset(&state);
+        bool success{true};
+        while(true) {
+            ssize_t n = read(fd, read_buffer.data(), READ_SIZE);
+            if(n == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                print_clib_error("read");
+                success = false;
+                break;
+            }
+            if(n == 0) {
+                break;
+            }
+            XXH3_64bits_update(&state, read_buffer.data(), static_cast<size_t>(n));
+        }
+
+        struct stat stats{};
+        if(success && fstat(fd, &stats) == -1) {
+            print_clib_error("fstat");
+            success = false;
+        }
+        close(fd);
+        if(!success || stats.st_mtim.tv_sec * 1000000000L + stats.st_mtim.tv_nsec != expected_mtime_ns) {
+            return std::nullopt;
+        }
+        return known_hash(XXH3_64bits_digest(&state));
+    }
+
+}
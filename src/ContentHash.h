@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string>
+
+
+namespace fmerge {
+
+    // 64 bit hash of file contents, used to recognize identical file versions. This is XXH3 (see
+    // lib/xxhash), which produces the same result on every host, whichever vector instructions it
+    // was built for.
+    //
+    // Not cryptographic. A value of 0 means that no hash is known.
+    unsigned long hash_content(const void* data, size_t length);
+    // Hashes the contents of a regular file. Returns nullopt if the file could not be read, or if
+    // its modification time is not expected_mtime_ns (anymore), since the hash would not belong
+    // to the version of the file that was recorded.
+    std::optional<unsigned long> hash_file(const std::string& path, long expected_mtime_ns);
+    // Name of the instruction set the hash was built for
+    const char* content_hash_kernel();
+
+}
@@ -0,0 +1,212 @@
+#include "DirCache.h"
+
+#include "Errors.h"
+
+#include <endian.h>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+
+
+namespace fmerge {
+
+    constexpr char DIR_CACHE_MAGIC[4] = {'F', 'M', 'D', 'C'};
+    // Directories that changed less than this long before the scan are not cached (see DirCache)
+    constexpr long RACY_MARGIN_NS = 1000000000L;
+
+
+    // Bounds checked reader for the cache file contents
+    class CacheReader {
+    public:
+        CacheReader(const std::string& _data) : data(_data) {}
+
+        bool read(void* dest, size_t len) {
+            if(data.length() - pos < len) {
+                return false;
+            }
+            memcpy(dest, data.data() + pos, len);
+            pos += len;
+            return true;
+        }
+
+        bool read_string(std::string& dest, size_t len) {
+            if(data.length() - pos < len) {
+                return false;
+            }
+            dest.assign(data, pos, len);
+            pos += len;
+            return true;
+        }
+    private:
+        const std::string& data;
+        size_t pos{0};
+    };
+
+
+    DirCache::DirCache(std::string _cache_path) : cache_path(_cache_path) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        scan_time_ns = now.tv_sec * 1000000000L + now.tv_nsec;
+    }
+
+
+    void DirCache::load() {
+        previous.clear();
+        std::ifstream cache_file(cache_path, std::ios_base::binary);
+        if(!cache_file) {
+            return;
+        }
+        std::stringstream buffer;
+        buffer << cache_file.rdbuf();
+        std::string data = buffer.str();
+        CacheReader reader(data);
+
+        char magic[4];
+        unsigned int version{};
+        unsigned long listing_count{};
+        if(!reader.read(magic, sizeof(magic)) || memcmp(magic, DIR_CACHE_MAGIC, sizeof(magic)) != 0) {
+            std::cerr << "[Warning] Ignoring invalid directory cache " << cache_path << std::endl;
+            return;
+        }
+        if(!reader.read(&version, sizeof(version)) || le32toh(version) != FORMAT_VERSION) {
+            // Written by a different version. It will simply be replaced.
+            return;
+        }
+        if(!reader.read(&listing_count, sizeof(listing_count))) {
+            std::cerr << "[Warning] Ignoring invalid directory cache " << cache_path << std::endl;
+            return;
+        }
+        listing_count = le64toh(listing_count);
+
+        for(unsigned long i = 0; i < listing_count; i++) {
+            unsigned short path_length{};
+            std::string path{};
+            Listing listing{};
+            unsigned int entry_count{};
+            bool ok = reader.read(&path_length, sizeof(path_length));
+            ok = ok && reader.read_string(path, le16toh(path_length));
+            ok = ok && reader.read(&listing.ino, sizeof(listing.ino));
+            ok = ok && reader.read(&listing.mtime_ns, sizeof(listing.mtime_ns));
+            ok = ok && reader.read(&listing.ctime_ns, sizeof(listing.ctime_ns));
+            ok = ok && reader.read(&entry_count, sizeof(entry_count));
+            listing.ino = le64toh(listing.ino);
+            listing.mtime_ns = le64toh(listing.mtime_ns);
+            listing.ctime_ns = le64toh(listing.ctime_ns);
+            entry_count = le32toh(entry_count);
+
+            for(unsigned int j = 0; ok && j < entry_count; j++) {
+                DirEntry entry{};
+                unsigned char type{};
+                unsigned char type_known{};
+                unsigned short name_length{};
+                ok = ok && reader.read(&type, sizeof(type));
+                ok = ok && reader.read(&type_known, sizeof(type_known));
+                ok = ok && reader.read(&entry.ino, sizeof(entry.ino));
+                ok = ok && reader.read(&name_length, sizeof(name_length));
+                ok = ok && reader.read_string(entry.name, le16toh(name_length));
+                entry.type = static_cast<FileType>(type);
+                entry.type_known = type_known != 0;
+                entry.ino = le64toh(entry.ino);
+                listing.entries.push_back(std::move(entry));
+            }
+
+            if(!ok) {
+                std::cerr << "[Warning] Ignoring invalid directory cache " << cache_path << std::endl;
+                previous.clear();
+                return;
+            }
+            previous.emplace(std::move(path), std::move(listing));
+        }
+    }
+
+
+    bool DirCache::save() const {
+        std::unique_lock lk(current_mtx);
+
+        // Written to a temporary file first, so that an interrupted run never leaves a truncated cache
+        std::string tmp_path = cache_path + ".tmp";
+        std::ofstream cache_file(tmp_path, std::ios_base::binary | std::ios_base::trunc);
+        if(!cache_file) {
+            std::cerr << "[Warning] Failed to write directory cache " << tmp_path << std::endl;
+            return false;
+        }
+        auto write = [&cache_file](const void* data, size_t len) {
+            cache_file.write(static_cast<const char*>(data), len);
+        };
+
+        unsigned int version = htole32(FORMAT_VERSION);
+        unsigned long listing_count = htole64(current.size());
+        write(DIR_CACHE_MAGIC, sizeof(DIR_CACHE_MAGIC));
+        write(&version, sizeof(version));
+        write(&listing_count, sizeof(listing_count));
+
+        for(const auto& [path, listing] : current) {
+            unsigned short path_length = htole16(static_cast<unsigned short>(path.length()));
+            unsigned long ino = htole64(listing.ino);
+            long mtime_ns = htole64(listing.mtime_ns);
+            long ctime_ns = htole64(listing.ctime_ns);
+            unsigned int entry_count = htole32(static_cast<unsigned int>(listing.entries.size()));
+            write(&path_length, sizeof(path_length));
+            write(path.c_str(), path.length());
+            write(&ino, sizeof(ino));
+            write(&mtime_ns, sizeof(mtime_ns));
+            write(&ctime_ns, sizeof(ctime_ns));
+            write(&entry_count, sizeof(entry_count));
+
+            for(const auto& entry : listing.entries) {
+                unsigned char type = static_cast<unsigned char>(entry.type);
+                unsigned char type_known = entry.type_known ? 1 : 0;
+                unsigned long entry_ino = htole64(entry.ino);
+                unsigned short name_length = htole16(static_cast<unsigned short>(entry.name.length()));
+                write(&type, sizeof(type));
+                write(&type_known, sizeof(type_known));
+                write(&entry_ino, sizeof(entry_ino));
+                write(&name_length, sizeof(name_length));
+                write(entry.name.c_str(), entry.name.length());
+            }
+        }
+
+        cache_file.close();
+        if(!cache_file) {
+            std::cerr << "[Warning] Failed to write directory cache " << tmp_path << std::endl;
+            return false;
+        }
+        if(rename(tmp_path.c_str(), cache_path.c_str()) == -1) {
+            print_clib_error("rename");
+            return false;
+        }
+        return true;
+    }
+
+
+    const std::vector<DirEntry>* DirCache::lookup(const std::string& relative_path, const FileStats& dir_stats) const {
+        auto it = previous.find(relative_path);
+        if(it == previous.end()) {
+            return nullptr;
+        }
+        const Listing& listing = it->second;
+        if(listing.ino != dir_stats.ino || listing.mtime_ns != dir_stats.mtime_ns || listing.ctime_ns != dir_stats.ctime_ns) {
+            return nullptr;
+        }
+        return &listing.entries;
+    }
+
+
+    void DirCache::store(const std::string& relative_path, const FileStats& dir_stats, std::vector<DirEntry> entries) {
+        if(dir_stats.mtime_ns > scan_time_ns - RACY_MARGIN_NS || dir_stats.ctime_ns > scan_time_ns - RACY_MARGIN_NS) {
+            // The directory may still change without its timestamps changing
+            return;
+        }
+        if(relative_path.length() > 0xFFFF) {
+            return;
+        }
+        std::unique_lock lk(current_mtx);
+        current.insert_or_assign(relative_path, Listing{
+            .ino = dir_stats.ino,
+            .mtime_ns = dir_stats.mtime_ns,
+            .ctime_ns = dir_stats.ctime_ns,
+            .entries = std::move(entries)
+        });
+    }
+
+}
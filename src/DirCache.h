@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Filesystem.h"
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+namespace fmerge {
+
+    // Persistent cache of directory listings, stored in .fmerge/dircache.db.
+    //
+    // A directory only has to be enumerated again if its mtime or ctime changed. Otherwise the
+    // listing of the last run is reused and only the entries themselves are stat'ed.
+    // Listings are only trusted if the directory was last changed clearly before the listing
+    // was read, since a change within the same timestamp tick would go unnoticed otherwise.
+    class DirCache {
+    public:
+        DirCache() = delete;
+        DirCache(std::string _cache_path);
+
+        // Reads the listings of the last run. A missing or corrupt cache file is treated as empty.
+        void load();
+        // Writes the listings stored during this run. The listings of the last run are discarded.
+        bool save() const;
+
+        // Returns the cached listing of the directory, if its metadata still matches
+        const std::vector<DirEntry>* lookup(const std::string& relative_path, const FileStats& dir_stats) const;
+        // Remembers the listing of a directory for the next run. May be called concurrently.
+        void store(const std::string& relative_path, const FileStats& dir_stats, std::vector<DirEntry> entries);
+
+        static constexpr unsigned int FORMAT_VERSION = 1;
+    private:
+        struct Listing {
+            unsigned long ino;
+            long mtime_ns;
+            long ctime_ns;
+            std::vector<DirEntry> entries;
+        };
+
+        std::string cache_path;
+        // Time at which this run started reading directories (ns since epoch)
+        long scan_time_ns;
+
+        std::unordered_map<std::string, Listing> previous;
+        // Filled during the scan
+        mutable std::mutex current_mtx;
+        std::unordered_map<std::string, Listing> current;
+    };
+
+}
@@ -0,0 +1,305 @@
+#include "DirWalker.h"
+
+#include "Errors.h"
+
+#include <fcntl.h>
+#include <thread>
+
+
+namespace fmerge {
+
+    DirWalker::DirHandle::~DirHandle() {
+        if(close(fd) == -1) {
+            print_clib_error("close");
+        }
+    }
+
+
+    DirWalker::DirWalker(std::string _base_path, int _threads, bool _use_io_uring)
+        : base_path(_base_path), threads(_threads), use_io_uring(_use_io_uring) {
+        if(threads <= 0) {
+            threads = static_cast<int>(std::thread::hardware_concurrency());
+        }
+        if(threads <= 0) {
+            threads = 1;
+        }
+    }
+
+
+    void DirWalker::walk(FileCallback f, ProgressCallback progress) {
+        file_callback = f;
+        progress_callback = progress;
+        dirs_read = 0;
+        dirs_discovered = 1;
+
+        queues.clear();
+        for(int i = 0; i < threads; i++) {
+            queues.push_back(std::make_unique<WorkQueue>());
+        }
+        rings.clear();
+        rings.resize(threads);
+        if(use_io_uring) {
+            for(int i = 0; i < threads; i++) {
+                rings[i] = StatxRing::create();
+                if(!rings[i]) {
+                    std::cerr << "[Warning] io_uring is not available. Falling back to synchronous stat calls." << std::endl;
+                    rings.clear();
+                    rings.resize(threads);
+                    break;
+                }
+            }
+        }
+        push_task(0, DirTask{.parent = nullptr, .name = base_path, .relative_path = "", .ignore_state = base_ignore_state});
+
+        if(threads == 1) {
+            // No need to spawn anything
+            worker_function(0);
+            return;
+        }
+
+        std::vector<std::thread> workers;
+        for(int i = 0; i < threads; i++) {
+            workers.push_back(std::thread{[this, i]() { worker_function(i); }});
+        }
+        for(auto& t : workers) {
+            t.join();
+        }
+    }
+
+
+    void DirWalker::worker_function(int tid) {
+        if(threads > 1) {
+            pthread_setname_np(pthread_self(), "fmergescanner");
+        }
+
+        while(true) {
+            DirTask task;
+            if(pop_task(tid, task)) {
+                process_dir(tid, task);
+
+                std::unique_lock lk(idle_mtx);
+                pending_tasks--;
+                if(pending_tasks == 0) {
+                    // We are done. Wake up everybody, so they can exit as well.
+                    idle_cv.notify_all();
+                }
+                continue;
+            }
+
+            // Nothing to do. Wait until some other worker discovers a new directory.
+            std::unique_lock lk(idle_mtx);
+            idle_cv.wait(lk, [this]{ return queued_tasks > 0 || pending_tasks == 0; });
+            if(pending_tasks == 0) {
+                return;
+            }
+        }
+    }
+
+
+    void DirWalker::push_task(int tid, DirTask task) {
+        {
+            std::unique_lock lk(queues[tid]->mtx);
+            queues[tid]->tasks.push_back(std::move(task));
+        }
+        {
+            std::unique_lock lk(idle_mtx);
+            queued_tasks++;
+            pending_tasks++;
+        }
+        idle_cv.notify_one();
+    }
+
+
+    bool DirWalker::pop_task(int tid, DirTask& task) {
+        bool found{false};
+        {
+            // Our own queue is used as a stack (depth first)
+            auto& own_queue = *queues[tid];
+            std::unique_lock lk(own_queue.mtx);
+            if(!own_queue.tasks.empty()) {
+                task = std::move(own_queue.tasks.back());
+                own_queue.tasks.pop_back();
+                found = true;
+            }
+        }
+        // Steal the oldest (and usually largest) directory from another worker
+        for(int i = 1; i < threads && !found; i++) {
+            auto& other_queue = *queues[(tid + i) % threads];
+            std::unique_lock lk(other_queue.mtx);
+            if(!other_queue.tasks.empty()) {
+                task = std::move(other_queue.tasks.front());
+                other_queue.tasks.pop_front();
+                found = true;
+            }
+        }
+
+        if(found) {
+            std::unique_lock lk(idle_mtx);
+            queued_tasks--;
+        }
+        return found;
+    }
+
+
+    void DirWalker::process_dir(int tid, DirTask& task) {
+        std::vector<std::pair<File, FileStats>> entries{};
+        // Names of the subdirectories and the state of the ignore rules for them
+        std::vector<std::pair<std::string, IgnoreRules::State>> subdirs{};
+
+        int fd{};
+        if(task.parent) {
+            fd = openat(task.parent->fd, task.name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        } else {
+            fd = open(task.name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+
+        if(fd == -1) {
+            int open_errno = errno;
+            // The directory itself is still reported, even if we cannot look inside.
+            if(task.parent) {
+                auto stats = get_file_stats_at(task.parent->fd, task.name.c_str());
+                if(stats.has_value()) {
+                    entries.emplace_back(File{.path = task.relative_path, .type = stats->type}, *stats);
+                }
+            }
+            task.parent.reset();
+
+            errno = open_errno;
+            if(errno != ENOTDIR && errno != ELOOP) {
+                print_clib_error("openat");
+                std::cerr << "^^^ occurred for " << join_path(base_path, task.relative_path) << std::endl;
+            }
+            // We have reached the limit on the maximum number of files, globally or for this process.
+            if(errno == ENFILE) {
+                std::cerr << "[Error] System-wide file limit hit." << std::endl;
+                exit(1);
+            } else if(errno == EMFILE) {
+                std::cerr << "[Error] Process file limit hit." << std::endl;
+                exit(1);
+            }
+            report_entries(entries, 0);
+            return;
+        }
+        // Allow the parent to be closed as soon as all its children are open
+        task.parent.reset();
+        auto handle = std::make_shared<DirHandle>(fd);
+
+        // Directories report their own entry, since the open handle can be stat'ed without a path lookup
+        auto dir_stats = get_file_stats_at(fd, "");
+        if(!dir_stats.has_value()) {
+            print_clib_error("statx");
+        } else if(!task.relative_path.empty()) {
+            entries.emplace_back(File{.path = task.relative_path, .type = dir_stats->type}, *dir_stats);
+        }
+
+        std::vector<DirEntry> dir_entries{};
+        const std::vector<DirEntry>* cached_entries{nullptr};
+        if(dir_cache && dir_stats.has_value()) {
+            cached_entries = dir_cache->lookup(task.relative_path, *dir_stats);
+        }
+        bool listed{true};
+        if(cached_entries) {
+            dir_entries = *cached_entries;
+        } else if(!read_dir_entries(fd, dir_entries)) {
+            std::cerr << "^^^ occurred for " << join_path(base_path, task.relative_path) << std::endl;
+            listed = false;
+        }
+        if(listed && dir_cache && dir_stats.has_value()) {
+            // Also carries reused listings over to the next run
+            dir_cache->store(task.relative_path, *dir_stats, dir_entries);
+        }
+
+        // Entries that have to be stat'ed. They are collected first, so that the requests can be batched.
+        std::vector<size_t> stat_indices{};
+        std::vector<const char*> stat_names{};
+        std::vector<IgnoreRules::State> stat_ignore_states{};
+        for(size_t i = 0; i < dir_entries.size(); i++) {
+            auto& entry = dir_entries[i];
+            IgnoreRules::State ignore_state{};
+            if(ignore_rules) {
+                // Ignored entries are skipped before they are stat'ed or descended into. If the
+                // type is not known yet, only the rules that apply to any type can be checked here.
+                ignore_state = ignore_rules->step(task.ignore_state, entry.name);
+                bool is_dir = entry.type_known && entry.type == FileType::Directory;
+                if(ignore_rules->ignored(ignore_state, is_dir)) {
+                    continue;
+                }
+            }
+
+            if(entry.type_known && entry.type == FileType::Directory) {
+                // Stat'ed by the task that reads it
+                subdirs.emplace_back(std::move(entry.name), std::move(ignore_state));
+                continue;
+            }
+            if(entry.type_known && entry.type == FileType::Unknown) {
+                // Special files are reported, but there is nothing worth stat'ing
+                std::string relative_path = task.relative_path.empty() ? entry.name : task.relative_path + "/" + entry.name;
+                entries.emplace_back(File{.path = std::move(relative_path), .type = FileType::Unknown}, FileStats{});
+                continue;
+            }
+            stat_indices.push_back(i);
+            stat_names.push_back(entry.name.c_str());
+            stat_ignore_states.push_back(std::move(ignore_state));
+        }
+
+        std::vector<optional<FileStats>> stat_results{};
+        stat_entries(tid, fd, stat_names, stat_results);
+
+        for(size_t i = 0; i < stat_indices.size(); i++) {
+            auto& entry = dir_entries[stat_indices[i]];
+            auto& stats = stat_results[i];
+            if(!stats.has_value()) {
+                // The file disappeared in the meantime
+                continue;
+            }
+            if(stats->type == FileType::Directory) {
+                // Only happens if the file system does not report entry types
+                if(!ignore_rules || !ignore_rules->ignored(stat_ignore_states[i], true)) {
+                    subdirs.emplace_back(std::move(entry.name), std::move(stat_ignore_states[i]));
+                }
+                continue;
+            }
+            std::string relative_path = task.relative_path.empty() ? entry.name : task.relative_path + "/" + entry.name;
+            entries.emplace_back(File{.path = std::move(relative_path), .type = stats->type}, *stats);
+        }
+
+        report_entries(entries, subdirs.size());
+
+        for(auto& [subdir, ignore_state] : subdirs) {
+            std::string relative_path = task.relative_path.empty() ? subdir : task.relative_path + "/" + subdir;
+            push_task(tid, DirTask{
+                .parent = handle,
+                .name = std::move(subdir),
+                .relative_path = std::move(relative_path),
+                .ignore_state = std::move(ignore_state)
+            });
+        }
+    }
+
+
+    void DirWalker::stat_entries(int tid, int dir_fd, const std::vector<const char*>& names, std::vector<optional<FileStats>>& results) {
+        if(rings[tid]) {
+            rings[tid]->stat_all(dir_fd, names, results);
+            return;
+        }
+        results.clear();
+        results.reserve(names.size());
+        for(const char* name : names) {
+            results.push_back(get_file_stats_at(dir_fd, name));
+        }
+    }
+
+
+    void DirWalker::report_entries(const std::vector<std::pair<File, FileStats>>& entries, size_t new_subdirs) {
+        std::unique_lock lk(callback_mtx);
+        for(const auto& [file, stats] : entries) {
+            file_callback(file, stats);
+        }
+        dirs_read++;
+        dirs_discovered += new_subdirs;
+        if(progress_callback) {
+            progress_callback(dirs_read, dirs_discovered);
+        }
+    }
+
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "DirCache.h"
+#include "Filesystem.h"
+#include "IgnoreRules.h"
+#include "StatxRing.h"
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <vector>
+
+
+namespace fmerge {
+
+    // Multi-threaded directory walker used for the initial scan of the file tree.
+    //
+    // Every worker owns a queue of directories that still have to be read. A worker pushes
+    // and pops at the back of its own queue (depth first, which keeps the number of open
+    // directory handles low), while idle workers steal from the front of the other queues.
+    // Directories are opened with openat() relative to the parent directory handle and read in
+    // large getdents64 batches. The entry type reported by the kernel is used to find the
+    // subdirectories, which stat their own open handle, so only files and links are stat'ed
+    // with statx() and the kernel never has to resolve full paths.
+    //
+    // Optionally, the statx() requests of a directory are submitted as one batch through a
+    // per-worker io_uring instance. The walker falls back to plain statx() calls if io_uring
+    // is not available.
+    //
+    // If a directory cache is given, unchanged directories are not enumerated again. Their entries
+    // are taken from the listing of the last run and only stat'ed.
+    //
+    // Entries matched by the ignore rules are dropped before they are stat'ed, and ignored
+    // directories are never opened.
+    class DirWalker {
+    public:
+        typedef std::function<void(File, const FileStats&)> FileCallback;
+        // Called with the number of directories that have been read and the number of directories
+        // discovered so far. The ratio of the two is a single-pass estimate of the scan progress.
+        typedef std::function<void(size_t, size_t)> ProgressCallback;
+
+        DirWalker() = delete;
+        // A thread count of 0 uses one thread per hardware core
+        DirWalker(std::string _base_path, int _threads = 0, bool _use_io_uring = false);
+
+        // Calls f for every file, directory and link below the base path. Entries of a directory
+        // are always passed before its subdirectories are read. The callbacks are never called
+        // concurrently, so they may modify shared state without locking.
+        void walk(FileCallback f, ProgressCallback progress = nullptr);
+        // The cache must outlive the walk
+        void set_dir_cache(DirCache* cache) { dir_cache = cache; }
+        // The rules must outlive the walk. base_state is the state of the rules for the base path.
+        void set_ignore_rules(const IgnoreRules* rules, IgnoreRules::State base_state) {
+            ignore_rules = rules;
+            base_ignore_state = std::move(base_state);
+        }
+    private:
+        // Open directory file descriptor. It is shared between all pending child directories,
+        // since they are opened relative to it, and closed once the last child has been opened.
+        struct DirHandle {
+            DirHandle(int _fd) : fd(_fd) {}
+            ~DirHandle();
+            int fd;
+        };
+
+        struct DirTask {
+            std::shared_ptr<DirHandle> parent;
+            // Name relative to the parent handle, or the full path for the base directory
+            std::string name;
+            std::string relative_path;
+            IgnoreRules::State ignore_state;
+        };
+
+        struct WorkQueue {
+            std::mutex mtx;
+            std::deque<DirTask> tasks;
+        };
+
+        void worker_function(int tid);
+        void process_dir(int tid, DirTask& task);
+        // Stats the given entries of the open directory with the ring of the worker, if there is one
+        void stat_entries(int tid, int dir_fd, const std::vector<const char*>& names, std::vector<optional<FileStats>>& results);
+        // Passes the entries of one directory to the user callback
+        void report_entries(const std::vector<std::pair<File, FileStats>>& entries, size_t new_subdirs);
+        void push_task(int tid, DirTask task);
+        bool pop_task(int tid, DirTask& task);
+
+        std::string base_path;
+        int threads;
+        bool use_io_uring;
+        DirCache* dir_cache{nullptr};
+        const IgnoreRules* ignore_rules{nullptr};
+        IgnoreRules::State base_ignore_state{};
+
+        std::vector<std::unique_ptr<WorkQueue>> queues;
+        // One ring per worker, or nullptr if the worker stats synchronously
+        std::vector<std::unique_ptr<StatxRing>> rings;
+
+        // Protects queued_tasks and pending_tasks. Idle workers wait on idle_cv.
+        std::mutex idle_mtx;
+        std::condition_variable idle_cv;
+        // Tasks sitting in one of the queues
+        size_t queued_tasks{0};
+        // Tasks that have been queued but are not completely processed yet
+        size_t pending_tasks{0};
+
+        // Serializes the user callbacks
+        std::mutex callback_mtx;
+        FileCallback file_callback;
+        ProgressCallback progress_callback;
+        size_t dirs_read{0};
+        size_t dirs_discovered{0};
+    };
+
+}
@@ -1,244 +1,494 @@
 #include "FileTree.h"
 
+#include "ChangeLog.h"
+#include "ChangeParser.h"
+#include "ContentHash.h"
+#include "DirWalker.h"
+#include "Globals.h"
 #include "Terminal.h"
+#include "ThreadPool.h"
+#include "TreeSnapshot.h"
+#include "Util.h"
 
+#include <endian.h>
 #include <cstring>
+#include <deque>
+#include <unordered_map>
 #include <valarray>
 #include <sstream>
 #include <fstream>
 #include <iomanip>
+#include <limits>
 
 
 namespace fmerge {
 
-    MetadataNode::MetadataNode(std::string _name, FileType _ftype, long _mtime) : mtime(_mtime), ftype(_ftype) {
-        size_t filename_len = _name.length();
-        char* _cname = new char[filename_len + 1];
-        strncpy(_cname, _name.c_str(), filename_len + 1);
-        name = _cname;
+    MetadataNode::MetadataNode(const FileStats& stats) : MetadataNode(stats.type, stats.mtime) {
+        mtime_ns = stats.mtime_ns;
+        ino = stats.ino;
+        dev = stats.dev;
+        size = stats.fsize;
     }
 
 
-    void MetadataNode::serialize(std::ostream& stream) const {
-        unsigned short name_len = static_cast<unsigned short>(strlen(name));
-        stream.write(reinterpret_cast<const char*>(&name_len), sizeof(name_len));
-        stream.write(name, name_len);
-        stream.write(reinterpret_cast<const char*>(&mtime), sizeof(mtime));
-        stream.write(reinterpret_cast<const char*>(&ftype), sizeof(ftype));
+    FileTree::FileTree() : FileTree("", MetadataNode(FileType::Directory, 0)) {}
+
+
+    FileTree::FileTree(std::string root_name, const MetadataNode& root_metadata) {
+        allocate_node(root_name, root_metadata, true);
     }
 
 
-    MetadataNode MetadataNode::deserialize(std::istream& stream) {
-        unsigned short name_len{};
-        stream.read(reinterpret_cast<char*>(&name_len), sizeof(unsigned short));
-        char* name = new char[name_len + 1];
-        stream.read(name, name_len);
-        name[name_len] = '\0';
-        long mtime;
-        FileType ftype;
-        stream.read(reinterpret_cast<char*>(&mtime), sizeof(mtime));
-        stream.read(reinterpret_cast<char*>(&ftype), sizeof(ftype));
+    std::string_view FileTree::name(NodeId node) const {
+        return std::string_view(names.data() + nodes[node].name_offset, nodes[node].name_length);
+    }
+
+
+    FileTree::NodeId FileTree::allocate_node(std::string_view name, const MetadataNode& metadata, bool dir) {
+        unsigned int name_offset = static_cast<unsigned int>(names.size());
+        names.append(name);
+        return allocate_node(name_offset, static_cast<unsigned short>(name.length()), metadata, dir);
+    }
+
+
+    FileTree::NodeId FileTree::allocate_node(unsigned int name_offset, unsigned short name_length, const MetadataNode& metadata, bool dir) {
+        Node node{
+            .metadata = metadata,
+            .name_offset = name_offset,
+            .name_length = name_length,
+            .dir_index = INVALID_NODE
+        };
+
+        if(dir) {
+            if(!free_dirs.empty()) {
+                node.dir_index = free_dirs.back();
+                free_dirs.pop_back();
+            } else {
+                node.dir_index = static_cast<NodeId>(dirs.size());
+                dirs.emplace_back();
+            }
+        }
+
+        if(!free_nodes.empty()) {
+            NodeId id = free_nodes.back();
+            free_nodes.pop_back();
+            nodes[id] = node;
+            return id;
+        }
+        nodes.push_back(node);
+        return static_cast<NodeId>(nodes.size() - 1);
+    }
+
+
+    void FileTree::free_subtree(NodeId node) {
+        NodeId dir_index = nodes[node].dir_index;
+        if(dir_index != INVALID_NODE) {
+            // Moved out, since the recursion may reuse the slot
+            DirChildren children = std::move(dirs[dir_index]);
+            dirs[dir_index] = DirChildren{};
+            for(NodeId subdir : children.subdirs) {
+                free_subtree(subdir);
+            }
+            for(NodeId file : children.files) {
+                free_nodes.push_back(file);
+            }
+            free_dirs.push_back(dir_index);
+        }
+        free_nodes.push_back(node);
+    }
+
+
+    FileTree::NodeId FileTree::find_child(NodeId dir, std::string_view child_name, bool child_is_dir) const {
+        if(dir == INVALID_NODE || !is_dir(dir)) {
+            return INVALID_NODE;
+        }
+        const auto& children = dirs[nodes[dir].dir_index];
+        if(children.index.empty()) {
+            for(NodeId child : child_is_dir ? children.subdirs : children.files) {
+                if(name(child) == child_name) {
+                    return child;
+                }
+            }
+            return INVALID_NODE;
+        }
 
-        return MetadataNode(name, ftype, mtime);
+        // A file and a directory may share a name, so the type has to match as well
+        size_t mask = children.index.size() - 1;
+        for(size_t slot = index_slot(children, child_name); children.index[slot] != INVALID_NODE; slot = (slot + 1) & mask) {
+            NodeId child = children.index[slot];
+            if(is_dir(child) == child_is_dir && name(child) == child_name) {
+                return child;
+            }
+        }
+        return INVALID_NODE;
     }
 
 
-    shared_ptr<MetadataNode> DirNode::get_child_file(std::string file_name) {
-        auto results = std::find_if(this->files.begin(), this->files.end(),
-            [&file_name](shared_ptr<MetadataNode> n) { return n->name == file_name; }
-        );
-        if(results == this->files.end()) {
-            return shared_ptr<MetadataNode>();
+    size_t FileTree::index_slot(const DirChildren& children, std::string_view child_name) const {
+        return std::hash<std::string_view>{}(child_name) & (children.index.size() - 1);
+    }
+
+
+    void FileTree::index_insert(DirChildren& children, NodeId child) {
+        size_t mask = children.index.size() - 1;
+        size_t slot = index_slot(children, name(child));
+        while(children.index[slot] != INVALID_NODE) {
+            slot = (slot + 1) & mask;
         }
-        return *results;
+        children.index[slot] = child;
     }
 
 
-    shared_ptr<MetadataNode> DirNode::get_child_file(std::vector<std::string> path_tokens) {
+    void FileTree::index_remove(DirChildren& children, NodeId child) {
+        size_t mask = children.index.size() - 1;
+        size_t slot = index_slot(children, name(child));
+        while(children.index[slot] != child) {
+            slot = (slot + 1) & mask;
+        }
+        // Without tombstones, the following entries of the cluster have to be moved back into the
+        // hole if it lies between their home slot and their current slot
+        size_t next = slot;
+        while(true) {
+            next = (next + 1) & mask;
+            NodeId entry = children.index[next];
+            if(entry == INVALID_NODE) {
+                break;
+            }
+            size_t home = index_slot(children, name(entry));
+            if(((next - home) & mask) >= ((next - slot) & mask)) {
+                children.index[slot] = entry;
+                slot = next;
+            }
+        }
+        children.index[slot] = INVALID_NODE;
+    }
+
+
+    void FileTree::rebuild_index(DirChildren& children) {
+        // The table is kept at most half full. Its size must be a power of two.
+        size_t entries = children.subdirs.size() + children.files.size();
+        size_t table_size = 2 * INDEX_THRESHOLD;
+        while(table_size < 2 * entries) {
+            table_size *= 2;
+        }
+        children.index.assign(table_size, INVALID_NODE);
+        for(NodeId subdir : children.subdirs) {
+            index_insert(children, subdir);
+        }
+        for(NodeId file : children.files) {
+            index_insert(children, file);
+        }
+    }
+
+
+    FileTree::NodeId FileTree::get_child_file(NodeId dir, std::string_view file_name) const {
+        return find_child(dir, file_name, false);
+    }
+
+
+    FileTree::NodeId FileTree::get_child_file(const std::vector<std::string>& path_tokens) const {
         if(path_tokens.size() == 0) {
-            return shared_ptr<MetadataNode>();
+            return INVALID_NODE;
         }
 
-        auto current_dir = shared_from_this();
+        NodeId current_dir = ROOT;
         for(auto folder = path_tokens.begin(); folder != (path_tokens.end() - 1); folder += 1) {
-            current_dir = current_dir->get_child_dir(*folder);
-            if(!current_dir) {
-                return shared_ptr<MetadataNode>();
+            current_dir = get_child_dir(current_dir, *folder);
+            if(current_dir == INVALID_NODE) {
+                return INVALID_NODE;
             }
         }
-        return current_dir->get_child_file(path_tokens.back());
+        return get_child_file(current_dir, path_tokens.back());
     }
 
 
-    shared_ptr<DirNode> DirNode::get_child_dir(std::string dir_name) {
-        auto results = std::find_if(this->subdirs.begin(), this->subdirs.end(),
-            [&dir_name](shared_ptr<DirNode> n) { return n->metadata->name == dir_name; }
-        );
-        if(results == this->subdirs.end()) {
-            return shared_ptr<DirNode>();
-        }
-        return *results;
+    FileTree::NodeId FileTree::get_child_dir(NodeId dir, std::string_view dir_name) const {
+        return find_child(dir, dir_name, true);
     }
 
 
-    shared_ptr<DirNode> DirNode::get_child_dir(std::vector<std::string> path_tokens) {
-        auto current_dir = shared_from_this();
-        for(auto folder : path_tokens) {
-            current_dir = current_dir->get_child_dir(folder);
-            if(!current_dir) {
-                // Return null
-                return current_dir;
+    FileTree::NodeId FileTree::get_child_dir(const std::vector<std::string>& path_tokens) const {
+        NodeId current_dir = ROOT;
+        for(const auto& folder : path_tokens) {
+            current_dir = get_child_dir(current_dir, folder);
+            if(current_dir == INVALID_NODE) {
+                return INVALID_NODE;
             }
         }
         return current_dir;
     }
 
 
-    bool DirNode::insert_node(std::vector<std::string> path_tokens, std::shared_ptr<DirNode> dir) {
-        if(!dir) {
-            std::cerr << "insert_node: attemped to insert null-dirnode" << std::endl;
-            return false;
+    FileTree::NodeId FileTree::ensure_parent(const std::vector<std::string>& path_tokens) {
+        NodeId current_dir = ROOT;
+        for(auto folder = path_tokens.begin(); folder != (path_tokens.end() - 1); folder += 1) {
+            NodeId next_dir = get_child_dir(current_dir, *folder);
+            if(next_dir == INVALID_NODE) {
+                // Create a temporary parent. Once this parent node is inserted later,
+                // it will receive its proper metadata.
+                next_dir = add_child(current_dir, *folder, MetadataNode(FileType::Directory, 0));
+            }
+            current_dir = next_dir;
         }
-        
-        // Get the parent node of the element to add
-        auto parent_node = get_child_dir(
-            std::vector<std::string>(path_tokens.begin(), path_tokens.end() - 1)
-        );
-
-
-        // Create a temporary parent if missing. Once this parent node is inserted later,
-        // it will receive it's proper metadata.
-        if(!parent_node) {
-            auto missing_node = std::vector<std::string>(path_tokens.begin(), path_tokens.end() - 1);
-            parent_node = std::make_shared<DirNode>(MetadataNode(missing_node.back(), FileType::Directory, 0));
-            insert_node(
-                missing_node,
-                parent_node
-            );
-        }
-
-        auto existing_dir = parent_node->get_child_dir(path_tokens.back());
-        if(!existing_dir) {
-            parent_node->subdirs.push_back(dir);
+        return current_dir;
+    }
+
+
+    FileTree::NodeId FileTree::add_child(NodeId parent, std::string_view name, const MetadataNode& metadata) {
+        NodeId child = allocate_node(name, metadata, metadata.ftype == FileType::Directory);
+        link_child(parent, child);
+        return child;
+    }
+
+
+    void FileTree::link_child(NodeId parent, NodeId child) {
+        // Note: Must not be called while holding a reference into dirs, since allocate_node may reallocate it
+        auto& children = dirs[nodes[parent].dir_index];
+        if(is_dir(child)) {
+            children.subdirs.push_back(child);
         } else {
-            // Update the metadata to match the new node
-            existing_dir->metadata = dir->metadata;
+            children.files.push_back(child);
+        }
+
+        size_t entries = children.subdirs.size() + children.files.size();
+        if(!children.index.empty() && 2 * entries <= children.index.size()) {
+            index_insert(children, child);
+        } else if(entries > INDEX_THRESHOLD) {
+            // Builds the table, or grows it once it is half full
+            rebuild_index(children);
         }
-        return true;
     }
 
 
-    bool DirNode::insert_node(std::vector<std::string> path_tokens, std::shared_ptr<MetadataNode> file) {
-        if(!file) {
-            std::cerr << "insert_node: attemped to insert null-node" << std::endl;
-            return false;
+    FileTree::NodeId FileTree::insert_node(const std::vector<std::string>& path_tokens, const MetadataNode& metadata) {
+        if(path_tokens.empty()) {
+            std::cerr << "insert_node: attempted to insert the root" << std::endl;
+            return INVALID_NODE;
         }
-        
-        // Get the parent node of the element to add
-        auto parent_node = get_child_dir(
-            std::vector<std::string>(path_tokens.begin(), path_tokens.end() - 1)
-        );
-
-        // Create a temporary parent if missing. Once this parent node is inserted later,
-        // it will receive it's proper metadata.
-        if(!parent_node) {
-            auto missing_node = std::vector<std::string>(path_tokens.begin(), path_tokens.end() - 1);
-            parent_node = std::make_shared<DirNode>(MetadataNode(missing_node.back(), FileType::Directory, 0));
-            insert_node(
-                missing_node,
-                parent_node
-            );
-        }
-
-        auto existing_file = parent_node->get_child_file(path_tokens.back());
-        if(!existing_file) {
-            parent_node->files.push_back(file);
+        NodeId parent = ensure_parent(path_tokens);
+
+        NodeId existing{};
+        if(metadata.ftype == FileType::Directory) {
+            existing = get_child_dir(parent, path_tokens.back());
         } else {
+            existing = get_child_file(parent, path_tokens.back());
+        }
+        if(existing != INVALID_NODE) {
             // Update the metadata to match the new node
-            existing_file->mtime = file->mtime;
-            existing_file->ftype = file->ftype;
+            nodes[existing].metadata = metadata;
+            return existing;
         }
-        return true;
+        return add_child(parent, path_tokens.back(), metadata);
     }
 
 
-    bool DirNode::remove_node(std::vector<std::string> path_tokens) {
-       // Get the parent node of the element to remove
-        auto parent_node = get_child_dir(
-            std::vector<std::string>(path_tokens.begin(), path_tokens.end() - 1)
-        );
+    FileTree::NodeId FileTree::insert_subtree(const std::vector<std::string>& path_tokens, const FileTree& other, NodeId other_node) {
+        NodeId node = insert_node(path_tokens, other.metadata(other_node));
+        if(node != INVALID_NODE && other.is_dir(other_node)) {
+            copy_children(node, other, other_node);
+        }
+        return node;
+    }
+
+
+    void FileTree::copy_children(NodeId dir, const FileTree& other, NodeId other_dir) {
+        for(NodeId other_subdir : other.child_dirs(other_dir)) {
+            NodeId subdir = get_child_dir(dir, other.name(other_subdir));
+            if(subdir == INVALID_NODE) {
+                subdir = add_child(dir, other.name(other_subdir), other.metadata(other_subdir));
+            } else {
+                nodes[subdir].metadata = other.metadata(other_subdir);
+            }
+            copy_children(subdir, other, other_subdir);
+        }
+        for(NodeId other_file : other.child_files(other_dir)) {
+            NodeId file = get_child_file(dir, other.name(other_file));
+            if(file == INVALID_NODE) {
+                add_child(dir, other.name(other_file), other.metadata(other_file));
+            } else {
+                nodes[file].metadata = other.metadata(other_file);
+            }
+        }
+    }
+
 
-        if(!parent_node) {
+    bool FileTree::remove_node(const std::vector<std::string>& path_tokens) {
+        if(path_tokens.empty()) {
+            return false;
+        }
+        // Get the parent node of the element to remove
+        NodeId parent = get_child_dir(std::vector<std::string>(path_tokens.begin(), path_tokens.end() - 1));
+        if(parent == INVALID_NODE) {
             // If the parent node does not exist, the file does not either
-            //std::cerr << "Parent node is missing for " << path_tokens.back() << std::endl;
             return true;
-        } 
+        }
 
-        auto existing_file = parent_node->get_child_file(path_tokens.back());
-        if(existing_file) {
-            auto match = std::find(parent_node->files.begin(), parent_node->files.end(), existing_file);
-            // match will always be valid
-            parent_node->files.erase(match);
+        auto& children = dirs[nodes[parent].dir_index];
+        NodeId existing = get_child_file(parent, path_tokens.back());
+        if(existing != INVALID_NODE) {
+            children.files.erase(std::find(children.files.begin(), children.files.end(), existing));
+            if(!children.index.empty()) {
+                index_remove(children, existing);
+            }
+            free_subtree(existing);
             return true;
         }
-        auto existing_dir = parent_node->get_child_dir(path_tokens.back());
-        if(existing_dir) {
-            auto match = std::find(parent_node->subdirs.begin(), parent_node->subdirs.end(), existing_dir);
-            // match will always be valid
-            parent_node->subdirs.erase(match);
+        existing = get_child_dir(parent, path_tokens.back());
+        if(existing != INVALID_NODE) {
+            children.subdirs.erase(std::find(children.subdirs.begin(), children.subdirs.end(), existing));
+            if(!children.index.empty()) {
+                index_remove(children, existing);
+            }
+            free_subtree(existing);
             return true;
         }
-
         return false;
     }
 
 
-    void DirNode::for_node_in_tree(
-        std::function<void(std::vector<std::string>, shared_ptr<MetadataNode>, bool)> f,
-        std::vector<std::string> prefix) {
-
-        for(const auto& subdir : subdirs) {
-            auto dir_path = std::vector<std::string>(prefix);
-            dir_path.push_back(subdir->metadata->name);
-            f(dir_path, subdir->metadata, true);
-            subdir->for_node_in_tree(f, dir_path);
-        }
-        for(const auto& file : files) {
-            auto file_path = std::vector<std::string>(prefix);
-            file_path.push_back(file->name);
-            f(file_path, file, false);
-        }
+    // Fixed size record of a node in a serialized tree (all fields little endian)
+    struct SerializedNode {
+        unsigned int name_offset;
+        unsigned short name_length;
+        unsigned char ftype;
+        unsigned char reserved;
+        // Number of subdirectories and files that follow the record (pre-order)
+        unsigned int subdir_count;
+        unsigned int file_count;
+        long mtime;
+        long mtime_ns;
+        unsigned long ino;
+        unsigned long dev;
+        unsigned long size;
+        unsigned long content_hash;
+    } __attribute__((packed));
+
+
+    void FileTree::serialize(std::ostream& stream) const {
+        // The names of the live nodes are written as one compact block, followed by the records of
+        // all nodes in pre-order. Every directory is followed by its subdirectories, then its files.
+        std::string names_block{};
+        std::vector<SerializedNode> records{};
+        records.reserve(size());
+
+        auto add_record = [&](NodeId node) {
+            const MetadataNode& metadata = nodes[node].metadata;
+            std::string_view node_name = name(node);
+            unsigned int subdir_count{0};
+            unsigned int file_count{0};
+            if(is_dir(node)) {
+                subdir_count = static_cast<unsigned int>(child_dirs(node).size());
+                file_count = static_cast<unsigned int>(child_files(node).size());
+            }
+            records.push_back(SerializedNode{
+                .name_offset = htole32(static_cast<unsigned int>(names_block.size())),
+                .name_length = htole16(static_cast<unsigned short>(node_name.length())),
+                .ftype = static_cast<unsigned char>(metadata.ftype),
+                .reserved = 0,
+                .subdir_count = htole32(subdir_count),
+                .file_count = htole32(file_count),
+                .mtime = static_cast<long>(htole64(metadata.mtime)),
+                .mtime_ns = static_cast<long>(htole64(metadata.mtime_ns)),
+                .ino = htole64(metadata.ino),
+                .dev = htole64(metadata.dev),
+                .size = htole64(metadata.size),
+                .content_hash = htole64(metadata.content_hash),
+            });
+            names_block.append(node_name);
+        };
+        add_record(ROOT);
+        for_each_node([&add_record](std::string_view, NodeId node) {
+            add_record(node);
+        });
+
+        unsigned long node_count = htole64(records.size());
+        unsigned long names_size = htole64(names_block.size());
+        stream.write(reinterpret_cast<const char*>(&node_count), sizeof(node_count));
+        stream.write(reinterpret_cast<const char*>(&names_size), sizeof(names_size));
+        stream.write(names_block.data(), names_block.size());
+        stream.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(SerializedNode));
     }
 
 
-    void DirNode::serialize(std::ostream& stream) const {
-        metadata->serialize(stream);
-        size_t subdirs_len = subdirs.size();
-        size_t files_len = files.size();
-        stream.write(reinterpret_cast<const char*>(&subdirs_len), sizeof(size_t));
-        stream.write(reinterpret_cast<const char*>(&files_len), sizeof(size_t));
-        for(auto subdir : subdirs) {
-            subdir->serialize(stream);
+    std::optional<FileTree> FileTree::deserialize(std::istream& stream) {
+        unsigned long node_count{};
+        unsigned long names_size{};
+        stream.read(reinterpret_cast<char*>(&node_count), sizeof(node_count));
+        stream.read(reinterpret_cast<char*>(&names_size), sizeof(names_size));
+        node_count = le64toh(node_count);
+        names_size = le64toh(names_size);
+        // Node ids and name offsets are 32 bit
+        if(!stream || node_count == 0 || node_count >= INVALID_NODE || names_size > 0xFFFFFFFFul) {
+            return std::nullopt;
         }
-        for(auto file : files) {
-            file->serialize(stream);
+        // Corrupt counts must not cause huge allocations
+        std::streampos start = stream.tellg();
+        if(start != std::streampos(-1)) {
+            stream.seekg(0, std::ios_base::end);
+            unsigned long remaining = static_cast<unsigned long>(stream.tellg() - start);
+            stream.seekg(start);
+            if(remaining < names_size || (remaining - names_size) / sizeof(SerializedNode) < node_count) {
+                return std::nullopt;
+            }
         }
-    }
-
 
-    shared_ptr<DirNode> DirNode::deserialize(std::istream& stream) {
-        auto new_node = std::make_shared<DirNode>(MetadataNode::deserialize(stream));
-        size_t num_subdirs{};
-        size_t num_files{};
-        stream.read(reinterpret_cast<char*>(&num_subdirs), sizeof(num_subdirs));
-        stream.read(reinterpret_cast<char*>(&num_files), sizeof(num_files));
-        for(size_t i = 0; i < num_subdirs; i++) {
-            new_node->subdirs.push_back(DirNode::deserialize(stream));
+        FileTree tree{};
+        tree.names.resize(names_size);
+        stream.read(tree.names.data(), names_size);
+        std::vector<SerializedNode> records(node_count);
+        stream.read(reinterpret_cast<char*>(records.data()), node_count * sizeof(SerializedNode));
+        if(!stream) {
+            return std::nullopt;
+        }
+        tree.nodes.reserve(node_count);
+
+        auto read_metadata = [](const SerializedNode& record) {
+            MetadataNode metadata(static_cast<FileType>(record.ftype), static_cast<long>(le64toh(record.mtime)));
+            metadata.mtime_ns = static_cast<long>(le64toh(record.mtime_ns));
+            metadata.ino = le64toh(record.ino);
+            metadata.dev = le64toh(record.dev);
+            metadata.size = le64toh(record.size);
+            metadata.content_hash = le64toh(record.content_hash);
+            return metadata;
+        };
+        auto valid_name = [&tree](const SerializedNode& record) {
+            return static_cast<unsigned long>(le32toh(record.name_offset)) + le16toh(record.name_length) <= tree.names.size();
+        };
+
+        const SerializedNode& root = records[0];
+        if(!valid_name(root)) {
+            return std::nullopt;
         }
-        for(size_t i = 0; i < num_files; i++) {
-            new_node->files.push_back(std::make_shared<MetadataNode>(MetadataNode::deserialize(stream)));
+        tree.nodes[ROOT].metadata = read_metadata(root);
+        tree.nodes[ROOT].name_offset = le32toh(root.name_offset);
+        tree.nodes[ROOT].name_length = le16toh(root.name_length);
+
+        // Reads the children of dir, starting at the record after next. Returns false if the records are inconsistent.
+        size_t next{1};
+        std::function<bool(NodeId, const SerializedNode&)> read_children = [&](NodeId dir, const SerializedNode& dir_record) {
+            unsigned int subdir_count = le32toh(dir_record.subdir_count);
+            unsigned int file_count = le32toh(dir_record.file_count);
+            for(unsigned long i = 0; i < static_cast<unsigned long>(subdir_count) + file_count; i++) {
+                if(next >= records.size()) {
+                    return false;
+                }
+                const SerializedNode& record = records[next++];
+                bool child_is_dir = i < subdir_count;
+                if(!valid_name(record) || (!child_is_dir && (record.subdir_count != 0 || record.file_count != 0))) {
+                    return false;
+                }
+                NodeId child = tree.allocate_node(le32toh(record.name_offset), le16toh(record.name_length), read_metadata(record), child_is_dir);
+                tree.link_child(dir, child);
+                if(child_is_dir && !read_children(child, record)) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        if(!read_children(ROOT, root) || next != records.size()) {
+            return std::nullopt;
         }
-        return new_node;
+        return tree;
     }
 
 
@@ -253,6 +503,12 @@ namespace fmerge {
         case ChangeType::Deletion:
             os << "Deletion";
             break;
+        case ChangeType::Move:
+            os << "Move";
+            break;
+        case ChangeType::Checkpoint:
+            os << "Checkpoint";
+            break;
         default:
             os << "Unknown Change";
         }
@@ -270,6 +526,9 @@ namespace fmerge {
         if(lhs.latest_change_time != rhs.latest_change_time) {
             return false;
         }
+        if(lhs.mtime_ns != rhs.mtime_ns) {
+            return false;
+        }
         if(lhs.type != rhs.type) {
             return false;
         }
@@ -286,99 +545,66 @@ namespace fmerge {
     }
 
 
-    void Change::serialize(std::ostream& stream) const {
+    void Change::serialize(std::ostream& stream, std::string_view previous_path) const {
         stream << static_cast<int>(type) << ",";
         stream << earliest_change_time << ",";
         stream << latest_change_time << ",";
         stream << static_cast<int>(file.type) << ",";
-        stream << file.path << std::endl; 
-    }
-
-
-    std::optional<Change> Change::deserialize(std::istream& stream) {
-        Change ret{};
-        std::stringbuf buffer{};
-
-        try {
-            stream.get(buffer, ',');
-            stream.seekg(1, std::ios_base::cur); // Seek to after the delimiter
-            ret.type = static_cast<ChangeType>(std::stoi(buffer.str()));
-            buffer.str("");
-
-            stream.get(buffer, ',');
-            stream.seekg(1, std::ios_base::cur); // Seek to after the delimiter
-            ret.earliest_change_time = std::stol(buffer.str());
-            buffer.str("");
-
-            stream.get(buffer, ',');
-            stream.seekg(1, std::ios_base::cur); // Seek to after the delimiter
-            ret.latest_change_time = std::stol(buffer.str());
-            buffer.str("");
-
-            stream.get(buffer, ',');
-            stream.seekg(1, std::ios_base::cur); // Seek to after the delimiter
-            ret.file.type = static_cast<FileType>(std::stoi(buffer.str()));
-            buffer.str("");
-
-            stream.get(buffer, '\n');
-            stream.seekg(1, std::ios_base::cur); // Seek to after the delimiter
-            ret.file.path = buffer.str();
-
-            return ret;
-        } catch(...) {
-            return std::nullopt;
+        stream << mtime_ns << ",";
+        stream << size << ",";
+        stream << ino << ",";
+        stream << dev << ",";
+        stream << content_hash << ",";
+        if(type == ChangeType::Move) {
+            // Paths may contain commas, so the old path is prefixed with its length
+            stream << moved_from.length() << "," << moved_from << ",";
         }
+        auto shared = std::mismatch(previous_path.begin(), previous_path.end(), file.path.begin(), file.path.end());
+        size_t shared_length = shared.first - previous_path.begin();
+        stream << shared_length << "," << std::string_view(file.path).substr(shared_length) << std::endl; 
     }
 
 
-    void update_file_tree(shared_ptr<DirNode> base_node, std::string base_path, bool show_loading_bar) {        
-        // Create file number total for loading bar
-        unsigned int total_number_files{0};
-        if(show_loading_bar) {
-            for_file_in_dir(base_path,
-                [&total_number_files](auto file, auto) {
-                    if(file_ignored(file)) {
-                        return;
-                    }
-                    total_number_files++;
-                }
-            );
-        }
-
-
+    void update_file_tree(FileTree& tree, std::string base_path, bool show_loading_bar, DirCache* dir_cache,
+        const IgnoreRules* ignore_rules, std::string relative_base) {        
         if(show_loading_bar) {
             term()->start_progress_bar("Building File Tree");
         }
 
-        unsigned int num_files_processed{0};
-        for_file_in_dir(base_path,
-            [=, &num_files_processed](auto file, const FileStats& stats) {
-                if(file_ignored(file)) {
-                    return;
+        // The progress is estimated from the number of directories that have been read versus the
+        // number of directories discovered so far, which does not require a separate counting pass.
+        DirWalker::ProgressCallback progress{nullptr};
+        if(show_loading_bar) {
+            progress = [](size_t dirs_read, size_t dirs_discovered) {
+                if((dirs_read % 64) == 0) {
+                    term()->update_progress_bar(static_cast<float>(dirs_read) / static_cast<float>(dirs_discovered));
                 }
+            };
+        }
 
-                if(show_loading_bar && (num_files_processed % 100) == 0) {
-                    // Go back to previous line
-                    term()->update_progress_bar(static_cast<float>(num_files_processed) / static_cast<float>(total_number_files));
-                }
-                num_files_processed++;
+        // Without user rules, the built-in rules still keep .fmerge out of the tree
+        IgnoreRules builtin_rules{};
+        if(!ignore_rules) {
+            ignore_rules = &builtin_rules;
+        }
 
-                auto path_tokens = split_path(file.path);
+        DirWalker walker(base_path, g_scan_threads, g_scan_io_uring);
+        walker.set_dir_cache(dir_cache);
+        walker.set_ignore_rules(ignore_rules, ignore_rules->state_for(relative_base));
+        auto base_tokens = split_path(relative_base);
+        walker.walk(
+            [&tree, &base_tokens](auto file, const FileStats& stats) {
+                auto path_tokens = base_tokens;
+                auto file_tokens = split_path(file.path);
+                path_tokens.insert(path_tokens.end(), file_tokens.begin(), file_tokens.end());
                 // LOG("Added " << path_tokens.back() << std::endl);
 
-                if(file.is_dir()) {
-                    base_node->insert_node(path_tokens, 
-                        std::make_shared<DirNode>(MetadataNode(path_tokens.back(), stats.type, stats.mtime))
-                    );
-                } else if(file.is_file() || file.is_link()) {
-                    base_node->insert_node(path_tokens,
-                        std::make_shared<MetadataNode>(path_tokens.back(), stats.type, stats.mtime)
-                    );
+                if(file.is_dir() || file.is_file() || file.is_link()) {
+                    tree.insert_node(path_tokens, MetadataNode(stats));
                 } else {
                     std::cerr << "[Error] " << file.path << ": Unknown file type (" << static_cast<int>(stats.type) << std::endl;
                 }
-            }
-        );
+            }, progress);
         
         if(show_loading_bar) {
             term()->complete_progress_bar();
@@ -386,7 +612,34 @@ namespace fmerge {
     }
 
 
-    std::vector<Change> compare_metadata(shared_ptr<MetadataNode> from_node, shared_ptr<MetadataNode> to_node, std::string path) {
+    // Creates a change that refers to the version of the file described by node
+    static Change make_change(ChangeType type, long earliest_change_time, long latest_change_time, std::string_view path, const MetadataNode& node) {
+        return Change {
+            .type = type,
+            .earliest_change_time = earliest_change_time,
+            .latest_change_time = latest_change_time,
+            .file = File{.path=std::string(path), .type=node.ftype},
+            .mtime_ns = node.mtime_ns,
+            .size = node.size,
+            .ino = node.ino,
+            .dev = node.dev,
+            .content_hash = node.content_hash,
+        };
+    }
+
+
+    // Compares the modification times of two versions of a file with nanosecond precision.
+    // Versions recorded by older releases only carry whole seconds. They are considered equal to
+    // any version within the same second.
+    static long compare_mtime(const MetadataNode& from_node, const MetadataNode& to_node) {
+        if(from_node.mtime_ns % 1000000000L == 0) {
+            return to_node.mtime_ns / 1000000000L - from_node.mtime_ns / 1000000000L;
+        }
+        return to_node.mtime_ns - from_node.mtime_ns;
+    }
+
+
+    std::vector<Change> compare_metadata(const MetadataNode* from_node, const MetadataNode* to_node, std::string_view path) {
         // Logic to determine what has changed.
         // This is one of the most critical parts of this application
         
@@ -398,32 +651,18 @@ namespace fmerge {
             // The type of object differs. This means the previous was deleted, and the latter was created
             if(from_node->ftype != to_node->ftype) {
                 return {
-                    Change {
-                        .type = ChangeType::Deletion,
-                        .earliest_change_time = from_node->mtime,
-                        .latest_change_time = to_node->mtime,
-                        .file = File{.path=path, .type=from_node->ftype}
-                    },
-                    Change {
-                        .type = ChangeType::Modification,
-                        .earliest_change_time = to_node->mtime,
-                        .latest_change_time = 0,
-                        .file = File{.path=path, .type=to_node->ftype}
-                    }
+                    make_change(ChangeType::Deletion, from_node->mtime, to_node->mtime, path, *from_node),
+                    make_change(ChangeType::Modification, to_node->mtime, 0, path, *to_node)
                 };
             }
             // Both objects exist and are file-like
             // Compare modification times for files
-            if(from_node->mtime < to_node->mtime) {
-                return {Change {
-                    .type = ChangeType::Modification,
-                    .earliest_change_time = to_node->mtime,
-                    .latest_change_time = 0,
-                    .file = File{.path=path, .type=to_node->ftype}
-                }};
-            } else if(from_node->mtime > to_node->mtime) {
-                termbuf() << "[Warning] Modification time of " << path << " lies " << 
-                    from_node->mtime - to_node->mtime << "s in the future!" << std::endl;
+            auto mtime_diff = compare_mtime(*from_node, *to_node);
+            if(mtime_diff > 0) {
+                return {make_change(ChangeType::Modification, to_node->mtime, 0, path, *to_node)};
+            } else if(mtime_diff < 0) {
+                LOG("[Warning] Modification time of " << path << " lies " <<
+                    from_node->mtime - to_node->mtime << "s in the future!" << std::endl);
                 return {};
             } else {
                 return {};
@@ -431,21 +670,11 @@ namespace fmerge {
         }
 
         if(from_node && !to_node) {
-            return {Change {
-                .type = ChangeType::Deletion,
-                .earliest_change_time = from_node->mtime,
-                .latest_change_time = get_timestamp_now(),
-                .file = {.path=path, .type=from_node->ftype},
-            }};
+            return {make_change(ChangeType::Deletion, from_node->mtime, get_timestamp_now(), path, *from_node)};
         }
 
         if(to_node && !from_node) {
-            return {Change {
-                .type = ChangeType::Modification,
-                .earliest_change_time = to_node->mtime,
-                .latest_change_time = 0,
-                .file = {.path=path, .type=to_node->ftype},
-            }};
+            return {make_change(ChangeType::Modification, to_node->mtime, 0, path, *to_node)};
         }
 
         std::cerr << "[Error] Change could not be properly identified!" << std::endl;
@@ -453,73 +682,331 @@ namespace fmerge {
     }
 
 
-    std::vector<Change> compare_trees(shared_ptr<DirNode> from_tree, shared_ptr<DirNode> to_tree) {
-        std::vector<Change> changes;
-        // Check for things that have changed that are present in the old tree
-        from_tree->for_node_in_tree(
-            [to_tree, &changes](std::vector<std::string> path, shared_ptr<MetadataNode> from_metadata, bool is_dir) { 
-                shared_ptr<MetadataNode> to_metadata;
-                if(is_dir) {
-                    auto to_dir = to_tree->get_child_dir(path);
-                    if(to_dir) {
-                        to_metadata = to_dir->metadata;
-                    } else {
-                        to_metadata = shared_ptr<MetadataNode>{};
-                    }
-                } else {
-                    to_metadata = to_tree->get_child_file(path);
+    // The parallel comparison hands every directory at this depth to the thread pool
+    constexpr size_t PARALLEL_SPLIT_DEPTH{2};
+    // Smaller comparisons are not worth the overhead of the thread pool
+    constexpr size_t PARALLEL_MIN_NODES{16384};
+
+
+    // Walks both trees at the same time. The children of every pair of directories are sorted by
+    // name and merged like two sorted lists, so that each node is visited exactly once and no
+    // path has to be looked up from the root. The path of the current node is kept in one buffer.
+    //
+    // With a thread pool, the subtrees at PARALLEL_SPLIT_DEPTH are compared by separate tasks.
+    // The walk remembers where the changes of each task belong in its own lists, and splices
+    // them in at the end, so the result does not depend on the number of threads.
+    class TreeComparison {
+    public:
+        TreeComparison(const FileTree& _from_tree, const FileTree& _to_tree, ThreadPool* _pool = nullptr)
+            : from_tree(_from_tree), to_tree(_to_tree), pool(_pool) {}
+
+        std::vector<Change> run() {
+            compare_dirs(FileTree::ROOT, FileTree::ROOT);
+            if(!subtasks.empty()) {
+                splice_subtasks();
+            }
+            changes.insert(changes.end(), creations.begin(), creations.end());
+            return std::move(changes);
+        }
+    private:
+        typedef FileTree::NodeId NodeId;
+
+        struct SubtaskResult {
+            std::vector<Change> changes;
+            std::vector<Change> creations;
+        };
+
+        struct Subtask {
+            // Position of the subtree in the lists of the parent walk
+            size_t changes_pos;
+            size_t creations_pos;
+            std::future<SubtaskResult> result;
+        };
+
+        // Either directory may be INVALID_NODE if it only exists in one of the trees
+        void compare_dirs(NodeId from_dir, NodeId to_dir) {
+            static const std::vector<NodeId> no_children{};
+            merge_children(
+                from_dir != FileTree::INVALID_NODE ? from_tree.child_dirs(from_dir) : no_children,
+                to_dir != FileTree::INVALID_NODE ? to_tree.child_dirs(to_dir) : no_children,
+                true);
+            merge_children(
+                from_dir != FileTree::INVALID_NODE ? from_tree.child_files(from_dir) : no_children,
+                to_dir != FileTree::INVALID_NODE ? to_tree.child_files(to_dir) : no_children,
+                false);
+        }
+
+        void merge_children(const std::vector<NodeId>& from_children, const std::vector<NodeId>& to_children, bool is_dir) {
+            // A directory that did not change usually lists its children in the same order in both
+            // trees, since the change log is written in the order of the scan. The common prefix is
+            // paired up directly, and only the rest has to be sorted. Names are unique within a
+            // list, so the rest cannot contain a name from the prefix.
+            size_t common{0};
+            while(common < from_children.size() && common < to_children.size()
+                && from_tree.name(from_children[common]) == to_tree.name(to_children[common])) {
+                visit_pair(from_children[common], to_children[common], is_dir);
+                common++;
+            }
+
+            // If one side is empty, nothing has to be merged and the insertion order is kept, which
+            // matches the order of for_each_node (see compare_nodes)
+            auto from_begin = from_children.begin() + common;
+            auto from_end = from_children.end();
+            auto to_begin = to_children.begin() + common;
+            auto to_end = to_children.end();
+            if(from_begin != from_end && to_begin != to_end) {
+                if(sort_buffers.size() <= depth) {
+                    sort_buffers.resize(depth + 1);
                 }
-                auto new_changes = compare_metadata(from_metadata, to_metadata, path_to_str(path));
-                changes.insert(changes.end(), new_changes.begin(), new_changes.end());
-            }
-        );
-
-        // Check for things that are new that are only in the new tree
-        to_tree->for_node_in_tree(
-            [from_tree, &changes](std::vector<std::string> path, shared_ptr<MetadataNode> to_metadata, bool is_dir) { 
-                shared_ptr<MetadataNode> from_metadata;
-                if(is_dir) {
-                    auto to_dir = from_tree->get_child_dir(path);
-                    if(to_dir) {
-                        from_metadata = to_dir->metadata;
-                    } else {
-                        from_metadata = shared_ptr<MetadataNode>{};
-                    }
+                auto& [from_buffer, to_buffer] = sort_buffers[depth];
+                sort_by_name(from_tree, from_begin, from_end, from_buffer);
+                sort_by_name(to_tree, to_begin, to_end, to_buffer);
+                from_begin = from_buffer.begin();
+                from_end = from_buffer.end();
+                to_begin = to_buffer.begin();
+                to_end = to_buffer.end();
+            }
+
+            while(from_begin != from_end || to_begin != to_end) {
+                int order{};
+                if(from_begin == from_end) {
+                    order = 1;
+                } else if(to_begin == to_end) {
+                    order = -1;
                 } else {
-                    from_metadata = from_tree->get_child_file(path);
+                    order = from_tree.name(*from_begin).compare(to_tree.name(*to_begin));
                 }
-                
-                // The only change we are looking for is file and folder creations
-                if(!from_metadata && to_metadata) {
-                    changes.push_back(Change{
-                        .type = ChangeType::Creation,
-                        .earliest_change_time = to_metadata->mtime,
-                        .latest_change_time = 0,
-                        .file = {.path=path_to_str(path), .type=to_metadata->ftype},
-                    });
+                NodeId from_node = order <= 0 ? *(from_begin++) : FileTree::INVALID_NODE;
+                NodeId to_node = order >= 0 ? *(to_begin++) : FileTree::INVALID_NODE;
+                visit_pair(from_node, to_node, is_dir);
+            }
+        }
+
+        // Either node may be INVALID_NODE, but not both
+        void visit_pair(NodeId from_node, NodeId to_node, bool is_dir) {
+            size_t parent_length = path.length();
+            if(from_node != FileTree::INVALID_NODE) {
+                from_tree.append_name(path, from_node);
+            } else {
+                to_tree.append_name(path, to_node);
+            }
+            compare_nodes(from_node, to_node, is_dir);
+            path.resize(parent_length);
+        }
+
+        void compare_nodes(NodeId from_node, NodeId to_node, bool is_dir) {
+            if(from_node != FileTree::INVALID_NODE) {
+                const MetadataNode* to_metadata = to_node != FileTree::INVALID_NODE ? &to_tree.metadata(to_node) : nullptr;
+                add_changes(compare_metadata(&from_tree.metadata(from_node), to_metadata, path));
+            } else {
+                add_creation(path, to_tree.metadata(to_node));
+            }
+            if(!is_dir) {
+                return;
+            }
+            bool split = pool && depth + 1 <= PARALLEL_SPLIT_DEPTH;
+            if(split && depth + 1 == PARALLEL_SPLIT_DEPTH) {
+                submit_subtask(from_node, to_node);
+                return;
+            }
+            if(!split && from_node == FileTree::INVALID_NODE) {
+                // Everything below was created. Nothing has to be merged.
+                to_tree.for_each_node(to_node, path, [this](std::string_view node_path, NodeId node) {
+                    add_creation(node_path, to_tree.metadata(node));
+                });
+                return;
+            }
+            if(!split && to_node == FileTree::INVALID_NODE) {
+                from_tree.for_each_node(from_node, path, [this](std::string_view node_path, NodeId node) {
+                    add_changes(compare_metadata(&from_tree.metadata(node), nullptr, node_path));
+                });
+                return;
+            }
+            depth++;
+            compare_dirs(from_node, to_node);
+            depth--;
+        }
+
+        void submit_subtask(NodeId from_dir, NodeId to_dir) {
+            auto result = pool->submit([this, from_dir, to_dir, subtree_path = path]() {
+                TreeComparison subtree(from_tree, to_tree);
+                subtree.path = subtree_path;
+                subtree.compare_dirs(from_dir, to_dir);
+                return SubtaskResult{.changes = std::move(subtree.changes), .creations = std::move(subtree.creations)};
+            });
+            subtasks.push_back(Subtask{
+                .changes_pos = changes.size(),
+                .creations_pos = creations.size(),
+                .result = std::move(result)
+            });
+        }
+
+        void splice_subtasks() {
+            std::vector<Change> all_changes{};
+            std::vector<Change> all_creations{};
+            size_t changes_pos{0};
+            size_t creations_pos{0};
+            for(auto& subtask : subtasks) {
+                auto result = subtask.result.get();
+                all_changes.insert(all_changes.end(), changes.begin() + changes_pos, changes.begin() + subtask.changes_pos);
+                all_changes.insert(all_changes.end(), result.changes.begin(), result.changes.end());
+                all_creations.insert(all_creations.end(), creations.begin() + creations_pos, creations.begin() + subtask.creations_pos);
+                all_creations.insert(all_creations.end(), result.creations.begin(), result.creations.end());
+                changes_pos = subtask.changes_pos;
+                creations_pos = subtask.creations_pos;
+            }
+            all_changes.insert(all_changes.end(), changes.begin() + changes_pos, changes.end());
+            all_creations.insert(all_creations.end(), creations.begin() + creations_pos, creations.end());
+            changes = std::move(all_changes);
+            creations = std::move(all_creations);
+            subtasks.clear();
+        }
+
+        void add_changes(const std::vector<Change>& new_changes) {
+            changes.insert(changes.end(), new_changes.begin(), new_changes.end());
+        }
+
+        void add_creation(std::string_view node_path, const MetadataNode& metadata) {
+            creations.push_back(make_change(ChangeType::Creation, metadata.mtime, 0, node_path, metadata));
+        }
+
+        static void sort_by_name(const FileTree& tree, std::vector<NodeId>::const_iterator begin,
+            std::vector<NodeId>::const_iterator end, std::vector<NodeId>& sorted) {
+            sorted.assign(begin, end);
+            std::sort(sorted.begin(), sorted.end(), [&tree](NodeId lhs, NodeId rhs) {
+                return tree.name(lhs) < tree.name(rhs);
+            });
+        }
+
+        const FileTree& from_tree;
+        const FileTree& to_tree;
+        ThreadPool* pool;
+        // Depth of the directory whose children are being compared
+        size_t depth{0};
+        std::string path{};
+        std::vector<Change> changes{};
+        std::vector<Change> creations{};
+        std::vector<Subtask> subtasks{};
+        // Sorted children of the directories that are being merged, one pair per depth. A deque
+        // keeps the buffers of the outer directories in place while the walk descends.
+        std::deque<std::pair<std::vector<NodeId>, std::vector<NodeId>>> sort_buffers{};
+    };
+
+
+    std::vector<Change> compare_trees(const FileTree& from_tree, const FileTree& to_tree, bool parallel) {
+        ThreadPool* pool{nullptr};
+        if(parallel && from_tree.size() + to_tree.size() >= PARALLEL_MIN_NODES && ThreadPool::shared().size() > 1) {
+            pool = &ThreadPool::shared();
+        }
+        return TreeComparison(from_tree, to_tree, pool).run();
+    }
+
+
+    void detect_moves(std::vector<Change>& changes) {
+        // Inodes of the removed files. Logs of old versions carry no inodes.
+        std::unordered_multimap<unsigned long, const Change*> deleted_files{};
+        for(const auto& change : changes) {
+            if(change.type == ChangeType::Deletion && change.file.is_file() && change.ino != 0) {
+                deleted_files.emplace(change.ino, &change);
+            }
+        }
+        if(deleted_files.empty()) {
+            return;
+        }
+
+        for(auto& change : changes) {
+            if((change.type != ChangeType::Creation && change.type != ChangeType::Modification) || !change.file.is_file()) {
+                continue;
+            }
+            auto [begin, end] = deleted_files.equal_range(change.ino);
+            for(auto deleted = begin; deleted != end; deleted++) {
+                const auto& deletion = *deleted->second;
+                // The inode could have been reused by a new file
+                if(deletion.dev == change.dev && deletion.size == change.size && deletion.mtime_ns == change.mtime_ns &&
+                    deletion.file.path != change.file.path) {
+                    change.type = ChangeType::Move;
+                    change.moved_from = deletion.file.path;
+                    change.content_hash = deletion.content_hash;
+                    // Each removed file can only have been moved once
+                    deleted_files.erase(deleted);
+                    break;
                 }
             }
-        );
+        }
+    }
 
-        return changes;
+
+    // Files are hashed in batches, so that small files do not cost a task each
+    constexpr size_t HASH_BATCH_SIZE{64};
+
+
+    void hash_file_versions(const std::string& base_path, const std::vector<Change*>& changes, HashCache& cache) {
+        if(changes.empty()) {
+            return;
+        }
+        DEBUG("Hashing " << changes.size() << " files (" << content_hash_kernel() << ")" << std::endl);
+
+        auto hash_batch = [&base_path, &changes, &cache](size_t begin, size_t end) {
+            for(size_t i = begin; i < end; i++) {
+                auto& change = *changes[i];
+                // The file could have been changed since the scan. It is then recorded again by the next one.
+                change.content_hash = cache.hash_file(join_path(base_path, change.file.path), change.mtime_ns).value_or(0);
+            }
+        };
+        auto& pool = ThreadPool::shared();
+        std::vector<std::future<void>> batches{};
+        for(size_t begin = 0; begin < changes.size(); begin += HASH_BATCH_SIZE) {
+            size_t end = std::min(begin + HASH_BATCH_SIZE, changes.size());
+            batches.push_back(pool.submit([&hash_batch, begin, end]() { hash_batch(begin, end); }));
+        }
+        for(auto& batch : batches) {
+            batch.get();
+        }
     }
 
 
-    std::vector<Change> deserialize_changes(std::istream& stream) {
-        std::vector<Change> changes;
+    void hash_new_versions(const std::string& base_path, std::vector<Change>& changes, HashCache& cache) {
+        std::vector<Change*> unhashed{};
+        for(auto& change : changes) {
+            bool new_version = change.type == ChangeType::Creation || change.type == ChangeType::Modification ||
+                change.type == ChangeType::Move;
+            if(new_version && change.file.is_file() && change.content_hash == 0) {
+                unhashed.push_back(&change);
+            }
+        }
+        hash_file_versions(base_path, unhashed, cache);
+    }
 
-        std::optional<Change> current_change{std::nullopt};
-        while(true) {
-            current_change = Change::deserialize(stream);
-            if(!current_change.has_value()) {
-                LOG("[Error] Could not parse change in line " << (changes.size()+1) << std::endl);
-                exit(1);
+
+    // First line of a serialized change list
+    constexpr const char* CHANGES_HEADER = "#fmerge-changes v";
+    // Every this many entries, a change list stores a complete path. Parsers of chunks of the list
+    // (see parse_changes) only have to wait for the previous chunk for the paths before it.
+    constexpr size_t CHANGES_PATH_RESTART_INTERVAL{16};
+
+
+    std::vector<Change> deserialize_changes(std::string_view data, bool* complete) {
+        // Lists without a header were written by the first version of the format
+        int version{1};
+        if(!data.empty() && data.front() == '#') {
+            size_t header_end = std::min(data.find('\n'), data.length());
+            std::string header(data.substr(0, header_end));
+            if(header.rfind(CHANGES_HEADER, 0) == 0) {
+                version = std::atoi(header.c_str() + strlen(CHANGES_HEADER));
             }
-            if(current_change->type == ChangeType::TerminateList) {
-                return changes;
+            if(version < 1 || version > CHANGES_FORMAT_VERSION) {
+                LOG("[Error] Unsupported change list format '" << header << "'" << std::endl);
+                exit(1);
             }
-            changes.push_back(*current_change);
+            data.remove_prefix(std::min(header_end + 1, data.length()));
         }
+        return parse_changes(data, version, complete);
+    }
+
+
+    std::vector<Change> deserialize_changes(std::istream& stream, bool* complete) {
+        std::string data(std::istreambuf_iterator<char>(stream), {});
+        return deserialize_changes(std::string_view(data), complete);
     }
 
 
@@ -531,12 +1018,19 @@ namespace fmerge {
             term()->start_progress_bar("Write Changes");
         }
 
+        stream << CHANGES_HEADER << CHANGES_FORMAT_VERSION << "\n";
+
+        std::string_view previous_path{};
         for(const auto& change : changes) {
             if(show_loading_bar && (changes_count % 500) == 0) {
                 term()->update_progress_bar(static_cast<float>(changes_count) / static_cast<float>(total_changes));
             }
+            if((changes_count % CHANGES_PATH_RESTART_INTERVAL) == 0) {
+                previous_path = {};
+            }
             changes_count++;
-            change.serialize(stream);
+            change.serialize(stream, previous_path);
+            previous_path = change.file.path;
         }
         auto terminator = Change {.type = ChangeType::TerminateList};
         terminator.serialize(stream);
@@ -547,84 +1041,350 @@ namespace fmerge {
     }
 
 
-    bool append_changes(std::string path, std::vector<Change> new_changes) {
-        auto all_changes = read_changes(path);
-        // Append new changes
-        all_changes.insert(all_changes.end(), new_changes.begin(), new_changes.end());
-        // Write new change log
-        write_changes(path, all_changes);
-        return 0;
+    static unsigned long extend_digest(unsigned long digest, unsigned long value) {
+        value = htole64(value);
+        return fnv1a_hash(std::string_view(reinterpret_cast<const char*>(&value), sizeof(value)), digest);
     }
 
 
-    std::vector<Change> read_changes(std::string base_dir) {
-        // Note: This function fails silently and returns an empty vector if the file is not found
-        std::string changes_path = join_path(base_dir, ".fmerge/filechanges.db");
-        std::vector<Change> changes{};
-        if(exists(changes_path)) {
-            std::ifstream changes_file(changes_path);
-            changes = deserialize_changes(changes_file);
+    unsigned long extend_history_digest(unsigned long digest, const Change& change) {
+        digest = extend_digest(digest, static_cast<unsigned long>(change.type));
+        digest = extend_digest(digest, static_cast<unsigned long>(change.file.type));
+        if(!change.file.is_dir()) {
+            digest = extend_digest(digest, change.earliest_change_time);
+            digest = extend_digest(digest, change.latest_change_time);
+            digest = extend_digest(digest, change.mtime_ns);
         }
-        return changes;
+        return digest;
     }
 
 
-    void write_changes(std::string base_dir, std::vector<Change> changes) {
-        std::string changes_path = join_path(base_dir, ".fmerge/filechanges.db");
-        std::ofstream changes_file(changes_path, std::ios_base::trunc);
-        serialize_changes(changes_file, changes, true);
+    FileTree construct_tree_from_changes(const std::vector<Change>& changes) {
+        return construct_tree_from_changes(changes.size(),
+            [&changes](size_t i) { return std::string_view(changes[i].file.path); },
+            [&changes](size_t i, Change&) { return &changes[i]; });
     }
 
 
-    std::shared_ptr<DirNode> construct_tree_from_changes(std::vector<Change> changes) {
-        auto root_node = std::make_shared<DirNode>("", FileType::Directory, 0);
+    // construct_tree_from_changes only splits lists of at least this many changes
+    constexpr size_t PARALLEL_MIN_CHANGES{65536};
+    // Number of shards per thread, so that threads that finish early can take over the rest
+    constexpr size_t SHARDS_PER_THREAD{4};
 
-        for(const auto& change : changes) {
-            const auto& file = change.file;
-            if(change.type == ChangeType::Creation || change.type == ChangeType::Modification) {
-                insert_file_into_tree(root_node, file, change.earliest_change_time);
-            } else if(change.type == ChangeType::Deletion) {
-                remove_file_from_tree(root_node, file);
-            } else {
-                std::cerr << "[Error] Cannot handle " << change.type << " for " << file.path << std::endl; 
+
+    // First component of a path, as returned by split_path
+    static std::string_view top_level_name(std::string_view path) {
+        if(!path.empty() && path.front() == '/') {
+            return path.substr(0, 1);
+        }
+        return path.substr(0, path.find('/'));
+    }
+
+
+    FileTree construct_tree_from_changes(size_t change_count, const std::function<std::string_view(size_t)>& read_path,
+        const std::function<const Change*(size_t, Change&)>& read_change) {
+        auto replay = [&read_change](FileTree& tree, size_t i, Change& buffer) {
+            if(const Change* change = read_change(i, buffer); change != nullptr) {
+                apply_change_to_tree(tree, *change);
             }
+        };
+        auto& pool = ThreadPool::shared();
+        if(change_count < PARALLEL_MIN_CHANGES || pool.size() <= 1) {
+            FileTree tree{};
+            Change buffer{};
+            for(size_t i = 0; i < change_count; i++) {
+                replay(tree, i, buffer);
+            }
+            return tree;
+        }
+
+        // Top-level names in the order in which they first appear, with their number of changes
+        std::unordered_map<std::string_view, unsigned int> name_ids{};
+        std::vector<std::pair<std::string_view, size_t>> names{};
+        std::vector<unsigned int> change_names(change_count);
+        for(size_t i = 0; i < change_count; i++) {
+            auto [name, inserted] = name_ids.try_emplace(top_level_name(read_path(i)), static_cast<unsigned int>(names.size()));
+            if(inserted) {
+                names.emplace_back(name->first, 0);
+            }
+            change_names[i] = name->second;
+            names[name->second].second++;
+        }
+
+        // The names with the most changes are assigned first, each to the shard with the fewest changes so far
+        size_t shard_count = std::min(pool.size() * SHARDS_PER_THREAD, names.size());
+        std::vector<unsigned int> by_size(names.size());
+        for(unsigned int i = 0; i < by_size.size(); i++) {
+            by_size[i] = i;
+        }
+        std::sort(by_size.begin(), by_size.end(), [&names](unsigned int a, unsigned int b) { return names[a].second > names[b].second; });
+        std::vector<size_t> name_shards(names.size());
+        std::vector<size_t> shard_sizes(shard_count, 0);
+        for(unsigned int name : by_size) {
+            size_t shard = std::min_element(shard_sizes.begin(), shard_sizes.end()) - shard_sizes.begin();
+            name_shards[name] = shard;
+            shard_sizes[shard] += names[name].second;
+        }
+        std::vector<std::vector<size_t>> shard_changes(shard_count);
+        for(size_t shard = 0; shard < shard_count; shard++) {
+            shard_changes[shard].reserve(shard_sizes[shard]);
+        }
+        for(size_t i = 0; i < change_count; i++) {
+            shard_changes[name_shards[change_names[i]]].push_back(i);
+        }
+
+        // Index of the change that last added the top-level directory or file of each name to its shard tree.
+        // The serial replay appends an entry to the root when it is added, and again when it is re-created
+        // after a deletion, so this is the order of the root entries.
+        constexpr size_t NOT_PRESENT = std::numeric_limits<size_t>::max();
+        std::vector<size_t> dir_added(names.size(), NOT_PRESENT);
+        std::vector<size_t> file_added(names.size(), NOT_PRESENT);
+        std::vector<FileTree> shard_trees(shard_count);
+        std::vector<std::future<void>> shards{};
+        for(size_t shard = 0; shard < shard_count; shard++) {
+            shards.push_back(pool.submit([&, &tree = shard_trees[shard], &indices = shard_changes[shard]]() {
+                Change buffer{};
+                for(size_t i : indices) {
+                    const Change* change = read_change(i, buffer);
+                    if(change == nullptr) {
+                        continue;
+                    }
+                    apply_change_to_tree(tree, *change);
+
+                    // Each name belongs to a single shard, so its entries are only written here
+                    unsigned int name = change_names[i];
+                    bool top_level = change->file.path.length() == names[name].first.length();
+                    auto update = [&](std::vector<size_t>& added, bool is_dir) {
+                        bool present = is_dir ? tree.get_child_dir(FileTree::ROOT, names[name].first) != FileTree::INVALID_NODE :
+                            tree.get_child_file(FileTree::ROOT, names[name].first) != FileTree::INVALID_NODE;
+                        if(!present) {
+                            added[name] = NOT_PRESENT;
+                        } else if(added[name] == NOT_PRESENT) {
+                            added[name] = i;
+                        }
+                    };
+                    if(change->type == ChangeType::Deletion) {
+                        // Only the deletion of the top-level entry itself removes it
+                        if(top_level) {
+                            update(dir_added, true);
+                            update(file_added, false);
+                        }
+                    } else if(!top_level || change->file.is_dir()) {
+                        // Changes below the name create its directory if needed
+                        if(dir_added[name] == NOT_PRESENT) {
+                            update(dir_added, true);
+                        }
+                    } else if(file_added[name] == NOT_PRESENT) {
+                        update(file_added, false);
+                    }
+                }
+            }));
+        }
+        for(auto& shard : shards) {
+            shard.get();
+        }
+
+        // Directories and files are kept in separate lists of their parent, so each list is filled in order
+        FileTree tree{};
+        for(auto* added : {&dir_added, &file_added}) {
+            std::vector<std::pair<size_t, unsigned int>> entries{};
+            for(unsigned int name = 0; name < names.size(); name++) {
+                if((*added)[name] != NOT_PRESENT) {
+                    entries.emplace_back((*added)[name], name);
+                }
+            }
+            std::sort(entries.begin(), entries.end());
+            for(auto [_, name] : entries) {
+                const auto& shard_tree = shard_trees[name_shards[name]];
+                auto node = added == &dir_added ? shard_tree.get_child_dir(FileTree::ROOT, names[name].first) :
+                    shard_tree.get_child_file(FileTree::ROOT, names[name].first);
+                tree.insert_subtree(std::vector<std::string>{std::string(names[name].first)}, shard_tree, node);
+            }
+        }
+        return tree;
+    }
+
+
+    void apply_change_to_tree(FileTree& tree, const Change& change) {
+        const auto& file = change.file;
+        if(change.type == ChangeType::Creation || change.type == ChangeType::Modification || change.type == ChangeType::Move) {
+            insert_file_into_tree(tree, change);
+        } else if(change.type == ChangeType::Deletion) {
+            remove_file_from_tree(tree, file);
+        } else if(change.type == ChangeType::Checkpoint) {
+            // The changes it stands for are already reflected by the changes that follow it
+        } else {
+            std::cerr << "[Error] Cannot handle " << change.type << " for " << file.path << std::endl; 
         }
-        return root_node;
     }
 
 
-    void insert_file_into_tree(std::shared_ptr<DirNode> root_node, const File& file, long mtime) {
-        if(file.is_dir()) {
-            root_node->insert_node(split_path(file.path),
-                std::make_shared<DirNode>(MetadataNode(file.name(), file.type, mtime))
-            );
-        } else if(file.is_file() || file.is_link()) {
-            root_node->insert_node(split_path(file.path),
-                std::make_shared<MetadataNode>(file.name(), file.type, mtime)
-            );
+    void insert_file_into_tree(FileTree& tree, const Change& change) {
+        const auto& file = change.file;
+        MetadataNode metadata(file.type, change.earliest_change_time);
+        metadata.mtime_ns = change.mtime_ns;
+        metadata.ino = change.ino;
+        metadata.dev = change.dev;
+        metadata.size = change.size;
+        metadata.content_hash = change.content_hash;
+
+        if(file.is_dir() || file.is_file() || file.is_link()) {
+            tree.insert_node(split_path(file.path), metadata);
         } else {
             std::cerr << "[Error] " << file.path << ": Unknown file type (" << static_cast<int>(file.type) << std::endl;
         }
     }
 
 
-    void remove_file_from_tree(std::shared_ptr<DirNode> root_node, const File& file) {
-        if(root_node->remove_node(split_path(file.path)) == false) {
+    void remove_file_from_tree(FileTree& tree, const File& file) {
+        if(tree.remove_node(split_path(file.path)) == false) {
             LOG("[Warning] Failed to delete " << file.path << " from file tree" << std::endl);
         }
     }
 
 
-    std::vector<Change> get_new_tree_changes(std::string path) {
+    // record_path_changes only updates the snapshot after this many changes since the last one
+    constexpr size_t PATH_CHANGES_SNAPSHOT_INTERVAL{4096};
+
+
+    // Appends new_changes to the change log of path, of which log is the view before the append. If
+    // save_snapshot is set and the append succeeded, log_tree is updated accordingly and saved as the
+    // snapshot of the log after the append. A snapshot that is saved before the changes are in the log
+    // would describe changes that were never recorded.
+    static bool append_new_changes(const std::string& path, const TreeSnapshot& snapshot, FileTree& log_tree,
+        const MappedChangeLog& log, const std::vector<Change>& new_changes, const IgnoreRules& rules, bool save_snapshot) {
+        if(!append_changes(path, new_changes)) {
+            return false;
+        }
+        if(!save_snapshot) {
+            return true;
+        }
+        // The append may have rewritten the log in the current format
+        auto log_stats = get_file_stats(join_path(path, ".fmerge/filechanges.db"));
+        if(!log_stats.has_value()) {
+            return true;
+        }
+        for(const auto& change : new_changes) {
+            apply_change_to_tree(log_tree, change);
+        }
+        size_t log_tail_length = std::min(log.size(), TreeSnapshot::CHECKSUM_CHANGES);
+        size_t new_tail_length = std::min(new_changes.size(), TreeSnapshot::CHECKSUM_CHANGES);
+        std::vector<Change> tail{};
+        for(size_t i = log.size() - log_tail_length; i < log.size(); i++) {
+            tail.push_back(log[i].to_change());
+        }
+        tail.insert(tail.end(), new_changes.end() - new_tail_length, new_changes.end());
+        snapshot.save(log_tree, log.size() + new_changes.size(), log_stats->ino, log_stats->fsize, tail, rules);
+        return true;
+    }
+
+
+    optional<size_t> record_tree_changes(std::string path) {
         auto root_stats = get_file_stats(path);
-        auto root_node = std::make_shared<DirNode>(split_path(path).back(), root_stats->type, root_stats->mtime);
-        update_file_tree(root_node, path); // This is where the current file tree is built in memory
+        FileTree tree(split_path(path).back(), MetadataNode(*root_stats));
+        DirCache dir_cache(join_path(path, ".fmerge/dircache.db"));
+        dir_cache.load();
+        auto ignore_rules = IgnoreRules::load(path);
+        update_file_tree(tree, path, true, &dir_cache, &ignore_rules); // This is where the current file tree is built in memory
+        dir_cache.save();
+
+        // Attempt to detect changes. Ignored files are treated as if they had never been recorded,
+        // so that adding an ignore rule does not delete the files on the peer.
+        MappedChangeLog log(path); // Empty if no change file is present
+        TreeSnapshot snapshot(join_path(path, ".fmerge/treesnapshot.db"));
+        auto existing_tree = snapshot.load(log, ignore_rules);
+        auto new_changes = compare_trees(existing_tree, tree, true);
+        detect_moves(new_changes);
+        if(g_content_hash) {
+            HashCache hash_cache(join_path(path, ".fmerge/hashcache.db"));
+            hash_new_versions(path, new_changes, hash_cache);
+            hash_cache.prune(tree);
+            hash_cache.save();
+        }
 
-        // Attempt to detect changes
-        auto existing_changes = read_changes(path); // Return empty array if not no change file is present
-        auto existing_tree = construct_tree_from_changes(existing_changes);
-        auto new_changes = compare_trees(existing_tree, root_node);
+        bool save_snapshot = snapshot.replayed() > 0 || !new_changes.empty();
+        if(!append_new_changes(path, snapshot, existing_tree, log, new_changes, ignore_rules, save_snapshot)) {
+            return std::nullopt;
+        }
+        return new_changes.size();
+    }
 
-        return new_changes;
+
+    optional<size_t> record_path_changes(std::string path, const std::vector<std::string>& relative_paths) {
+        auto ignore_rules = IgnoreRules::load(path);
+        MappedChangeLog log(path);
+        TreeSnapshot snapshot(join_path(path, ".fmerge/treesnapshot.db"));
+        auto existing_tree = snapshot.load(log, ignore_rules);
+
+        // A path that lies below another one is already covered by it
+        std::vector<std::string> sorted_paths(relative_paths);
+        std::sort(sorted_paths.begin(), sorted_paths.end());
+        std::vector<std::string> covering_paths{};
+        for(const auto& relative_path : sorted_paths) {
+            if(!covering_paths.empty()) {
+                const auto& last = covering_paths.back();
+                if(relative_path == last || relative_path.rfind(last + "/", 0) == 0) {
+                    continue;
+                }
+            }
+            covering_paths.push_back(relative_path);
+        }
+
+        std::vector<Change> new_changes{};
+        for(const auto& relative_path : covering_paths) {
+            if(relative_path.empty()) {
+                continue;
+            }
+            std::string full_path = join_path(path, relative_path);
+            auto stats = get_file_stats(full_path);
+            if(ignore_rules.ignored(relative_path, stats.has_value() && stats->type == FileType::Directory)) {
+                continue;
+            }
+            auto path_tokens = split_path(relative_path);
+
+            // Both trees only contain the subtree at relative_path. The placeholder parents are
+            // identical directories and never cause changes.
+            std::vector<std::string> parent_tokens(path_tokens.begin(), path_tokens.end() - 1);
+            auto make_partial_tree = [&parent_tokens]() {
+                FileTree tree{};
+                if(!parent_tokens.empty()) {
+                    tree.insert_node(parent_tokens, MetadataNode(FileType::Directory, 0));
+                }
+                return tree;
+            };
+
+            auto from_tree = make_partial_tree();
+            if(auto existing_dir = existing_tree.get_child_dir(path_tokens); existing_dir != FileTree::INVALID_NODE) {
+                from_tree.insert_subtree(path_tokens, existing_tree, existing_dir);
+            } else if(auto existing_file = existing_tree.get_child_file(path_tokens); existing_file != FileTree::INVALID_NODE) {
+                from_tree.insert_node(path_tokens, existing_tree.metadata(existing_file));
+            }
+
+            auto to_tree = make_partial_tree();
+            if(stats.has_value() && stats->type == FileType::Directory) {
+                to_tree.insert_node(path_tokens, MetadataNode(*stats));
+                update_file_tree(to_tree, full_path, false, nullptr, &ignore_rules, relative_path);
+            } else if(stats.has_value() && (stats->type == FileType::File || stats->type == FileType::Link)) {
+                to_tree.insert_node(path_tokens, MetadataNode(*stats));
+            }
+
+            auto path_changes = compare_trees(from_tree, to_tree);
+            new_changes.insert(new_changes.end(), path_changes.begin(), path_changes.end());
+        }
+        // Across paths, since a move usually touches two of them
+        detect_moves(new_changes);
+        if(g_content_hash) {
+            // The trees only cover the given paths, so they cannot be used to prune the cache
+            HashCache hash_cache(join_path(path, ".fmerge/hashcache.db"));
+            hash_new_versions(path, new_changes, hash_cache);
+            hash_cache.save();
+        }
+
+        // Writing the whole tree is only worth it once enough changes have accumulated
+        bool save_snapshot = snapshot.replayed() + new_changes.size() >= PATH_CHANGES_SNAPSHOT_INTERVAL;
+        if(!append_new_changes(path, snapshot, existing_tree, log, new_changes, ignore_rules, save_snapshot)) {
+            return std::nullopt;
+        }
+        return new_changes.size();
     }
-}
\ No newline at end of file
+}
@@ -1,6 +1,9 @@
 #pragma once
 
+#include "DirCache.h"
 #include "Filesystem.h"
+#include "HashCache.h"
+#include "IgnoreRules.h"
 
 #include <optional>
 #include <functional>
@@ -8,6 +11,7 @@
 #include <vector>
 #include <memory>
 #include <string>
+#include <string_view>
 
 
 using std::shared_ptr;
@@ -16,49 +20,152 @@ using std::optional;
 
 namespace fmerge {
 
-    // A tree consisting of Metadata nodes is constructed to represent the file 
-    // system on disk. It includes the minimal set of metadata required by the change
-    // detection algorithms.
-    class MetadataNode {
-    public:
+    // Metadata of a file or directory in a FileTree. It includes the minimal set of metadata
+    // required by the change detection algorithms. The name is stored by the tree.
+    struct MetadataNode {
         MetadataNode() = delete;
-        MetadataNode(const char* _name, FileType _ftype, long _mtime) : name(_name), mtime(_mtime), ftype(_ftype) {}
-        MetadataNode(std::string _name, FileType _ftype, long _mtime);
-        // Metadata
-        const char* name;
+        MetadataNode(FileType _ftype, long _mtime) : mtime(_mtime), ftype(_ftype) {}
+        MetadataNode(const FileStats& stats);
+
         long mtime;
         FileType ftype;
-    public:
-        void serialize(std::ostream& stream) const;
-        static MetadataNode deserialize(std::istream& stream);
+        long mtime_ns{}; // Precise modification time, used to identify file versions
+        unsigned long ino{};
+        unsigned long dev{};
+        unsigned long size{};
+        unsigned long content_hash{}; // 0 if the contents have not been hashed
     };
 
 
-    class DirNode : public std::enable_shared_from_this<DirNode> {
-    public:
-        DirNode() = delete;
-        DirNode(shared_ptr<MetadataNode> _metadata) : metadata(_metadata) {}
-        DirNode(MetadataNode _metadata) : metadata(std::make_shared<MetadataNode>(_metadata)) {}
-        DirNode(std::string _name, FileType _ftype, long _mtime) : metadata(std::make_shared<MetadataNode>(_name, _ftype, _mtime)) {}
-
-        std::vector<shared_ptr<DirNode>> subdirs{};
-        std::vector<shared_ptr<MetadataNode>> files{};
-        // Metadata
-        shared_ptr<MetadataNode> metadata;
+    // A tree of metadata nodes is constructed to represent the file system on disk, or the
+    // state recorded in the change log.
+    //
+    // All nodes live in one contiguous array and refer to each other by index. The names are
+    // stored back to back in a single string arena. Only directories own a (small) list of their
+    // children, so building the tree costs no allocation per file. Removed nodes are recycled
+    // through a free list. Their names stay in the arena until the tree is destroyed.
+    //
+    // Small directories are searched linearly. Once a directory holds more than INDEX_THRESHOLD
+    // entries, it also gets a hash table over the names of its children, so that looking up a
+    // child does not depend on the width of the directory.
+    class FileTree {
     public:
-        shared_ptr<MetadataNode> get_child_file(std::string file_name);
-        shared_ptr<MetadataNode> get_child_file(std::vector<std::string> path_tokens);
-        shared_ptr<DirNode> get_child_dir(std::string dir_name);
-        shared_ptr<DirNode> get_child_dir(std::vector<std::string> path_tokens);
+        typedef unsigned int NodeId;
+        static constexpr NodeId ROOT{0};
+        static constexpr NodeId INVALID_NODE{~0u};
+
+        // The root is an unnamed directory
+        FileTree();
+        FileTree(std::string root_name, const MetadataNode& root_metadata);
+
+        std::string_view name(NodeId node) const;
+        const MetadataNode& metadata(NodeId node) const { return nodes[node].metadata; }
+        MetadataNode& metadata(NodeId node) { return nodes[node].metadata; }
+        bool is_dir(NodeId node) const { return nodes[node].dir_index != INVALID_NODE; }
+
+        // All lookups return INVALID_NODE if the entry does not exist
+        NodeId get_child_file(NodeId dir, std::string_view file_name) const;
+        NodeId get_child_file(const std::vector<std::string>& path_tokens) const;
+        NodeId get_child_dir(NodeId dir, std::string_view dir_name) const;
+        // An empty path returns the root
+        NodeId get_child_dir(const std::vector<std::string>& path_tokens) const;
+
+        // Inserts a directory if the type of the metadata is Directory, and a file otherwise.
+        // Missing parents are created as placeholders. Once a placeholder is inserted itself,
+        // it receives its proper metadata. Existing entries are updated.
+        NodeId insert_node(const std::vector<std::string>& path_tokens, const MetadataNode& metadata);
+        // Copies the subtree below other_node of another tree to path_tokens
+        NodeId insert_subtree(const std::vector<std::string>& path_tokens, const FileTree& other, NodeId other_node);
+        // Returns false if there is no such entry
+        bool remove_node(const std::vector<std::string>& path_tokens);
+
+        // Children of a directory, in insertion order
+        const std::vector<NodeId>& child_dirs(NodeId dir) const { return dirs[nodes[dir].dir_index].subdirs; }
+        const std::vector<NodeId>& child_files(NodeId dir) const { return dirs[nodes[dir].dir_index].files; }
 
-        bool insert_node(std::vector<std::string> path_tokens, std::shared_ptr<DirNode> dir);
-        bool insert_node(std::vector<std::string> path_tokens, std::shared_ptr<MetadataNode> file);
-        bool remove_node(std::vector<std::string> path_tokens);
+        // Calls visit(path, node) for every node below dir: subdirectories first (depth first), then
+        // files, in insertion order. path holds the path of dir and is extended in place, so the path
+        // passed to visit is only valid during the call. It is restored before returning.
+        template<typename Visitor>
+        void for_each_node(NodeId dir, std::string& path, Visitor&& visit) const {
+            const auto& children = dirs[nodes[dir].dir_index];
+            size_t dir_length = path.length();
+            for(NodeId subdir : children.subdirs) {
+                append_name(path, subdir);
+                visit(std::string_view(path), subdir);
+                for_each_node(subdir, path, visit);
+                path.resize(dir_length);
+            }
+            for(NodeId file : children.files) {
+                append_name(path, file);
+                visit(std::string_view(path), file);
+                path.resize(dir_length);
+            }
+        }
 
-        void for_node_in_tree(std::function<void(std::vector<std::string>, shared_ptr<MetadataNode>, bool)> f, std::vector<std::string> prefix = {});
+        // Visits the whole tree. The paths are relative to the root.
+        template<typename Visitor>
+        void for_each_node(Visitor&& visit) const {
+            std::string path{};
+            for_each_node(ROOT, path, visit);
+        }
 
+        // Appends "/name" to the path of the parent of node, or just the name at the root
+        void append_name(std::string& path, NodeId node) const {
+            if(!path.empty()) {
+                path.push_back('/');
+            }
+            path.append(name(node));
+        }
+
+        // Number of nodes, including the root
+        size_t size() const { return nodes.size() - free_nodes.size(); }
+
+        // Compact binary form of the tree. Only the live nodes and their names are written.
         void serialize(std::ostream& stream) const;
-        static shared_ptr<DirNode> deserialize(std::istream& stream);
+        // Returns nullopt if the data is truncated or inconsistent
+        static std::optional<FileTree> deserialize(std::istream& stream);
+    private:
+        struct Node {
+            MetadataNode metadata;
+            unsigned int name_offset;
+            unsigned short name_length;
+            // Index into dirs, or INVALID_NODE for files
+            NodeId dir_index;
+        };
+
+        struct DirChildren {
+            std::vector<NodeId> subdirs{};
+            std::vector<NodeId> files{};
+            // Open addressing table (linear probing) over subdirs and files. Empty for small directories.
+            std::vector<NodeId> index{};
+        };
+
+        static constexpr size_t INDEX_THRESHOLD{32};
+
+        NodeId allocate_node(std::string_view name, const MetadataNode& metadata, bool dir);
+        // Uses a name that is already stored in the arena
+        NodeId allocate_node(unsigned int name_offset, unsigned short name_length, const MetadataNode& metadata, bool dir);
+        void free_subtree(NodeId node);
+        // Returns the directory that contains the entry at path_tokens, creating placeholders if necessary
+        NodeId ensure_parent(const std::vector<std::string>& path_tokens);
+        NodeId add_child(NodeId parent, std::string_view name, const MetadataNode& metadata);
+        // Appends an allocated node to the children of parent
+        void link_child(NodeId parent, NodeId child);
+        // Inserts copies of the children of other_dir into dir
+        void copy_children(NodeId dir, const FileTree& other, NodeId other_dir);
+        NodeId find_child(NodeId dir, std::string_view child_name, bool child_is_dir) const;
+        size_t index_slot(const DirChildren& children, std::string_view child_name) const;
+        void index_insert(DirChildren& children, NodeId child);
+        void index_remove(DirChildren& children, NodeId child);
+        // (Re)builds the table of a directory with at least INDEX_THRESHOLD entries
+        void rebuild_index(DirChildren& children);
+
+        std::vector<Node> nodes;
+        std::vector<DirChildren> dirs;
+        std::string names;
+        std::vector<NodeId> free_nodes;
+        std::vector<NodeId> free_dirs;
     };
 
 
@@ -69,11 +176,22 @@ namespace fmerge {
         Deletion,
         FileType,
         TerminateList,
+        // Creation of a file that was moved from another path. The old path is deleted by a separate change.
+        Move,
+        // Stands for the first changes of a history, which were removed by a compaction of the change log.
+        // size holds the number of changes it replaces and content_hash their digest (see extend_history_digest).
+        // It is always followed by at least one change, which describes the current version.
+        Checkpoint,
     };
 
 
     std::ostream& operator<<(std::ostream& os, ChangeType change_type);
 
+    // Version of the serialized change list format. Version 1 lists carry no header and only
+    // store whole seconds. Version 3 adds moves, version 4 content hashes, version 5 checkpoints,
+    // version 6 front coding of the paths (see Change::serialize).
+    constexpr int CHANGES_FORMAT_VERSION = 6;
+
     class Change {
     public:
         ChangeType type;
@@ -84,28 +202,74 @@ namespace fmerge {
         long earliest_change_time{}; // This is the default field
         long latest_change_time{}; // Only used if range is necessary
         File file{}; // Aggregate of path and dir/file/link indentification
+        // Metadata of the file version the change refers to. For deletions, this is the deleted version.
+        long mtime_ns{}; // Modification time in nanoseconds. Identifies the file version.
+        unsigned long size{};
+        unsigned long ino{}; // Inode and device are only meaningful on the host that recorded the change
+        unsigned long dev{};
+        unsigned long content_hash{}; // See hash_content. 0 if the contents were not hashed.
+        std::string moved_from{}; // Only used by moves: path of the file before it was moved
+        long log_time_ns{}; // Time at which the change entered the local change log. Not sent to the peer.
     public:
         friend std::ostream& operator<<(std::ostream& os, const Change& change);
         friend bool operator==(const Change& lhs, const Change& rhs);
 
-        void serialize(std::ostream& stream) const;
-        static std::optional<Change> deserialize(std::istream& stream);
+        // The path is front-coded: only the part after the prefix it shares with previous_path is written,
+        // preceded by the length of that prefix.
+        void serialize(std::ostream& stream, std::string_view previous_path = {}) const;
     };
 
-    void update_file_tree(shared_ptr<DirNode> base_node, std::string base_path, bool show_loading_bar = true);
-    std::vector<Change> compare_metadata(shared_ptr<MetadataNode> from_node, shared_ptr<MetadataNode> to_node, std::string path);
-    std::vector<Change> compare_trees(shared_ptr<DirNode> from_tree, shared_ptr<DirNode> to_tree);
+    // If dir_cache is given, unchanged directories are not enumerated again (see DirCache).
+    // Entries matched by ignore_rules never enter the tree. relative_base is the location of base_path
+    // relative to the folder the rules belong to, and the entries are inserted at relative_base in the tree.
+    void update_file_tree(FileTree& tree, std::string base_path, bool show_loading_bar = true, DirCache* dir_cache = nullptr,
+        const IgnoreRules* ignore_rules = nullptr, std::string relative_base = "");
+    // A missing node is given as nullptr
+    std::vector<Change> compare_metadata(const MetadataNode* from_node, const MetadataNode* to_node, std::string_view path);
+    // Deletions and modifications are listed before creations. In parallel mode, the subtrees of large
+    // trees are compared on the shared thread pool. The result is the same in both modes.
+    std::vector<Change> compare_trees(const FileTree& from_tree, const FileTree& to_tree, bool parallel = false);
+    // Turns the appearance of a file into a move if the same file (by inode, size and mtime) was deleted
+    // at another path. The deletion of the old path is kept.
+    void detect_moves(std::vector<Change>& changes);
+    // Fills in the content hashes of the changes from the files below base_path, on the shared thread pool.
+    // Files that are not the recorded version (anymore) keep the hash 0.
+    void hash_file_versions(const std::string& base_path, const std::vector<Change*>& changes, HashCache& cache);
+    // Hashes the new file versions among the changes that have no hash yet
+    void hash_new_versions(const std::string& base_path, std::vector<Change>& changes, HashCache& cache);
 
-    std::vector<Change> deserialize_changes(std::istream& stream);
+    // Text form of change lists, as sent to the peer. Older versions also stored the change log in this form.
+    // Reading stops at the first entry that cannot be parsed, such as the end of a list whose writing was
+    // interrupted. complete tells whether the list was read up to its terminator. The entries are parsed
+    // by parse_changes (see ChangeParser).
+    std::vector<Change> deserialize_changes(std::string_view data, bool* complete = nullptr);
+    // Reads the rest of the stream
+    std::vector<Change> deserialize_changes(std::istream& stream, bool* complete = nullptr);
     void serialize_changes(std::ostream& stream, std::vector<Change> changes, bool show_loading_bar = false);
-    bool append_changes(std::string path, std::vector<Change> new_changes);
-    std::vector<Change> read_changes(std::string base_dir);
-    void write_changes(std::string base_dir, std::vector<Change> changes);
 
-    std::shared_ptr<DirNode> construct_tree_from_changes(std::vector<Change> changes);
-    void insert_file_into_tree(std::shared_ptr<DirNode> root_node, const File& file, long mtime);
-    void remove_file_from_tree(std::shared_ptr<DirNode> root_node, const File& file);
+    // Extends the digest of a file history, which starts at FNV_OFFSET_BASIS, by the next change. It covers what
+    // is_change_equal compares, except for the path, which is the same for the whole history.
+    unsigned long extend_history_digest(unsigned long digest, const Change& change);
+
+    FileTree construct_tree_from_changes(const std::vector<Change>& changes);
+    // Replays the changes with the indices 0 to change_count - 1 into an empty tree. read_change(i, buffer) returns
+    // change i, which it may decode into buffer, or nullptr if it is to be skipped. read_path(i) only returns its
+    // path, which must stay valid during the call. Both are called concurrently.
+    //
+    // Changes only affect the entries below the first component of their path. Long lists are therefore split
+    // into shards by that component, which are replayed into separate trees on the shared thread pool, in the
+    // order of the list. The subtrees are then copied into the result.
+    FileTree construct_tree_from_changes(size_t change_count, const std::function<std::string_view(size_t)>& read_path,
+        const std::function<const Change*(size_t, Change&)>& read_change);
+    // Replays a single change of the change log
+    void apply_change_to_tree(FileTree& tree, const Change& change);
+    void insert_file_into_tree(FileTree& tree, const Change& change);
+    void remove_file_from_tree(FileTree& tree, const File& file);
 
-    std::vector<Change> get_new_tree_changes(std::string path);
+    // Scans the folder and appends the changes since the last scan to its change log. The caller must hold
+    // .fmerge/filechanges.lock. Returns the number of recorded changes, or nothing if they could not be appended.
+    optional<size_t> record_tree_changes(std::string path);
+    // Like record_tree_changes, but only looks at the given paths (relative to path) and everything below them
+    optional<size_t> record_path_changes(std::string path, const std::vector<std::string>& relative_paths);
 
 }
\ No newline at end of file
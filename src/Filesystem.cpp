@@ -1,44 +1,144 @@
 #include "Filesystem.h"
 
+#include "DirWalker.h"
 #include "Errors.h"
+#include "Globals.h"
 
 #include <fcntl.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <memory>
 
 
 namespace fmerge {
 
-    optional<FileStats> get_file_stats(std::string filepath) {
-        Stat clib_stats;
+    FileStats to_file_stats(const struct statx& clib_stats) {
         FileStats stats;
-        int ret = lstat(filepath.c_str(), &clib_stats);
-        if(ret != 0) {
-            //print_clib_error("lstat");
-            //std::cerr << "^^^ occurred for " << filepath << std::endl;
-            return std::nullopt;
-        }
         // Populate with the read metadata
-        stats.mtime = clib_stats.st_mtime;
-        stats.ctime = clib_stats.st_ctime;
-        stats.atime = clib_stats.st_atime;
-        if(S_ISDIR(clib_stats.st_mode)) {
+        stats.mtime = clib_stats.stx_mtime.tv_sec;
+        stats.mtime_ns = clib_stats.stx_mtime.tv_sec * 1000000000L + clib_stats.stx_mtime.tv_nsec;
+        stats.ctime = clib_stats.stx_ctime.tv_sec;
+        stats.ctime_ns = clib_stats.stx_ctime.tv_sec * 1000000000L + clib_stats.stx_ctime.tv_nsec;
+        stats.atime = clib_stats.stx_atime.tv_sec;
+        if(S_ISDIR(clib_stats.stx_mode)) {
             stats.type = FileType::Directory;
-        } else if(S_ISREG(clib_stats.st_mode)) {
+        } else if(S_ISREG(clib_stats.stx_mode)) {
             stats.type = FileType::File;
-        } else if(S_ISLNK(clib_stats.st_mode)) {
+        } else if(S_ISLNK(clib_stats.stx_mode)) {
             stats.type = FileType::Link;
         } else {
             stats.type = FileType::Unknown;
         }
-        stats.fsize = clib_stats.st_size;
+        stats.fsize = clib_stats.stx_size;
+        stats.ino = clib_stats.stx_ino;
+        stats.dev = makedev(clib_stats.stx_dev_major, clib_stats.stx_dev_minor);
+
+        return stats;
+    }
+
+
+    optional<FileStats> get_file_stats(std::string filepath) {
+        struct statx clib_stats;
+        int ret = statx(AT_FDCWD, filepath.c_str(), AT_SYMLINK_NOFOLLOW, SCAN_STATX_MASK | STATX_ATIME, &clib_stats);
+        if(ret != 0) {
+            //print_clib_error("statx");
+            //std::cerr << "^^^ occurred for " << filepath << std::endl;
+            return std::nullopt;
+        }
+        return optional<FileStats>{to_file_stats(clib_stats)};
+    }
+
+
+    optional<FileStats> get_file_stats_at(int dir_fd, const char* name) {
+        struct statx clib_stats;
+        int flags = AT_SYMLINK_NOFOLLOW;
+        if(name[0] == '\0') {
+            flags |= AT_EMPTY_PATH;
+        }
+        if(statx(dir_fd, name, flags, SCAN_STATX_MASK, &clib_stats) != 0) {
+            return std::nullopt;
+        }
+        return optional<FileStats>{to_file_stats(clib_stats)};
+    }
+
+
+    // Size of the buffer passed to getdents64. Large enough to read most directories in a single call.
+    constexpr size_t DIR_BUFFER_SIZE = 256 * 1024;
+
+    // Layout of the records returned by getdents64 (see man 2 getdents)
+    struct linux_dirent64 {
+        ino64_t        d_ino;
+        off64_t        d_off;
+        unsigned short d_reclen;
+        unsigned char  d_type;
+        char           d_name[];
+    };
+
+
+    static FileType dtype_to_file_type(unsigned char d_type) {
+        switch(d_type) {
+        case DT_DIR:
+            return FileType::Directory;
+        case DT_REG:
+            return FileType::File;
+        case DT_LNK:
+            return FileType::Link;
+        default:
+            return FileType::Unknown;
+        }
+    }
+
+
+    bool read_dir_entries(int dir_fd, std::vector<DirEntry>& entries) {
+        // Every scanner thread keeps its own buffer around
+        static thread_local std::unique_ptr<char[]> buffer{};
+        if(!buffer) {
+            buffer = std::make_unique<char[]>(DIR_BUFFER_SIZE);
+        }
+
+        while(true) {
+            long nread = syscall(SYS_getdents64, dir_fd, buffer.get(), DIR_BUFFER_SIZE);
+            if(nread == -1) {
+                print_clib_error("getdents64");
+                return false;
+            }
+            if(nread == 0) {
+                return true;
+            }
+
+            for(long pos = 0; pos < nread;) {
+                auto* dent = reinterpret_cast<linux_dirent64*>(buffer.get() + pos);
+                pos += dent->d_reclen;
+
+                const char* name = dent->d_name;
+                if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                    continue;
+                }
 
-        return optional<FileStats>{stats};
+                // Sockets, fifos and devices are reported with a known type, but are never synced.
+                entries.push_back(DirEntry{
+                    .name = name,
+                    .type = dtype_to_file_type(dent->d_type),
+                    .type_known = dent->d_type != DT_UNKNOWN,
+                    .ino = dent->d_ino
+                });
+            }
+        }
     }
 
 
-    bool set_timestamp(std::string filepath, long mod_time, long access_time) {
+    bool set_timestamp(std::string filepath, long mod_time_ns, long access_time) {
+        // Division truncates toward zero, but tv_nsec must not be negative for times before 1970
+        long mod_time_s = mod_time_ns / 1000000000L;
+        long mod_time_nsec = mod_time_ns % 1000000000L;
+        if(mod_time_nsec < 0) {
+            mod_time_nsec += 1000000000L;
+            mod_time_s--;
+        }
         timespec times[] = {
             {.tv_sec = access_time, .tv_nsec = 0 },
-            {.tv_sec = mod_time, .tv_nsec = 0}
+            {.tv_sec = mod_time_s, .tv_nsec = mod_time_nsec}
         };
         if(utimensat(AT_FDCWD, filepath.c_str(), times, AT_SYMLINK_NOFOLLOW) == -1) {
             print_clib_error("utimensat");
@@ -89,6 +189,49 @@ namespace fmerge {
     }
 
 
+    long get_timestamp_now_ns() {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        return now.tv_sec * 1000000000L + now.tv_nsec;
+    }
+
+
+    FileLock::~FileLock() {
+        unlock();
+    }
+
+
+    bool FileLock::lock(bool wait) {
+        if(fd == -1) {
+            fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+            if(fd == -1) {
+                print_clib_error("open");
+                std::cerr << "^^^ occurred for " << path << std::endl;
+                return false;
+            }
+        }
+        while(flock(fd, LOCK_EX | (wait ? 0 : LOCK_NB)) == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno != EWOULDBLOCK) {
+                print_clib_error("flock");
+            }
+            return false;
+        }
+        return true;
+    }
+
+
+    void FileLock::unlock() {
+        if(fd != -1) {
+            // Closing the file releases the lock
+            close(fd);
+            fd = -1;
+        }
+    }
+
+
     optional<std::string> abs_path(std::string basepath) {
         char fullpath[PATH_MAX];
         if(realpath(basepath.c_str(), fullpath) == nullptr) {
@@ -145,75 +288,13 @@ namespace fmerge {
     }
 
 
-    void _for_file_in_dir(std::string basepath, std::string prefix, std::function<void(File, const FileStats&)> f) {
+    void for_file_in_dir(std::string basepath, std::function<void(File, const FileStats&)> f, int threads) {
         // basepath must already be normalized with realpath/abs_path
-        // The child files and directories are returned with prefix + / + filename
-
-        // Open and check dir
-        auto* dir = opendir(basepath.c_str());
-        if(dir == nullptr) {
-            print_clib_error("opendir");
-            std::cerr << "^^^ occurred for " << basepath << std::endl;
-            
-            // We have reached the limit on the maximum number of files, globally or for this process.
-            if(errno == ENFILE) {
-                std::cerr << "[Error] System-wide file limit hit." << std::endl;
-                exit(1);
-            } else if(errno == EMFILE) {
-                std::cerr << "[Error] Process file limit hit." << std::endl;
-                exit(1);
-            }
-            return;
-        }
-
-        struct dirent* subdir;
-        // "subdir" is not necessarily a directory
-        while((subdir = readdir(dir)) != nullptr) {
-            auto subdirname = std::string(subdir->d_name); 
-            if(subdirname != "." && subdirname != "..") {
-                auto subdirpath = std::string(basepath) + "/" + subdirname;
-                auto relative_path = join_path(prefix, subdirname);
-                auto file_stats = get_file_stats(subdirpath);
-                if(file_stats.has_value()) {
-                    File file{path:relative_path, type:file_stats->type};
-                    f(file, *file_stats);
-                    if(file.is_dir()) _for_file_in_dir(subdirpath, relative_path, f);
-                }
-            }
-        }
-        closedir(dir);
+        // The child files and directories are returned relative to basepath
+        DirWalker(basepath, threads, g_scan_io_uring).walk(f);
     }
     
 
-    static bool str_starts_with(std::string s1, std::string starts_with) {
-        // Returns true if the strings are equal, up to the length of the second string
-        if(starts_with.length() > s1.length()) {
-            return false;
-        }
-
-        for(size_t i = 0; i < starts_with.length(); i++) {
-            if(s1[i] != starts_with[i]) {
-                return false;
-            }
-        }
-        return true;
-    }
-
-
-    bool file_ignored(const File& file) {
-        std::string compare_path = file.path;
-        if(file.is_dir()) {
-            compare_path.append("/");
-        }
-
-        // Ignore .fmerge directory
-        if(str_starts_with(compare_path, ".fmerge/")) {
-            return true;
-        }
-        return false;
-    }
-
-
     std::ostream& operator<<(std::ostream& os, const FileType& filetype) {
         if(filetype == FileType::File) {
             os << "F";
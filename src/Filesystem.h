@@ -28,10 +28,14 @@ namespace fmerge {
 
     struct FileStats {
         long mtime; // Modification time
+        long mtime_ns; // Modification time in nanoseconds
         long ctime; // Creation time
+        long ctime_ns; // Status change time in nanoseconds
         long atime; // Access time
         FileType type;
         unsigned long fsize;
+        unsigned long ino; // Inode number
+        unsigned long dev; // Device the inode resides on
     };
 
     optional<std::string> abs_path(std::string basepath);
@@ -52,19 +56,56 @@ namespace fmerge {
         }
     };
     
+    // Directory entry as returned by the kernel. If the file system does not report the type of
+    // the entry, type_known is false and the entry has to be stat'ed to classify it.
+    struct DirEntry {
+        std::string name;
+        FileType type;
+        bool type_known;
+        unsigned long ino;
+    };
+
+    // Reads all entries of the open directory using large getdents64 batches. "." and ".." are skipped.
+    // Returns false if the directory could not be read.
+    bool read_dir_entries(int dir_fd, std::vector<DirEntry>& entries);
+
     optional<FileStats> get_file_stats(std::string filepath);
-    bool set_timestamp(std::string filepath, long mod_time, long access_time);
+    // Stats a file relative to an open directory without following links. An empty name stats the
+    // directory itself. Only requests the fields required by the file tree from the file system.
+    optional<FileStats> get_file_stats_at(int dir_fd, const char* name);
+    // Fields that are needed to build the file tree
+    constexpr unsigned int SCAN_STATX_MASK = STATX_TYPE | STATX_MTIME | STATX_CTIME | STATX_SIZE | STATX_INO;
+    FileStats to_file_stats(const struct statx& clib_stats);
+    // The modification time is given in nanoseconds, the access time in seconds
+    bool set_timestamp(std::string filepath, long mod_time_ns, long access_time);
     bool exists(std::string filepath);
     bool remove_path(std::string path);
     bool ensure_dir(std::string path, bool allow_exists = false);
     long get_timestamp_now();
+    // Current time in nanoseconds since the epoch
+    long get_timestamp_now_ns();
+
+    // Advisory lock (flock) on a lock file. Used to coordinate fmerge processes working on the same folder.
+    // The lock is released when the object is destroyed.
+    class FileLock {
+    public:
+        FileLock() = delete;
+        FileLock(std::string _path) : path(_path) {}
+        ~FileLock();
+
+        FileLock(const FileLock&) = delete;
+        FileLock& operator=(const FileLock&) = delete;
+
+        // Returns false if the lock file could not be opened, or if wait is false and the lock is held
+        bool lock(bool wait = true);
+        void unlock();
+    private:
+        std::string path;
+        int fd{-1};
+    };
 
-    void _for_file_in_dir(std::string basepath, std::string prefix, std::function<void(File, const FileStats&)> f);
-    inline void for_file_in_dir(std::string basepath, std::function<void(File, const FileStats&)> f) {
-        _for_file_in_dir(basepath, "", f);
-    }
+    // Calls f for every entry below basepath. See DirWalker for the parallel implementation.
+    void for_file_in_dir(std::string basepath, std::function<void(File, const FileStats&)> f, int threads = 1);
 
-    // Check if file should be ignored
-    bool file_ignored(const File &file);
     std::ostream& operator<<(std::ostream& os, const FileType& filetype);
 }
\ No newline at end of file
@@ -6,6 +6,12 @@ namespace fmerge {
     extern bool g_debug_protocol;
     // Whether user confirmation is required
     extern bool g_ask_confirmation;
+    // Number of threads used to scan and compare the file tree (0: one per core)
+    extern int g_scan_threads;
+    // Whether to batch the metadata requests of the scan with io_uring
+    extern bool g_scan_io_uring;
+    // Whether to hash the contents of new file versions, so that identical files are recognized
+    extern bool g_content_hash;
 
     extern int g_exit_code;
 }
\ No newline at end of file
@@ -0,0 +1,187 @@
+#include "HashCache.h"
+
+#include "ContentHash.h"
+#include "Errors.h"
+#include "FileTree.h"
+
+#include <endian.h>
+#include <fstream>
+#include <cstring>
+#include <vector>
+
+
+namespace fmerge {
+
+    constexpr char HASH_CACHE_MAGIC[4] = {'F', 'M', 'H', 'C'};
+    // Files that were modified less than this long before the run are not cached (see HashCache)
+    constexpr long RACY_MARGIN_NS = 1000000000L;
+
+
+    // Fixed size record of a cached hash (all fields little endian)
+    struct SerializedHash {
+        unsigned long dev;
+        unsigned long ino;
+        unsigned long size;
+        long mtime_ns;
+        unsigned long hash;
+    } __attribute__((packed));
+
+
+    HashCache::HashCache(std::string _cache_path) : cache_path(_cache_path) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        start_time_ns = now.tv_sec * 1000000000L + now.tv_nsec;
+    }
+
+
+    void HashCache::ensure_loaded() {
+        if(loaded) {
+            return;
+        }
+        loaded = true;
+        std::ifstream cache_file(cache_path, std::ios_base::binary);
+        if(!cache_file) {
+            return;
+        }
+
+        char magic[4];
+        unsigned int version{};
+        unsigned long entry_count{};
+        cache_file.read(magic, sizeof(magic));
+        if(!cache_file || memcmp(magic, HASH_CACHE_MAGIC, sizeof(magic)) != 0) {
+            std::cerr << "[Warning] Ignoring invalid hash cache " << cache_path << std::endl;
+            return;
+        }
+        cache_file.read(reinterpret_cast<char*>(&version), sizeof(version));
+        if(!cache_file || le32toh(version) != FORMAT_VERSION) {
+            // Written by a different version. It will simply be replaced.
+            return;
+        }
+        cache_file.read(reinterpret_cast<char*>(&entry_count), sizeof(entry_count));
+        entry_count = le64toh(entry_count);
+
+        // The count is checked against the file size before anything is allocated
+        auto records_start = cache_file.tellg();
+        cache_file.seekg(0, std::ios_base::end);
+        auto records_end = cache_file.tellg();
+        cache_file.seekg(records_start);
+        if(!cache_file || static_cast<unsigned long>(records_end - records_start) != entry_count * sizeof(SerializedHash)) {
+            std::cerr << "[Warning] Ignoring invalid hash cache " << cache_path << std::endl;
+            return;
+        }
+
+        std::vector<SerializedHash> records(entry_count);
+        cache_file.read(reinterpret_cast<char*>(records.data()), entry_count * sizeof(SerializedHash));
+        if(!cache_file) {
+            std::cerr << "[Warning] Ignoring invalid hash cache " << cache_path << std::endl;
+            return;
+        }
+        entries.reserve(entry_count);
+        for(const auto& record : records) {
+            Key key{
+                .dev = le64toh(record.dev),
+                .ino = le64toh(record.ino),
+                .size = le64toh(record.size),
+                .mtime_ns = static_cast<long>(le64toh(record.mtime_ns)),
+            };
+            entries.emplace(key, le64toh(record.hash));
+        }
+    }
+
+
+    std::optional<unsigned long> HashCache::hash_file(const std::string& file_path, long mtime_ns) {
+        auto stats = get_file_stats(file_path);
+        if(!stats.has_value() || stats->type != FileType::File || stats->mtime_ns != mtime_ns) {
+            return std::nullopt;
+        }
+        Key key{.dev = stats->dev, .ino = stats->ino, .size = stats->fsize, .mtime_ns = stats->mtime_ns};
+        {
+            std::unique_lock lk(entries_mtx);
+            ensure_loaded();
+            auto cached = entries.find(key);
+            if(cached != entries.end()) {
+                return cached->second;
+            }
+        }
+
+        auto hash = fmerge::hash_file(file_path, mtime_ns);
+        if(hash.has_value() && mtime_ns <= start_time_ns - RACY_MARGIN_NS) {
+            std::unique_lock lk(entries_mtx);
+            entries.insert_or_assign(key, *hash);
+            modified = true;
+        }
+        return hash;
+    }
+
+
+    void HashCache::prune(const FileTree& tree) {
+        std::unique_lock lk(entries_mtx);
+        if(!loaded || entries.empty()) {
+            // Nothing to drop. The entries of an unread cache are pruned by a later run.
+            return;
+        }
+
+        std::unordered_map<Key, unsigned long, KeyHash> live_entries{};
+        tree.for_each_node([&](std::string_view, FileTree::NodeId node) {
+            if(tree.is_dir(node)) {
+                return;
+            }
+            const auto& metadata = tree.metadata(node);
+            auto entry = entries.find(Key{.dev = metadata.dev, .ino = metadata.ino, .size = metadata.size, .mtime_ns = metadata.mtime_ns});
+            if(entry != entries.end()) {
+                live_entries.insert(*entry);
+            }
+        });
+        if(live_entries.size() != entries.size()) {
+            entries = std::move(live_entries);
+            modified = true;
+        }
+    }
+
+
+    bool HashCache::save() {
+        std::unique_lock lk(entries_mtx);
+        if(!modified) {
+            return true;
+        }
+
+        std::vector<SerializedHash> records{};
+        records.reserve(entries.size());
+        for(const auto& [key, hash] : entries) {
+            records.push_back(SerializedHash{
+                .dev = htole64(key.dev),
+                .ino = htole64(key.ino),
+                .size = htole64(key.size),
+                .mtime_ns = static_cast<long>(htole64(key.mtime_ns)),
+                .hash = htole64(hash),
+            });
+        }
+
+        // Written to a temporary file first, so that an interrupted run never leaves a truncated cache
+        std::string tmp_path = cache_path + ".tmp";
+        std::ofstream cache_file(tmp_path, std::ios_base::binary | std::ios_base::trunc);
+        if(!cache_file) {
+            std::cerr << "[Warning] Failed to write hash cache " << tmp_path << std::endl;
+            return false;
+        }
+        unsigned int version = htole32(FORMAT_VERSION);
+        unsigned long entry_count = htole64(records.size());
+        cache_file.write(HASH_CACHE_MAGIC, sizeof(HASH_CACHE_MAGIC));
+        cache_file.write(reinterpret_cast<const char*>(&version), sizeof(version));
+        cache_file.write(reinterpret_cast<const char*>(&entry_count), sizeof(entry_count));
+        cache_file.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(SerializedHash));
+
+        cache_file.close();
+        if(!cache_file) {
+            std::cerr << "[Warning] Failed to write hash cache " << tmp_path << std::endl;
+            return false;
+        }
+        if(rename(tmp_path.c_str(), cache_path.c_str()) == -1) {
+            print_clib_error("rename");
+            return false;
+        }
+        modified = false;
+        return true;
+    }
+
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "Filesystem.h"
+
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+
+namespace fmerge {
+
+    class FileTree;
+
+
+    // Persistent cache of content hashes, stored in .fmerge/hashcache.db.
+    //
+    // A file version is identified by its device, inode, size and modification time. As long as
+    // these match, the hash of the last run is reused instead of reading the file again. Like in
+    // the DirCache, versions that were modified shortly before they were hashed are not cached,
+    // since a write within the same timestamp tick would go unnoticed.
+    //
+    // The cache file is only read once a hash is needed, so runs without changed files never pay
+    // for it. Entries of versions that no longer exist are dropped by prune().
+    class HashCache {
+    public:
+        HashCache() = delete;
+        HashCache(std::string _cache_path);
+
+        // Hashes the regular file at file_path, if it still is the version with the modification time
+        // mtime_ns. Returns nullopt if the file could not be read or changed. May be called concurrently.
+        std::optional<unsigned long> hash_file(const std::string& file_path, long mtime_ns);
+
+        // Keeps only the entries of the file versions in the tree (as built by update_file_tree)
+        void prune(const FileTree& tree);
+        // Writes the cache if it changed during this run
+        bool save();
+
+        // Version 2 holds XXH3 hashes
+        static constexpr unsigned int FORMAT_VERSION = 2;
+    private:
+        struct Key {
+            unsigned long dev;
+            unsigned long ino;
+            unsigned long size;
+            long mtime_ns;
+
+            friend bool operator==(const Key& lhs, const Key& rhs) {
+                return lhs.dev == rhs.dev && lhs.ino == rhs.ino && lhs.size == rhs.size && lhs.mtime_ns == rhs.mtime_ns;
+            }
+        };
+
+        struct KeyHash {
+            size_t operator()(const Key& key) const {
+                return std::hash<unsigned long>{}(key.ino ^ (key.dev << 48) ^ static_cast<unsigned long>(key.mtime_ns) * 0x9e3779b97f4a7c15ul);
+            }
+        };
+
+        // Reads the cache file on first use. Must be called with entries_mtx held.
+        void ensure_loaded();
+
+        std::string cache_path;
+        // Time at which this run started (ns since epoch)
+        long start_time_ns;
+
+        std::mutex entries_mtx;
+        bool loaded{false};
+        bool modified{false};
+        std::unordered_map<Key, unsigned long, KeyHash> entries;
+    };
+
+}
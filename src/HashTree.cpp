@@ -0,0 +1,148 @@
+#include "HashTree.h"
+
+#include "Util.h"
+
+#include <algorithm>
+#include <endian.h>
+
+
+namespace fmerge {
+
+    static unsigned long hash_value(unsigned long value, unsigned long hash) {
+        value = htole64(value);
+        return fnv1a_hash(std::string_view(reinterpret_cast<const char*>(&value), sizeof(value)), hash);
+    }
+
+
+    HashTree::HashTree(std::vector<Change> _changes) : changes(std::move(_changes)) {
+        nodes.push_back(Node{});
+        nodes_by_path.emplace("", 0);
+        for(size_t i = 0; i < changes.size(); i++) {
+            nodes[find_or_create(changes[i].file.path)].history.push_back(i);
+        }
+        compute_hashes();
+        described.push_back(0);
+    }
+
+
+    HashTree::NodeId HashTree::find_or_create(const std::string& path) {
+        auto existing = nodes_by_path.find(path);
+        if(existing != nodes_by_path.end()) {
+            return existing->second;
+        }
+
+        auto separator = path.rfind('/');
+        NodeId parent = find_or_create(separator == std::string::npos ? std::string{} : path.substr(0, separator));
+        NodeId node = static_cast<NodeId>(nodes.size());
+        nodes.push_back(Node{.path = path});
+        nodes[parent].children.push_back(node);
+        nodes_by_path.emplace(path, node);
+        return node;
+    }
+
+
+    void HashTree::compute_hashes() {
+        // Children always have a higher id than their parent, so a reverse pass sees them first
+        for(NodeId id = static_cast<NodeId>(nodes.size()); id-- > 0;) {
+            auto& node = nodes[id];
+            // Both peers have to combine the children in the same order
+            std::sort(node.children.begin(), node.children.end(), [this](NodeId l, NodeId r) {
+                return nodes[l].path < nodes[r].path;
+            });
+
+            // A checkpoint carries the digest of the changes it replaces, so a compacted history
+            // hashes the same as the full one
+            unsigned long own_hash{FNV_OFFSET_BASIS};
+            for(auto index : node.history) {
+                const auto& change = changes[index];
+                if(change.type == ChangeType::Checkpoint) {
+                    own_hash = change.content_hash;
+                } else {
+                    own_hash = extend_history_digest(own_hash, change);
+                }
+            }
+
+            unsigned long hash = hash_value(own_hash, FNV_OFFSET_BASIS);
+            for(auto child : node.children) {
+                hash = hash_value(nodes[child].path.length(), hash);
+                hash = fnv1a_hash(nodes[child].path, hash);
+                hash = hash_value(nodes[child].hash, hash);
+            }
+            node.own_hash = own_hash;
+            node.hash = hash;
+        }
+    }
+
+
+    NodeHash HashTree::describe(NodeId node) const {
+        return NodeHash{
+            .path = nodes[node].path,
+            .hash = nodes[node].hash,
+            .own_hash = nodes[node].own_hash,
+            .children = static_cast<unsigned int>(nodes[node].children.size()),
+        };
+    }
+
+
+    std::vector<NodeHash> HashTree::round_entries() const {
+        std::vector<NodeHash> entries{};
+        entries.reserve(described.size());
+        for(auto node : described) {
+            entries.push_back(describe(node));
+        }
+        return entries;
+    }
+
+
+    bool HashTree::next_round(const std::vector<NodeHash>& peer_entries) {
+        std::unordered_map<std::string_view, const NodeHash*> peer_nodes{};
+        peer_nodes.reserve(peer_entries.size());
+        for(const auto& entry : peer_entries) {
+            peer_nodes.emplace(entry.path, &entry);
+        }
+
+        // The exchange has to go on as long as either peer has children in a differing directory,
+        // even if there are no local ones to describe.
+        bool differing_dirs{false};
+        std::vector<NodeId> next_described{};
+        for(auto id : described) {
+            const auto& node = nodes[id];
+            auto peer_node = peer_nodes.find(node.path);
+            if(peer_node == peer_nodes.end()) {
+                // The peer has never seen this path
+                collect_subtree(id);
+                continue;
+            }
+            if(peer_node->second->hash == node.hash) {
+                continue;
+            }
+            if(peer_node->second->own_hash != node.own_hash) {
+                collect_own(id);
+            }
+            if(!node.children.empty() || peer_node->second->children > 0) {
+                differing_dirs = true;
+                next_described.insert(next_described.end(), node.children.begin(), node.children.end());
+            }
+        }
+
+        described = std::move(next_described);
+        current_round++;
+        return differing_dirs;
+    }
+
+
+    void HashTree::collect_subtree(NodeId node) {
+        collect_own(node);
+        for(auto child : nodes[node].children) {
+            collect_subtree(child);
+        }
+    }
+
+
+    void HashTree::collect_own(NodeId node) {
+        for(auto index : nodes[node].history) {
+            peer_changes.push_back(changes[index]);
+        }
+    }
+
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "FileTree.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+namespace fmerge {
+
+    // Hashes of one node of a HashTree, as exchanged with the peer
+    struct NodeHash {
+        std::string path;
+        // Covers the history of the node and all of its descendants
+        unsigned long hash;
+        // Covers only the history of the path itself
+        unsigned long own_hash;
+        unsigned int children;
+    };
+
+
+    // Merkle tree over the change histories of all paths in the change log.
+    //
+    // The merge only looks at the per-path change histories, so a subtree whose histories are
+    // identical on both peers merges to exactly the local histories and can be left out of the
+    // exchange. Deleted paths still have a history, which is why the tree is built from the log
+    // and not from the file tree on disk. Directory changes are hashed without their times,
+    // like is_change_equal compares them.
+    //
+    // Both peers walk their trees top-down in rounds. Each round describes the children of the
+    // directories that differed in the last round. After comparing the descriptions of the peer,
+    // both sides arrive at the same set of differing directories, so they also agree on when the
+    // exchange is complete. Only the changes of differing paths have to be sent afterwards.
+    class HashTree {
+    public:
+        HashTree() = delete;
+        explicit HashTree(std::vector<Change> changes);
+
+        // Entries describing the local nodes of the current round
+        std::vector<NodeHash> round_entries() const;
+        // Compares the entries of the peer for the current round with the local ones, collects the
+        // changes that the peer does not have, and moves on to the next round.
+        // Returns false once no differing directories are left.
+        bool next_round(const std::vector<NodeHash>& peer_entries);
+
+        unsigned int round() const { return current_round; }
+        // Changes of the paths whose history differs from the peer, in log order per path
+        const std::vector<Change>& changes_for_peer() const { return peer_changes; }
+    private:
+        typedef unsigned int NodeId;
+
+        struct Node {
+            std::string path{};
+            std::vector<NodeId> children{};
+            // Indices into changes, in log order
+            std::vector<size_t> history{};
+            unsigned long own_hash{};
+            unsigned long hash{};
+        };
+
+        NodeId find_or_create(const std::string& path);
+        void compute_hashes();
+        NodeHash describe(NodeId node) const;
+        void collect_subtree(NodeId node);
+        void collect_own(NodeId node);
+
+        std::vector<Change> changes;
+        // Parents always come before their children
+        std::vector<Node> nodes;
+        std::unordered_map<std::string, NodeId> nodes_by_path;
+
+        unsigned int current_round{0};
+        // Nodes described in the current round
+        std::vector<NodeId> described;
+        std::vector<Change> peer_changes;
+    };
+
+}
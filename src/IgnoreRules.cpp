@@ -0,0 +1,244 @@
+#include "IgnoreRules.h"
+
+#include "FileTree.h"
+
+#include <fnmatch.h>
+#include <fstream>
+#include <algorithm>
+
+
+namespace fmerge {
+
+    // Always ignored, regardless of the user rules
+    constexpr const char* BUILTIN_PATTERN = "/.fmerge/";
+
+
+    static std::vector<std::string> split_components(const std::string& path) {
+        std::vector<std::string> components{};
+        size_t last = 0;
+        while(last <= path.length()) {
+            size_t pos = path.find('/', last);
+            if(pos == std::string::npos) {
+                pos = path.length();
+            }
+            if(pos > last) {
+                components.push_back(path.substr(last, pos - last));
+            }
+            last = pos + 1;
+        }
+        return components;
+    }
+
+
+    static bool is_literal(const std::string& component) {
+        return component.find_first_of("*?[\\") == std::string::npos;
+    }
+
+
+    IgnoreRules::IgnoreRules() {
+        nodes.emplace_back();
+        add_pattern(BUILTIN_PATTERN);
+    }
+
+
+    IgnoreRules IgnoreRules::load(std::string base_path) {
+        IgnoreRules rules{};
+        std::ifstream ignore_file(join_path(base_path, ".fmergeignore"));
+        if(!ignore_file) {
+            return rules;
+        }
+        std::string line{};
+        while(std::getline(ignore_file, line)) {
+            rules.add_pattern(line);
+        }
+        // The built-in rule must have the highest priority, so that it cannot be negated
+        rules.add_pattern(BUILTIN_PATTERN);
+        return rules;
+    }
+
+
+    void IgnoreRules::add_pattern(std::string line) {
+        pattern_hash = fnv1a_hash(line, pattern_hash);
+        pattern_hash = fnv1a_hash("\n", pattern_hash);
+        // Trailing whitespace (and carriage returns) is not part of the pattern
+        while(!line.empty() && (line.back() == ' ' || line.back() == '\r' || line.back() == '\t')) {
+            line.pop_back();
+        }
+        if(line.empty() || line[0] == '#') {
+            return;
+        }
+
+        bool negated{false};
+        if(line[0] == '!') {
+            negated = true;
+            line.erase(0, 1);
+        } else if(line[0] == '\\' && line.length() > 1 && (line[1] == '!' || line[1] == '#')) {
+            line.erase(0, 1);
+        }
+
+        bool dir_only{false};
+        if(line.back() == '/') {
+            dir_only = true;
+            line.pop_back();
+        }
+        // A slash anywhere but at the end anchors the pattern to the root
+        bool anchored = line.find('/') != std::string::npos;
+
+        auto components = split_components(line);
+        if(components.empty()) {
+            return;
+        }
+        if(!anchored) {
+            components.insert(components.begin(), "**");
+        }
+        if(components.back() == "**") {
+            // "dir/**" matches everything inside dir, but not dir itself
+            components.push_back("*");
+        }
+
+        int node = 0;
+        for(const auto& component : components) {
+            node = add_child(node, component);
+        }
+
+        int rule_index = static_cast<int>(negated_rules.size());
+        negated_rules.push_back(negated);
+        if(dir_only) {
+            nodes[node].dir_rule = rule_index;
+        } else {
+            nodes[node].rule = rule_index;
+        }
+    }
+
+
+    int IgnoreRules::add_child(int parent, const std::string& component) {
+        int child{-1};
+        if(component == "**") {
+            child = nodes[parent].any_depth_child;
+        } else if(is_literal(component)) {
+            auto it = nodes[parent].literal_children.find(component);
+            if(it != nodes[parent].literal_children.end()) {
+                child = it->second;
+            }
+        } else {
+            for(const auto& [glob, glob_child] : nodes[parent].glob_children) {
+                if(glob == component) {
+                    child = glob_child;
+                }
+            }
+        }
+        if(child != -1) {
+            return child;
+        }
+
+        // Note: May invalidate references into nodes
+        child = static_cast<int>(nodes.size());
+        nodes.emplace_back();
+        if(component == "**") {
+            nodes[child].any_depth = true;
+            nodes[parent].any_depth_child = child;
+        } else if(is_literal(component)) {
+            nodes[parent].literal_children.emplace(component, child);
+        } else {
+            nodes[parent].glob_children.emplace_back(component, child);
+        }
+        return child;
+    }
+
+
+    void IgnoreRules::close_state(State& state) const {
+        // A ** node also matches zero components. The loop also visits the nodes added by itself.
+        for(size_t i = 0; i < state.size(); i++) {
+            int any_depth_child = nodes[state[i]].any_depth_child;
+            if(any_depth_child != -1) {
+                state.push_back(any_depth_child);
+            }
+        }
+        std::sort(state.begin(), state.end());
+        state.erase(std::unique(state.begin(), state.end()), state.end());
+    }
+
+
+    IgnoreRules::State IgnoreRules::root_state() const {
+        State state{0};
+        close_state(state);
+        return state;
+    }
+
+
+    IgnoreRules::State IgnoreRules::state_for(const std::string& relative_path) const {
+        State state = root_state();
+        for(const auto& component : split_components(relative_path)) {
+            state = step(state, component);
+        }
+        return state;
+    }
+
+
+    IgnoreRules::State IgnoreRules::step(const State& dir_state, const std::string& name) const {
+        State state{};
+        for(int node_index : dir_state) {
+            const Node& node = nodes[node_index];
+            if(node.any_depth) {
+                state.push_back(node_index);
+            }
+            auto it = node.literal_children.find(name);
+            if(it != node.literal_children.end()) {
+                state.push_back(it->second);
+            }
+            for(const auto& [glob, glob_child] : node.glob_children) {
+                if(fnmatch(glob.c_str(), name.c_str(), 0) == 0) {
+                    state.push_back(glob_child);
+                }
+            }
+        }
+        close_state(state);
+        return state;
+    }
+
+
+    bool IgnoreRules::ignored(const State& entry_state, bool is_dir) const {
+        int rule{-1};
+        for(int node_index : entry_state) {
+            const Node& node = nodes[node_index];
+            rule = std::max(rule, node.rule);
+            if(is_dir) {
+                rule = std::max(rule, node.dir_rule);
+            }
+        }
+        return rule != -1 && !negated_rules[rule];
+    }
+
+
+    bool IgnoreRules::ignored(const std::string& relative_path, bool is_dir) const {
+        auto components = split_components(relative_path);
+        State state = root_state();
+        for(size_t i = 0; i < components.size(); i++) {
+            state = step(state, components[i]);
+            bool last = (i + 1) == components.size();
+            // Everything inside an ignored directory is ignored
+            if(ignored(state, last ? is_dir : true)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    bool IgnoreRules::ignored(const File& file) const {
+        return ignored(file.path, file.is_dir());
+    }
+
+
+    std::vector<Change> filter_ignored_changes(const std::vector<Change>& changes, const IgnoreRules& rules) {
+        std::vector<Change> filtered{};
+        filtered.reserve(changes.size());
+        for(const auto& change : changes) {
+            if(change.type == ChangeType::TerminateList || !rules.ignored(change.file)) {
+                filtered.push_back(change);
+            }
+        }
+        return filtered;
+    }
+
+}
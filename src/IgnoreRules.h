@@ -0,0 +1,80 @@
+#pragma once
+
+#include "Filesystem.h"
+#include "Util.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+namespace fmerge {
+
+    class Change;
+
+    // Ignore rules of a folder, read from the .fmergeignore file in its root.
+    //
+    // The file uses a subset of the gitignore syntax:
+    //  * One glob per line (*, ? and [...]). Blank lines and lines starting with # are skipped.
+    //  * A pattern without a slash matches the name of an entry at any depth.
+    //    A pattern with a slash is anchored to the root of the folder. ** matches any number of directories.
+    //  * A trailing slash only matches directories.
+    //  * A leading ! re-includes entries that were excluded by an earlier pattern. The last matching pattern wins.
+    // Everything below an ignored directory is ignored as well, since the directory is never read.
+    // The .fmerge directory is always ignored.
+    //
+    // All patterns are compiled into a single trie of path components, which is walked like an
+    // NFA. Literal components are looked up in a hash table, so the cost per entry does not grow
+    // with the number of plain name patterns (node_modules, build, ...).
+    class IgnoreRules {
+    public:
+        // Set of active trie nodes after matching the components of a directory path
+        typedef std::vector<int> State;
+
+        // Only the built-in rules
+        IgnoreRules();
+        // Loads <base_path>/.fmergeignore, if it exists
+        static IgnoreRules load(std::string base_path);
+        // Adds one line of an ignore file
+        void add_pattern(std::string line);
+        // Changes whenever different patterns were added
+        unsigned long fingerprint() const { return pattern_hash; }
+
+        // State of the root directory
+        State root_state() const;
+        // State of the directory at relative_path
+        State state_for(const std::string& relative_path) const;
+        // Advances the state of a directory to one of its entries
+        State step(const State& dir_state, const std::string& name) const;
+        // Whether the entry described by the state returned from step() is ignored
+        bool ignored(const State& entry_state, bool is_dir) const;
+
+        // Convenience function for a full relative path
+        bool ignored(const std::string& relative_path, bool is_dir) const;
+        bool ignored(const File& file) const;
+    private:
+        struct Node {
+            std::unordered_map<std::string, int> literal_children{};
+            std::vector<std::pair<std::string, int>> glob_children{};
+            // Child that matches any number of path components (**)
+            int any_depth_child{-1};
+            bool any_depth{false};
+            // Highest priority rule that ends in this node, for all entries and for directories only
+            int rule{-1};
+            int dir_rule{-1};
+        };
+
+        int add_child(int parent, const std::string& component);
+        // Adds the ** children of the given nodes
+        void close_state(State& state) const;
+
+        std::vector<Node> nodes;
+        // Whether the rule with the given index re-includes entries
+        std::vector<bool> negated_rules;
+        unsigned long pattern_hash{FNV_OFFSET_BASIS};
+    };
+
+    // Removes all changes that refer to ignored paths
+    std::vector<Change> filter_ignored_changes(const std::vector<Change>& changes, const IgnoreRules& rules);
+
+}
@@ -1,9 +1,11 @@
 #include "MergeAlgorithms.h"
 
 #include "Terminal.h"
+#include "Util.h"
 
 #include <iomanip>
 #include <map>
+#include <tuple>
 
 
 namespace fmerge {
@@ -18,6 +20,10 @@ namespace fmerge {
             os << "PLACEHOLDER_REVERT";
         } else if(fop_type == FileOperationType::Transfer) {
             os << "TRANSFER";
+        } else if(fop_type == FileOperationType::Move) {
+            os << "MOVE";
+        } else if(fop_type == FileOperationType::Touch) {
+            os << "TOUCH";
         } else {
             os << "UNKNOWN";
         }
@@ -26,7 +32,11 @@ namespace fmerge {
 
 
     std::ostream& operator<<(std::ostream& os, const FileOperation& fop) {
-        os << std::setw(64) << std::left << fop.path << ": " << fop.type << std::endl;
+        os << std::setw(64) << std::left << fop.path << ": " << fop.type;
+        if(fop.type == FileOperationType::Move) {
+            os << " from " << fop.source;
+        }
+        os << std::endl;
         return os;
     }
 
@@ -150,23 +160,151 @@ namespace fmerge {
     }
 
 
+    // Whether both histories end in an existing file with the same (known) contents
+    static bool same_final_contents(const std::vector<Change> &rem, const std::vector<Change> &loc) {
+        if(rem.empty() || loc.empty() || squash_changes(rem) == 0 || squash_changes(loc) == 0) {
+            return false;
+        }
+        const auto& rem_last = rem.back();
+        const auto& loc_last = loc.back();
+        return rem_last.file.is_file() && loc_last.file.is_file() && rem_last.content_hash != 0 &&
+            rem_last.content_hash == loc_last.content_hash;
+    }
+
+
+    // Every field of a change that is sent to the peer, so that both peers order histories the same way
+    static auto change_key(const Change &change) {
+        return std::make_tuple(change.earliest_change_time, change.latest_change_time, change.mtime_ns,
+            static_cast<int>(change.type), static_cast<int>(change.file.type), change.size, change.ino, change.dev,
+            change.content_hash, std::string_view(change.file.path), std::string_view(change.moved_from));
+    }
+
+
+    // Orders histories independently of which peer they belong to: by the time of the last version,
+    // then by length, then change by change. Histories that differ in any field that is sent to the
+    // peer are never equivalent.
+    static bool history_less(const std::vector<Change> &lhs, const std::vector<Change> &rhs) {
+        if(lhs.back().mtime_ns != rhs.back().mtime_ns) {
+            return lhs.back().mtime_ns < rhs.back().mtime_ns;
+        }
+        if(lhs.size() != rhs.size()) {
+            return lhs.size() < rhs.size();
+        }
+        for(size_t i = 0; i < lhs.size(); i++) {
+            auto lhs_key = change_key(lhs[i]);
+            auto rhs_key = change_key(rhs[i]);
+            if(lhs_key != rhs_key) {
+                return lhs_key < rhs_key;
+            }
+        }
+        return false;
+    }
+
+
+    // Number of changes that are replaced by the checkpoint at the start of the history, if any
+    static size_t checkpoint_length(const std::vector<Change> &history) {
+        if(!history.empty() && history.front().type == ChangeType::Checkpoint) {
+            return history.front().size;
+        }
+        return 0;
+    }
+
+
+    // Number of changes the history stands for
+    static size_t history_length(const std::vector<Change> &history) {
+        size_t compacted = checkpoint_length(history);
+        return compacted > 0 ? compacted + history.size() - 1 : history.size();
+    }
+
+
+    // The change at index i of the full history. It must not be replaced by the checkpoint.
+    static const Change& change_at(const std::vector<Change> &history, size_t i) {
+        size_t compacted = checkpoint_length(history);
+        return compacted > 0 ? history[i - compacted + 1] : history[i];
+    }
+
+
+    // Digest of the first length changes of the history, which must include its checkpoint
+    static unsigned long prefix_digest(const std::vector<Change> &history, size_t length) {
+        size_t compacted = checkpoint_length(history);
+        unsigned long digest = compacted > 0 ? history.front().content_hash : FNV_OFFSET_BASIS;
+        for(size_t i = compacted; i < length; i++) {
+            digest = extend_history_digest(digest, change_at(history, i));
+        }
+        return digest;
+    }
+
+
     std::optional<std::vector<Change>> try_automatic_resolution(const std::vector<Change> &rem, const std::vector<Change> &loc) {
         // Algorithms used to merge the change lists:
         // Equal stems: Check if one branch is ahead of the other. The just fast-forward it a la git.
-        for(size_t i = 0; i < loc.size(); i++) {
-            if(i >= rem.size()) {
-                // The change lists match up to the latest common additions.
-                break;
-            } else if(!is_change_equal(rem[i], loc[i])) {
-                return std::nullopt;
+        // Changes that were compacted on either side can only be compared by their digest. A history that
+        // ends within the checkpoint of the other one cannot be compared at all.
+        size_t common_length = std::min(history_length(rem), history_length(loc));
+        size_t compacted = std::max(checkpoint_length(rem), checkpoint_length(loc));
+        bool equal_stems = compacted <= common_length;
+        if(equal_stems && compacted > 0) {
+            equal_stems = prefix_digest(rem, compacted) == prefix_digest(loc, compacted);
+        }
+        for(size_t i = compacted; equal_stems && i < common_length; i++) {
+            equal_stems = is_change_equal(change_at(rem, i), change_at(loc, i));
+        }
+        if(!equal_stems) {
+            // Equal contents: Both branches ended up with the same file. Only its modification time
+            // may have to be adjusted.
+            if(same_final_contents(rem, loc)) {
+                return history_less(loc, rem) ? rem : loc;
             }
+            return std::nullopt;
         }
+
         // The change list stems match. Now take the longer change list
-        if(loc.size() >= rem.size()) {
+        if(history_length(loc) >= history_length(rem)) {
             return loc;
-        } else {
-            return rem;
         }
+        // Only the new changes are taken from the peer, so that the local history is never compacted further
+        // than this peer decided to. Other peers may not have acknowledged the changes of the remote checkpoint.
+        std::vector<Change> merged = loc;
+        for(size_t i = history_length(loc); i < history_length(rem); i++) {
+            merged.push_back(change_at(rem, i));
+        }
+        return merged;
+    }
+
+
+    size_t compact_history(std::vector<Change> &history, long checkpoint_ns) {
+        // The last change describes the current version and is always kept
+        size_t acknowledged{0};
+        while(acknowledged + 1 < history.size() && history[acknowledged].log_time_ns != 0 &&
+                history[acknowledged].log_time_ns <= checkpoint_ns) {
+            acknowledged++;
+        }
+        if(acknowledged < 2) {
+            // Replacing a single change by a checkpoint would not save anything
+            return 0;
+        }
+
+        size_t compacted = checkpoint_length(history);
+        size_t first = compacted > 0 ? 1 : 0;
+        unsigned long digest = compacted > 0 ? history.front().content_hash : FNV_OFFSET_BASIS;
+        long log_time_ns{0};
+        for(size_t i = 0; i < acknowledged; i++) {
+            if(i >= first) {
+                digest = extend_history_digest(digest, history[i]);
+                compacted++;
+            }
+            log_time_ns = std::max(log_time_ns, history[i].log_time_ns);
+        }
+        Change checkpoint{
+            .type = ChangeType::Checkpoint,
+            .file = File{.path = history.front().file.path, .type = history[acknowledged - 1].file.type},
+            .size = compacted,
+            .content_hash = digest,
+            .log_time_ns = log_time_ns,
+        };
+        history.erase(history.begin() + 1, history.begin() + static_cast<long>(acknowledged));
+        history.front() = std::move(checkpoint);
+        return acknowledged - 1;
     }
 
 
@@ -181,6 +319,27 @@ namespace fmerge {
                 ops.emplace(target_changes.first, construct_operations(std::vector<Change>{}, target_changes.second));
             }
         }
+
+        for(auto &file_ops : ops) {
+            const auto &last_change = target.at(file_ops.first).back();
+            if(last_change.type != ChangeType::Move || file_ops.second.size() != 1 || file_ops.second.back().type != FileOperationType::Transfer) {
+                continue;
+            }
+            // The old path has to hold the moved version locally, and must be deleted by the merge
+            auto source_current = current.find(last_change.moved_from);
+            auto source_ops = ops.find(last_change.moved_from);
+            if(source_current == current.end() || source_ops == ops.end() || !source_current->second.back().file.is_file() ||
+                squash_changes(source_current->second) != last_change.mtime_ns) {
+                continue;
+            }
+            if(source_ops->second.size() != 1 || source_ops->second.back().type != FileOperationType::Delete) {
+                // Not deleted, or already used by another move
+                continue;
+            }
+            file_ops.second = {FileOperation(FileOperationType::Move, file_ops.first, last_change.moved_from)};
+            // The path stays in the set, so that its change history is still updated after the sync
+            source_ops->second.clear();
+        }
         return ops;
     }
 
@@ -203,7 +362,11 @@ namespace fmerge {
             // A version of the file exists in the target state
             if(target_mtime != current_mtime) {
                 // The file versions are not identical
-                ops.push_back(FileOperation(FileOperationType::Transfer, target.back().file.path));
+                if(same_final_contents(target, current)) {
+                    ops.push_back(FileOperation(FileOperationType::Touch, target.back().file.path, target_mtime));
+                } else {
+                    ops.push_back(FileOperation(FileOperationType::Transfer, target.back().file.path));
+                }
             }
             // else
             //      The file versions are identical. Do not do anything
@@ -321,7 +484,8 @@ namespace fmerge {
             switch(change.type) {
             case ChangeType::Creation:
             case ChangeType::Modification:
-                mtime = change.earliest_change_time;
+            case ChangeType::Move:
+                mtime = change.mtime_ns;
                 break;
             case ChangeType::Deletion:
                 mtime = 0;
@@ -344,9 +508,15 @@ namespace fmerge {
         if(!lhs.file.is_dir() && (lhs.latest_change_time != rhs.latest_change_time)) {
             return false;
         }
+        if(!lhs.file.is_dir() && (lhs.mtime_ns != rhs.mtime_ns)) {
+            return false;
+        }
         if(lhs.type != rhs.type) {
             return false;
         }
+        if(lhs.type == ChangeType::Checkpoint && (lhs.size != rhs.size || lhs.content_hash != rhs.content_hash)) {
+            return false;
+        }
         if(lhs.file.path != rhs.file.path) {
             return false;
         }
@@ -20,6 +20,10 @@ namespace fmerge {
         Transfer,
         Delete,
         CreateFolder,
+        // Renames a local file that already is the required version, instead of transferring it again
+        Move,
+        // Sets the modification time of a local file whose contents already are the required version
+        Touch,
         // We cannot revert files, since their historical variants don't exist.
         // This is still required as the anti-operation that is applied to modications that will
         // be overwritten. In theory it should always become optimized away after we simplify the
@@ -34,9 +38,15 @@ namespace fmerge {
     // the new, unified file structure
     struct FileOperation {
         FileOperation(FileOperationType _type, std::string _path) : type(_type), path(_path) {};
+        FileOperation(FileOperationType _type, std::string _path, std::string _source) : type(_type), path(_path), source(_source) {};
+        FileOperation(FileOperationType _type, std::string _path, long _mtime_ns) : type(_type), path(_path), mtime_ns(_mtime_ns) {};
 
         FileOperationType type;
         std::string path;
+        // Only used by moves: path of the local file that is moved to path
+        std::string source{};
+        // Only used by touches: modification time of the required version
+        long mtime_ns{};
 
         friend std::ostream& operator<<(std::ostream& os, const FileOperation& fop);
     };
@@ -93,12 +103,21 @@ namespace fmerge {
 
     // Merges two lists of changes into a single list containing both sets. 
     // Will fail if an obvious merge is not possible and user intervention is required.
+    // Histories that end in files with the same content hash are merged to one of them, which is
+    // chosen the same way on both peers.
     optional<vector<Change>> try_automatic_resolution(const vector<Change> &rem, const vector<Change> &loc);
 
+    // Replaces the changes at the start of the history that entered the change log up to checkpoint_ns by a
+    // checkpoint (see ChangeType::Checkpoint). Returns the number of changes that were removed.
+    size_t compact_history(vector<Change> &history, long checkpoint_ns);
+
     // Create an unordered map of file operations for each file-key.
+    // Files that were moved by the peer are moved locally as well, if the local file at the old path
+    // is the same version and would be deleted otherwise.
     SortedOperationSet construct_operation_set(const SortedChangeSet &current, const SortedChangeSet& target);
 
-    // Create a list of file operations that create the given changes that originate from the remote
+    // Create a list of file operations that create the given changes that originate from the remote.
+    // A file whose contents are known to match the target version is only touched.
     std::vector<FileOperation> construct_operations(const vector<Change> &current, const vector<Change> &target);
 
     // Simplify the list of file operations to be performed to a minimal set.
@@ -114,7 +133,7 @@ namespace fmerge {
     void print_conflicts(const std::vector<Conflict>& conflicts);
 
     /// Simplify the list of changes to the final resulting file
-    /// @returns Timestamp of latest modification if file exists, or 0 if it is deleted.
+    /// @returns Timestamp of latest modification in nanoseconds if file exists, or 0 if it is deleted.
     /// The timestamp is used as a unique hash to identify a specific file revision in this case.
     long squash_changes(const vector<Change> &changes);
 
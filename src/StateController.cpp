@@ -1,5 +1,6 @@
 #include "StateController.h"
 
+#include "ChangeLog.h"
 #include "ConflictResolver.h"
 #include "Errors.h"
 #include "Terminal.h"
@@ -7,6 +8,7 @@
 #include "Version.h"
 #include "protocol/NetProtocolRegistry.h"
 
+#include <algorithm>
 #include <memory>
 #include <fstream>
 #include <uuid/uuid.h>
@@ -20,6 +22,9 @@ namespace fmerge {
     }
 
     void StateController::run() {
+        // Sent before listening, since the version message of the peer already moves us on to the next state
+        LOG("Checking version" << std::endl);
+        send_version();
         c->listen(
             [this](auto msg) { handle_message(msg); },
             [this]() { handle_peer_disconnect(); }
@@ -30,8 +35,6 @@ namespace fmerge {
             auto old_state = state.load();
             switch(old_state) {
             case State::AwaitingVersion:
-                LOG("Checking version" << std::endl);
-                send_version();
                 break;
             case State::SendTree:
                 break;
@@ -75,6 +78,8 @@ namespace fmerge {
             return handle_exiting_state_message(std::dynamic_pointer_cast<ExitingStateMessage>(msg));
         } else if(msg->type() == MsgType::ConflictResolutions) {
             return handle_resolutions_message(std::dynamic_pointer_cast<ConflictResolutionsMessage>(msg));
+        } else if(msg->type() == MsgType::TreeHashes) {
+            return handle_tree_hashes_message(std::dynamic_pointer_cast<TreeHashesMessage>(msg));
         } else {
             LOG("[Error] Received invalid message with type " << msg->type() << std::endl);
         }
@@ -111,7 +116,13 @@ namespace fmerge {
 
     void StateController::handle_version_message(std::shared_ptr<VersionMessage> msg) {
         auto& ver_payload = msg->get_payload();
-        auto peer_version = ver_payload.substr(0, ver_payload.find(';'));
+        auto separator = ver_payload.find(';');
+        auto peer_version = ver_payload.substr(0, separator);
+        if(separator != std::string::npos) {
+            state_lock.lock();
+            peer_uuid = ver_payload.substr(separator + 1);
+            state_lock.unlock();
+        }
 
         auto version_ok = check_peer_version(g_fmerge_version, peer_version);
         if (version_ok != NoError) { 
@@ -201,17 +212,22 @@ namespace fmerge {
             state_lock.lock();
             state = State::SyncingFiles;
             state_lock.unlock();
-        } else if(msg->get_payload().state == State::SyncingFiles) {
+        } else if(msg->get_payload().state == State::SyncingFiles || msg->get_payload().state == State::Finished) {
+            // The peer reports Finished if all of its files were synced
             state_lock.lock();
             peer_finished.store(true);
+            peer_synced = msg->get_payload().state == State::Finished;
             if(state.load() == State::Finished) {
+                if(synced && peer_synced) {
+                    record_checkpoint();
+                }
                 state = State::Exiting;
             }
             state_lock.unlock();
         } else if(msg->get_payload().state == State::AwaitingVersion) {
             // The user accepted the version difference at the peer
             term()->cancel_prompt();
-            LOG("Sending file tree" << std::endl);
+            LOG("Comparing file tree with peer" << std::endl);
             send_filetree();
         } else {
             std::cerr << "Error: Received unknown exit state message from peer" << std::endl;
@@ -249,24 +265,80 @@ namespace fmerge {
     }
 
 
+    void StateController::handle_tree_hashes_message(std::shared_ptr<TreeHashesMessage> msg) {
+        const auto& payload = msg->get_payload();
+        std::unique_lock lk(hashes_mtx);
+        // The peer can be one round ahead of us
+        hashes_cv.wait(lk, [this, &payload]() { return local_hashes && local_hashes->round() == payload.round; });
+
+        if(local_hashes->next_round(payload.nodes)) {
+            c->send_message(std::make_shared<TreeHashesMessage>(
+                std::make_unique<TreeHashesPayload>(local_hashes->round(), local_hashes->round_entries())
+            ));
+        } else {
+            // Both sides agree that the remaining paths are identical
+            LOG("Compared file trees in " << local_hashes->round() << " rounds" << std::endl);
+            c->send_message(std::make_shared<ChangesMessage>(local_hashes->changes_for_peer()));
+        }
+        lk.unlock();
+        hashes_cv.notify_all();
+    }
+
+
     void StateController::send_filetree() {
-        c->send_message(std::make_shared<ChangesMessage>(read_changes(path)));
+        // Instead of the whole change log, only the histories that differ from the peer are sent
+        // once the tree hashes have been compared (see HashTree).
+        std::unique_lock lk(hashes_mtx);
+        local_hashes = std::make_unique<HashTree>(filter_ignored_changes(read_changes(path), ignore_rules));
+        c->send_message(std::make_shared<TreeHashesMessage>(
+            std::make_unique<TreeHashesPayload>(local_hashes->round(), local_hashes->round_entries())
+        ));
+        lk.unlock();
+        hashes_cv.notify_all();
+    }
+
+
+    // Same as filter_ignored_changes, for changes that are sorted by file
+    static void filter_ignored_histories(SortedChangeSet& sorted_changes, const IgnoreRules& rules) {
+        for(auto file = sorted_changes.begin(); file != sorted_changes.end();) {
+            auto& history = file->second;
+            history.erase(std::remove_if(history.begin(), history.end(), [&rules](const Change& change) {
+                return rules.ignored(change.file);
+            }), history.end());
+            file = history.empty() ? sorted_changes.erase(file) : std::next(file);
+        }
     }
 
 
     void StateController::do_merge() {
         state = State::ResolvingConflicts;
         state_lock.lock();
-        auto sorted_peer_changes = sort_changes_by_file(peer_changes);
+        auto sorted_peer_changes = sort_changes_by_file(filter_ignored_changes(peer_changes, ignore_rules));
 
         // print_sorted_changes(sorted_peer_changes);
 
         // LOG("Merging..." << std::endl);
-        sorted_local_changes = sort_changes_by_file(read_changes(path));
+        // Ignored entries are dropped from the change log once the sync is complete
+        sorted_local_changes = read_sorted_changes(path);
+        filter_ignored_histories(sorted_local_changes, ignore_rules);
         state_lock.unlock();
+
+        if(g_content_hash) {
+            hash_unhashed_local_versions(sorted_peer_changes);
+        }
         
+        // The peer only sent the histories that differ from ours. All other paths merge to the local
+        // history and need no operations, so they can be left out of the merge.
+        SortedChangeSet merged_local_changes{};
+        for(const auto& peer_file : sorted_peer_changes) {
+            auto local_file = sorted_local_changes.find(peer_file.first);
+            if(local_file != sorted_local_changes.end()) {
+                merged_local_changes.insert(*local_file);
+            }
+        }
+
         std::vector<Conflict> conflicts;
-        while((conflicts = attempt_merge(sorted_local_changes, sorted_peer_changes, resolutions)).empty() == false) {
+        while((conflicts = attempt_merge(merged_local_changes, sorted_peer_changes, resolutions)).empty() == false) {
             std::cerr << "!!! Merge conflicts occured for the following paths:" << std::endl;
             sort_conflicts_alphabetically(conflicts);
             print_conflicts(conflicts);
@@ -288,6 +360,30 @@ namespace fmerge {
     }
 
 
+    void StateController::hash_unhashed_local_versions(const SortedChangeSet& sorted_peer_changes) {
+        // Versions recorded before hashing was enabled can only be compared once their hash is known.
+        // The hashes are written to the change log with the merged histories.
+        std::vector<Change*> unhashed{};
+        for(const auto& peer_file : sorted_peer_changes) {
+            auto local_file = sorted_local_changes.find(peer_file.first);
+            if(local_file == sorted_local_changes.end() || peer_file.second.back().content_hash == 0) {
+                continue;
+            }
+            auto& local_last = local_file->second.back();
+            if(local_last.content_hash == 0 && local_last.file.is_file() && squash_changes(local_file->second) != 0 &&
+                local_last.mtime_ns != peer_file.second.back().mtime_ns) {
+                unhashed.push_back(&local_last);
+            }
+        }
+        if(unhashed.empty()) {
+            return;
+        }
+        HashCache hash_cache(join_path(path, ".fmerge/hashcache.db"));
+        hash_file_versions(path, unhashed, hash_cache);
+        hash_cache.save();
+    }
+
+
     std::vector<Conflict> StateController::attempt_merge(const SortedChangeSet& loc, const SortedChangeSet& rem, const std::unordered_map<std::string, ConflictResolution> &resolutions) {
         auto [merged_sorted_changes, conflicts] = merge_change_sets(loc, rem, resolutions);
         if(conflicts.size() > 0) {
@@ -330,7 +426,8 @@ namespace fmerge {
 
         term()->complete_progress_bar();
 
-        write_changes(path, recombine_changes_by_file(sorted_local_changes));
+        bool changes_saved = write_changes(path, recombine_changes_by_file(sorted_local_changes));
+        long saved_time_ns = get_timestamp_now_ns();
         LOG("Saved changes to disk" << std::endl);
 
         if(syncer->get_error_count() > 0) {
@@ -344,7 +441,12 @@ namespace fmerge {
         }
 
         state_lock.lock();
+        synced = changes_saved && syncer->get_error_count() == 0;
+        checkpoint_ns = saved_time_ns;
         if(peer_finished.load()) {
+            if(synced && peer_synced) {
+                record_checkpoint();
+            }
             state = State::Exiting;
         } else {
             state = State::Finished;
@@ -352,7 +454,20 @@ namespace fmerge {
         state_lock.unlock();
 
         // Notify our peer that we are done
-        c->send_message(std::make_shared<ExitingStateMessage>(State::SyncingFiles));
+        c->send_message(std::make_shared<ExitingStateMessage>(synced ? State::Finished : State::SyncingFiles));
+    }
+
+
+    void StateController::record_checkpoint() {
+        if(peer_uuid.empty()) {
+            return;
+        }
+        // Other sessions may have updated the config since it was loaded
+        std::string config_file = join_path(path, ".fmerge/config.json");
+        auto current_config = load_config(config_file);
+        set_remote_checkpoint(current_config, peer_uuid, checkpoint_ns);
+        save_config(config_file, current_config);
+        DEBUG("Recorded checkpoint with peer " << peer_uuid << std::endl);
     }
 
 
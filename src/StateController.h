@@ -2,6 +2,8 @@
 
 #include "Config.h"
 #include "Connection.h"
+#include "HashTree.h"
+#include "IgnoreRules.h"
 #include "protocol/NetProtocol.h"
 #include "MergeAlgorithms.h"
 #include "ApplicationState.h"
@@ -10,6 +12,7 @@
 #include <thread>
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
 
 
 namespace fmerge {
@@ -18,7 +21,8 @@ namespace fmerge {
         // This is the main class that handles connections to peers and initiates
         // the necessary operations to make the file sync happen.
     public:
-        StateController(std::unique_ptr<Connection> conn, std::string _path, json _config) : c(std::move(conn)), config(_config), path(_path), state(State::AwaitingVersion) {};
+        StateController(std::unique_ptr<Connection> conn, std::string _path, json _config) :
+            c(std::move(conn)), config(_config), path(_path), ignore_rules(IgnoreRules::load(_path)), state(State::AwaitingVersion) {};
         ~StateController();
 
         void run();
@@ -32,6 +36,7 @@ namespace fmerge {
         void handle_file_transfer_message(std::shared_ptr<protocol::FileTransferMessage> msg);
         void handle_file_request_message(std::shared_ptr<protocol::FileRequestMessage> msg);
         void handle_resolutions_message(std::shared_ptr<protocol::ConflictResolutionsMessage> msg);
+        void handle_tree_hashes_message(std::shared_ptr<protocol::TreeHashesMessage> msg);
 
         void handle_peer_disconnect();
 
@@ -42,14 +47,22 @@ namespace fmerge {
         void send_version();
         void send_filetree();
         void do_merge();
+        // Hashes the local file versions that the peer's hashed versions have to be compared with
+        void hash_unhashed_local_versions(const SortedChangeSet& sorted_peer_changes);
         std::vector<Conflict> attempt_merge(const SortedChangeSet& loc, const SortedChangeSet& rem, const std::unordered_map<std::string, ConflictResolution> &resolutions);
         void do_sync();
+        // Remembers in the config that the peer has all changes logged up to checkpoint_ns. Must be called with
+        // state_lock held, once both sides completed the sync without errors.
+        void record_checkpoint();
         void ask_proceed();
 
         // Wait for the next state to be activated asynchronously, usually by completion of a thread or peer message
         void wait_for_state_change(State current_state);
 
         std::atomic_bool peer_finished{false};
+        // Whether the sync completed without errors, locally and at the peer
+        bool synced{false};
+        bool peer_synced{false};
 
         // Cross-thread state
         std::mutex state_lock; // Used for all non-constant members.
@@ -59,8 +72,19 @@ namespace fmerge {
         json config;
         // Read-only
         std::string path;
+        // Read-only. Ignored paths are neither sent to nor accepted from the peer.
+        IgnoreRules ignore_rules;
         std::atomic<State> state;
+        // Sent with the version. Empty for peers that do not identify themselves.
+        std::string peer_uuid;
+        // Time up to which all changes in the rewritten change log were logged
+        long checkpoint_ns{};
         std::vector<Change> peer_changes;
+        // Local side of the tree hash exchange. Guarded by hashes_mtx, since the messages of two
+        // rounds can be handled concurrently.
+        std::unique_ptr<HashTree> local_hashes;
+        std::mutex hashes_mtx;
+        std::condition_variable hashes_cv;
         SortedChangeSet sorted_local_changes;
         // Each operation also has changes associated with it
         SortedOperationSet pending_operations;
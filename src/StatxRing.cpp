@@ -0,0 +1,177 @@
+#include "StatxRing.h"
+
+#include "Errors.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+
+
+namespace fmerge {
+
+    static int io_uring_setup(unsigned int entries, io_uring_params* params) {
+        return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+    }
+
+
+    static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+        return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+    }
+
+
+    std::unique_ptr<StatxRing> StatxRing::create(unsigned int entries) {
+        std::unique_ptr<StatxRing> ring{new StatxRing()};
+
+        io_uring_params params{};
+        ring->ring_fd = io_uring_setup(entries, &params);
+        if(ring->ring_fd == -1) {
+            return nullptr;
+        }
+        ring->sq_entries = params.sq_entries;
+
+        ring->sq_ptr_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        ring->cq_ptr_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if(single_mmap) {
+            ring->sq_ptr_size = std::max(ring->sq_ptr_size, ring->cq_ptr_size);
+        }
+
+        ring->sq_ptr = mmap(nullptr, ring->sq_ptr_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+        if(ring->sq_ptr == MAP_FAILED) {
+            ring->sq_ptr = nullptr;
+            print_clib_error("mmap");
+            return nullptr;
+        }
+        if(single_mmap) {
+            ring->cq_ptr = ring->sq_ptr;
+        } else {
+            ring->cq_ptr = mmap(nullptr, ring->cq_ptr_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+            if(ring->cq_ptr == MAP_FAILED) {
+                ring->cq_ptr = nullptr;
+                print_clib_error("mmap");
+                return nullptr;
+            }
+        }
+        ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = mmap(nullptr, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+        if(sqes == MAP_FAILED) {
+            print_clib_error("mmap");
+            return nullptr;
+        }
+        ring->sqes = static_cast<io_uring_sqe*>(sqes);
+
+        auto* sq = static_cast<char*>(ring->sq_ptr);
+        ring->sq_tail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+        ring->sq_mask = reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+        ring->sq_array = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+        auto* cq = static_cast<char*>(ring->cq_ptr);
+        ring->cq_head = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+        ring->cq_tail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+        ring->cq_mask = reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+        ring->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        ring->buffers.resize(ring->sq_entries);
+        return ring;
+    }
+
+
+    StatxRing::~StatxRing() {
+        if(sqes != nullptr) munmap(sqes, sqes_size);
+        if(cq_ptr != nullptr && cq_ptr != sq_ptr) munmap(cq_ptr, cq_ptr_size);
+        if(sq_ptr != nullptr) munmap(sq_ptr, sq_ptr_size);
+        if(ring_fd != -1) close(ring_fd);
+    }
+
+
+    void StatxRing::queue_statx(int dir_fd, const char* name, struct statx* buffer, unsigned long user_data) {
+        // We are the only producer, so the tail does not need to be loaded atomically
+        unsigned int tail = *sq_tail;
+        unsigned int index = tail & *sq_mask;
+
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dir_fd;
+        sqe->addr = reinterpret_cast<unsigned long>(name);
+        sqe->len = SCAN_STATX_MASK;
+        sqe->off = reinterpret_cast<unsigned long>(buffer);
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        sqe->user_data = user_data;
+
+        sq_array[index] = index;
+        // Publish the entry to the kernel
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+
+    int StatxRing::submit_and_wait(unsigned int to_submit, unsigned int min_complete) {
+        while(true) {
+            int ret = io_uring_enter(ring_fd, to_submit, min_complete, IORING_ENTER_GETEVENTS);
+            if(ret >= 0) {
+                return ret;
+            }
+            if(errno != EINTR) {
+                print_clib_error("io_uring_enter");
+                return -1;
+            }
+        }
+    }
+
+
+    void StatxRing::stat_all(int dir_fd, const std::vector<const char*>& names, std::vector<optional<FileStats>>& results) {
+        results.assign(names.size(), std::nullopt);
+        if(failed) {
+            for(size_t i = 0; i < names.size(); i++) {
+                results[i] = get_file_stats_at(dir_fd, names[i]);
+            }
+            return;
+        }
+
+        for(size_t batch_start = 0; batch_start < names.size(); batch_start += sq_entries) {
+            unsigned int batch_size = static_cast<unsigned int>(std::min<size_t>(sq_entries, names.size() - batch_start));
+            for(unsigned int i = 0; i < batch_size; i++) {
+                queue_statx(dir_fd, names[batch_start + i], &buffers[i], i);
+            }
+
+            // Collect all completions of this batch. The kernel may consume only part of the queued requests
+            // or return early, so keep submitting and waiting.
+            unsigned int to_submit = batch_size;
+            unsigned int completed = 0;
+            while(completed < batch_size) {
+                int submitted = submit_and_wait(to_submit, 1);
+                if(submitted == -1) {
+                    failed = true;
+                    break;
+                }
+                to_submit -= std::min(to_submit, static_cast<unsigned int>(submitted));
+
+                unsigned int head = *cq_head;
+                while(head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                    const io_uring_cqe& cqe = cqes[head & *cq_mask];
+                    size_t i = cqe.user_data;
+                    if(cqe.res == 0) {
+                        results[batch_start + i] = to_file_stats(buffers[i]);
+                    } else if(cqe.res != -ENOENT) {
+                        // Kernels without IORING_OP_STATX reject the request. Stat the entry directly instead.
+                        results[batch_start + i] = get_file_stats_at(dir_fd, names[batch_start + i]);
+                    }
+                    head++;
+                    completed++;
+                }
+                __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            }
+
+            if(failed) {
+                // Should never happen. Requests of this batch may still be in flight and write into the buffers,
+                // so the ring is not used again. Do not leave the caller with missing entries.
+                for(size_t i = batch_start; i < names.size(); i++) {
+                    if(!results[i].has_value()) {
+                        results[i] = get_file_stats_at(dir_fd, names[i]);
+                    }
+                }
+                return;
+            }
+        }
+    }
+
+}
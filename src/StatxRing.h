@@ -0,0 +1,66 @@
+#pragma once
+
+#include "Filesystem.h"
+
+#include <linux/io_uring.h>
+#include <memory>
+#include <vector>
+
+
+namespace fmerge {
+
+    // Minimal io_uring instance that only submits statx requests.
+    //
+    // Stat'ing the entries of a directory one by one leaves the device queue nearly empty, which
+    // hurts on spinning disks and network file systems with a cold cache. The ring submits the
+    // requests for a whole batch of entries at once and lets the kernel complete them in any order.
+    class StatxRing {
+    public:
+        // Returns nullptr if io_uring is not supported by the kernel or blocked by the system.
+        static std::unique_ptr<StatxRing> create(unsigned int entries = DEFAULT_ENTRIES);
+        ~StatxRing();
+
+        StatxRing(const StatxRing&) = delete;
+        StatxRing& operator=(const StatxRing&) = delete;
+
+        // Stats all names relative to the open directory dir_fd without following links.
+        // results[i] is empty if names[i] could not be stat'ed.
+        void stat_all(int dir_fd, const std::vector<const char*>& names, std::vector<optional<FileStats>>& results);
+
+        static constexpr unsigned int DEFAULT_ENTRIES = 256;
+    private:
+        StatxRing() = default;
+
+        // Queues one statx request. The caller guarantees that there is space in the ring.
+        void queue_statx(int dir_fd, const char* name, struct statx* buffer, unsigned long user_data);
+        // Submits the queued requests and blocks until at least min_complete are completed.
+        // Returns the number of requests that were submitted, or -1 on failure.
+        int submit_and_wait(unsigned int to_submit, unsigned int min_complete);
+
+        int ring_fd{-1};
+        unsigned int sq_entries{0};
+        // Set once the ring failed. Its requests may still be in flight, so all later calls stat directly.
+        bool failed{false};
+
+        // Mapped ring memory
+        void* sq_ptr{nullptr};
+        size_t sq_ptr_size{0};
+        void* cq_ptr{nullptr};
+        size_t cq_ptr_size{0};
+        io_uring_sqe* sqes{nullptr};
+        size_t sqes_size{0};
+
+        // Pointers into the rings
+        unsigned int* sq_tail{nullptr};
+        unsigned int* sq_mask{nullptr};
+        unsigned int* sq_array{nullptr};
+        unsigned int* cq_head{nullptr};
+        unsigned int* cq_tail{nullptr};
+        unsigned int* cq_mask{nullptr};
+        io_uring_cqe* cqes{nullptr};
+
+        // statx result buffers for the requests in flight
+        std::vector<struct statx> buffers{};
+    };
+
+}
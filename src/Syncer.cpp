@@ -12,7 +12,8 @@ namespace fmerge {
     Syncer::Syncer(SortedOperationSet &operations, std::string _base_path, Connection &_peer_conn) : Syncer(operations, _base_path, _peer_conn, nullptr) {}
 
     Syncer::Syncer(SortedOperationSet &operations, std::string _base_path, Connection &_peer_conn, CompletionCallback _status_callback) : peer_conn(_peer_conn) {
-        auto[q1, q2] = split_operations(operations);
+        auto[q0, q1, q2] = split_operations(operations);
+        queued_move_operations = std::move(q0);
         queued_parallel_operations = std::move(q1);
         queued_sequential_operations = std::move(q2);
         completion_callback = _status_callback;
@@ -21,6 +22,9 @@ namespace fmerge {
 
     
     void Syncer::perform_sync() {
+        // Moves come first, since the old paths could be removed by the deletion of their folders otherwise
+        sequential_function(queued_move_operations);
+
         for(int i = 0; i < MAX_SYNC_WORKERS; i++) {
             worker_threads.push_back(
                 std::thread{[this, i](){worker_function(i);}}
@@ -28,7 +32,7 @@ namespace fmerge {
         }
 
         // Use this thread as the sequential worker
-        sequential_function();
+        sequential_function(queued_sequential_operations);
 
         // Wait for threads to finish processing everything
         for(auto &t: worker_threads) {
@@ -76,8 +80,8 @@ namespace fmerge {
     }
 
 
-    void Syncer::sequential_function() {
-        for(auto op : queued_sequential_operations) {
+    void Syncer::sequential_function(const SortedOperationSet &operations) {
+        for(const auto& op : operations) {
             const auto& filepath = op.first;
             const auto& op_list = op.second;
             DEBUG("[seq. thread] Processing file " << filepath << std::endl);
@@ -101,27 +105,30 @@ namespace fmerge {
     }
 
 
-    static bool is_sequential_operation(std::vector<FileOperation> ops) {
+    static bool contains_operation(const std::vector<FileOperation> &ops, FileOperationType type) {
         for(const auto& op : ops) {
-            if(op.type == FileOperationType::Delete) return true;
+            if(op.type == type) return true;
         }
         return false;
     }
 
 
-    std::pair<SortedOperationSet, SortedOperationSet> Syncer::split_operations(SortedOperationSet &operation_map) {
+    std::tuple<SortedOperationSet, SortedOperationSet, SortedOperationSet> Syncer::split_operations(SortedOperationSet &operation_map) {
+        SortedOperationSet move_ops{};
         SortedOperationSet parallel_ops{};
         SortedOperationSet sequential_ops{};
         
         for(const auto& op : operation_map) {
-            if(is_sequential_operation(op.second)) {
+            if(contains_operation(op.second, FileOperationType::Move)) {
+                move_ops.emplace(op);
+            } else if(contains_operation(op.second, FileOperationType::Delete)) {
                 sequential_ops.emplace(op);
             } else {
                 parallel_ops.emplace(op);
             }
         }
 
-        return {parallel_ops, sequential_ops};
+        return {move_ops, parallel_ops, sequential_ops};
     }
 
 
@@ -134,41 +141,29 @@ namespace fmerge {
                     return false;
                 }
             } else if(op.type == FileOperationType::Transfer) {
-                DEBUG("Requesting file " << filepath << std::endl);
-                peer_conn.send_message(
-                    std::make_shared<protocol::FileRequestMessage>(filepath)
-                );
-                // Sleep until the file has been transferred
-                std::unique_lock lk(ft_flag_mtx);
-                file_transfer_flags.emplace(filepath, 5);                
-                auto& ft_flag = file_transfer_flags.at(filepath);
-                lk.unlock();
-
-                int attempts{FILE_TRANSFER_TIMEOUT / 5};
-                int i{0};
-                while(ft_flag.wait()) {
-                    if(i == attempts) {
-                        {
-                            std::unique_lock lk(ft_flag_mtx);
-                            file_transfer_flags.erase(file_transfer_flags.find(filepath));
-                        }
-                        std::cerr << "[Error] File transfer timed out for " << filepath << std::endl;
-                        return false; 
+                if(!request_file(filepath)) {
+                    return false;
+                }
+            } else if(op.type == FileOperationType::Move) {
+                if(!move_file(op.source, filepath)) {
+                    // The old file could have been changed or removed in the meantime
+                    LOG("[Warning] Could not move " << op.source << " to " << filepath << ". Transferring it instead." << std::endl);
+                    if(!request_file(filepath)) {
+                        return false;
+                    }
+                    // The move replaced the deletion of the old path, which is still due
+                    std::string full_source = join_path(base_path, op.source);
+                    if(exists(full_source) && !remove_path(full_source)) {
+                        return false;
                     }
-                    i++;
-                    LOG("Waited " << 5*i << "s/" << FILE_TRANSFER_TIMEOUT << "s for " << filepath << std::endl);
                 }
-                // File has arrived
-                // Check the result of the file operation
-                bool op_status = ft_flag.collect_message();
-                {
-                    std::unique_lock lk(ft_flag_mtx);
-                    // Find it again, since the position of the flag in the unordered map every time we reacquire the lock.
-                    file_transfer_flags.erase(file_transfer_flags.find(filepath));
-		        }
-                if(op_status == false) {
-                    // The file transfer failed.
-                    return false;
+            } else if(op.type == FileOperationType::Touch) {
+                DEBUG("Touching " << filepath << std::endl);
+                if(!set_timestamp(join_path(base_path, filepath), op.mtime_ns, get_timestamp_now())) {
+                    LOG("[Warning] Could not set the modification time of " << filepath << ". Transferring it instead." << std::endl);
+                    if(!request_file(filepath)) {
+                        return false;
+                    }
                 }
             } else {
                 std::cerr << "[Error] Could not perform unknown file operation " << op.type << std::endl;
@@ -178,6 +173,67 @@ namespace fmerge {
         return true;
     }
 
+
+    bool Syncer::request_file(const std::string &filepath) {
+        DEBUG("Requesting file " << filepath << std::endl);
+        peer_conn.send_message(
+            std::make_shared<protocol::FileRequestMessage>(filepath)
+        );
+        // Sleep until the file has been transferred
+        std::unique_lock lk(ft_flag_mtx);
+        file_transfer_flags.emplace(filepath, 5);                
+        auto& ft_flag = file_transfer_flags.at(filepath);
+        lk.unlock();
+
+        int attempts{FILE_TRANSFER_TIMEOUT / 5};
+        int i{0};
+        while(ft_flag.wait()) {
+            if(i == attempts) {
+                {
+                    std::unique_lock lk(ft_flag_mtx);
+                    file_transfer_flags.erase(file_transfer_flags.find(filepath));
+                }
+                std::cerr << "[Error] File transfer timed out for " << filepath << std::endl;
+                return false; 
+            }
+            i++;
+            LOG("Waited " << 5*i << "s/" << FILE_TRANSFER_TIMEOUT << "s for " << filepath << std::endl);
+        }
+        // File has arrived
+        // Check the result of the file operation
+        bool op_status = ft_flag.collect_message();
+        {
+            std::unique_lock lk(ft_flag_mtx);
+            // Find it again, since the position of the flag in the unordered map every time we reacquire the lock.
+            file_transfer_flags.erase(file_transfer_flags.find(filepath));
+        }
+        if(op_status == false) {
+            // The file transfer failed.
+            return false;
+        }
+        return true;
+    }
+
+
+    bool Syncer::move_file(const std::string &source, const std::string &destination) {
+        std::string full_source = join_path(base_path, source);
+        std::string full_destination = join_path(base_path, destination);
+        DEBUG("Moving " << full_source << " to " << full_destination << std::endl);
+
+        // The folder of the new path may not have been created yet
+        auto path_tokens = split_path(full_destination);
+        auto file_folder = path_to_str(std::vector<std::string>(path_tokens.begin(), path_tokens.end() - 1));
+        if(!exists(file_folder) && !ensure_dir(file_folder, true)) {
+            std::cerr << "[Error] Failed to create directory " << file_folder << std::endl;
+            return false;
+        }
+        if(rename(full_source.c_str(), full_destination.c_str()) == -1) {
+            print_clib_error("rename");
+            return false;
+        }
+        return true;
+    }
+
     bool Syncer::_submit_file_transfer(const protocol::FileTransferPayload &ft_payload) {
         std::string fullpath = join_path(base_path, ft_payload.path);
 
@@ -239,7 +295,7 @@ namespace fmerge {
         }
 
         // TODO: Return error codes
-        set_timestamp(fullpath, ft_payload.mod_time, ft_payload.access_time);
+        set_timestamp(fullpath, ft_payload.mod_time_ns, ft_payload.access_time);
         return true;
     }
 
@@ -22,7 +22,8 @@ namespace fmerge {
         Syncer(SortedOperationSet &operations, std::string _base_path, Connection &_peer_conn);
         Syncer(SortedOperationSet &operations, std::string _base_path, Connection &_peer_conn, CompletionCallback _status_callback);
 
-        std::pair<SortedOperationSet, SortedOperationSet> split_operations(SortedOperationSet &operations);
+        // Returns the move, parallel and sequential operations
+        std::tuple<SortedOperationSet, SortedOperationSet, SortedOperationSet> split_operations(SortedOperationSet &operations);
 
         void perform_sync();
         void submit_file_transfer(const protocol::FileTransferPayload &ft_payload);
@@ -30,6 +31,7 @@ namespace fmerge {
 
         int get_error_count() { return error_count.load(); }
     private:
+        SortedOperationSet queued_move_operations{};
         SortedOperationSet queued_parallel_operations{};
         SortedOperationSet queued_sequential_operations{};
         std::mutex operations_mtx;
@@ -48,9 +50,12 @@ namespace fmerge {
         std::atomic_int error_count{0};
 
         void worker_function(int tid);
-        void sequential_function();
+        void sequential_function(const SortedOperationSet &operations);
         // Returns true if file was processed successfully
         bool process_file(const std::vector<FileOperation> &ops);
+        // Requests the file from the peer and waits for it to arrive
+        bool request_file(const std::string &filepath);
+        bool move_file(const std::string &source, const std::string &destination);
     };
 
 }
\ No newline at end of file
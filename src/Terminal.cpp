@@ -41,6 +41,10 @@ namespace fmerge {
         }
         terminal_width = w.ws_col;
 
+        // The handler is process wide. Registering it before the thread starts keeps kill_thread() from
+        // terminating short runs that exit before the thread got to register it.
+        register_trivial_sigint();
+
         // Create input listener thread
         istream_listener_thread_created = true;
         istream_listener_thread = std::thread([this]() { istream_listener(); });
@@ -0,0 +1,55 @@
+#include "ThreadPool.h"
+
+#include "Globals.h"
+
+
+namespace fmerge {
+
+    ThreadPool::ThreadPool(int threads) {
+        if(threads <= 0) {
+            threads = static_cast<int>(std::thread::hardware_concurrency());
+        }
+        if(threads <= 0) {
+            threads = 1;
+        }
+        for(int i = 0; i < threads; i++) {
+            workers.emplace_back(&ThreadPool::worker_function, this);
+        }
+    }
+
+
+    ThreadPool::~ThreadPool() {
+        {
+            std::unique_lock lk(tasks_mtx);
+            stopping = true;
+        }
+        tasks_cv.notify_all();
+        for(auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+
+    void ThreadPool::worker_function() {
+        while(true) {
+            std::function<void()> task{};
+            {
+                std::unique_lock lk(tasks_mtx);
+                tasks_cv.wait(lk, [this]() { return stopping || !tasks.empty(); });
+                if(tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+
+    ThreadPool& ThreadPool::shared() {
+        static ThreadPool pool(g_scan_threads);
+        return pool;
+    }
+
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace fmerge {
+
+    // Fixed set of worker threads that run submitted tasks in FIFO order.
+    //
+    // Tasks must not wait for other tasks of the same pool, since all workers could end up
+    // waiting. The pool is meant for one level of fork-join parallelism: a caller submits a
+    // batch of independent tasks and collects their results.
+    class ThreadPool {
+    public:
+        ThreadPool() = delete;
+        // A thread count of 0 uses one thread per hardware core
+        ThreadPool(int threads);
+        // Runs the remaining tasks and joins the workers
+        ~ThreadPool();
+
+        size_t size() const { return workers.size(); }
+
+        template<typename F>
+        auto submit(F f) -> std::future<decltype(f())> {
+            auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::move(f));
+            auto result = task->get_future();
+            {
+                std::unique_lock lk(tasks_mtx);
+                tasks.emplace_back([task]() { (*task)(); });
+            }
+            tasks_cv.notify_one();
+            return result;
+        }
+
+        // Pool shared by the whole process. It is created on first use with g_scan_threads workers.
+        static ThreadPool& shared();
+    private:
+        void worker_function();
+
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()>> tasks;
+        std::mutex tasks_mtx;
+        std::condition_variable tasks_cv;
+        bool stopping{false};
+    };
+
+}
@@ -0,0 +1,152 @@
+#include "TreeSnapshot.h"
+
+#include "Errors.h"
+#include "Terminal.h"
+#include "Util.h"
+
+#include <algorithm>
+#include <endian.h>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+
+
+namespace fmerge {
+
+    constexpr char TREE_SNAPSHOT_MAGIC[4] = {'F', 'M', 'T', 'S'};
+
+
+    // Checksum of the last CHECKSUM_CHANGES changes before end
+    static unsigned long changes_checksum(std::vector<Change>::const_iterator begin, std::vector<Change>::const_iterator end) {
+        if(static_cast<size_t>(end - begin) > TreeSnapshot::CHECKSUM_CHANGES) {
+            begin = end - TreeSnapshot::CHECKSUM_CHANGES;
+        }
+        unsigned long hash{FNV_OFFSET_BASIS};
+        for(auto change = begin; change != end; change++) {
+            std::stringstream serialized{};
+            change->serialize(serialized);
+            hash = fnv1a_hash(serialized.str(), hash);
+        }
+        return hash;
+    }
+
+
+    // Checksum of the last CHECKSUM_CHANGES changes of the log before position
+    static unsigned long log_checksum(const MappedChangeLog& log, size_t position) {
+        std::vector<Change> tail{};
+        for(size_t i = position - std::min(position, TreeSnapshot::CHECKSUM_CHANGES); i < position; i++) {
+            tail.push_back(log[i].to_change());
+        }
+        return changes_checksum(tail.begin(), tail.end());
+    }
+
+
+    // True if the first position records of the log end at log_length bytes of the log file with the inode log_ino
+    static bool log_matches(const MappedChangeLog& log, size_t position, unsigned long log_ino, unsigned long log_length) {
+        if(log.ino() != log_ino || position > log.size()) {
+            return false;
+        }
+        return position < log.size() ? log.offset(position) == log_length : log.length() == log_length;
+    }
+
+
+    TreeSnapshot::TreeSnapshot(std::string _snapshot_path) : snapshot_path(_snapshot_path) {}
+
+
+    FileTree TreeSnapshot::load(const MappedChangeLog& log, const IgnoreRules& rules) {
+        std::optional<FileTree> tree{};
+        size_t position{0};
+
+        std::ifstream snapshot_file(snapshot_path, std::ios_base::binary);
+        if(snapshot_file) {
+            char magic[4];
+            unsigned int version{};
+            unsigned long stored_position{};
+            unsigned long log_ino{};
+            unsigned long log_length{};
+            unsigned long checksum{};
+            unsigned long fingerprint{};
+            snapshot_file.read(magic, sizeof(magic));
+            snapshot_file.read(reinterpret_cast<char*>(&version), sizeof(version));
+            snapshot_file.read(reinterpret_cast<char*>(&stored_position), sizeof(stored_position));
+            snapshot_file.read(reinterpret_cast<char*>(&log_ino), sizeof(log_ino));
+            snapshot_file.read(reinterpret_cast<char*>(&log_length), sizeof(log_length));
+            snapshot_file.read(reinterpret_cast<char*>(&checksum), sizeof(checksum));
+            snapshot_file.read(reinterpret_cast<char*>(&fingerprint), sizeof(fingerprint));
+            position = le64toh(stored_position);
+
+            if(!snapshot_file || memcmp(magic, TREE_SNAPSHOT_MAGIC, sizeof(magic)) != 0) {
+                std::cerr << "[Warning] Ignoring invalid tree snapshot " << snapshot_path << std::endl;
+            } else if(le32toh(version) == FORMAT_VERSION &&
+                log_matches(log, position, le64toh(log_ino), le64toh(log_length)) &&
+                le64toh(checksum) == log_checksum(log, position) &&
+                le64toh(fingerprint) == rules.fingerprint()) {
+                // Otherwise the snapshot is outdated, and simply replaced after the next scan
+                tree = FileTree::deserialize(snapshot_file);
+                if(!tree) {
+                    std::cerr << "[Warning] Ignoring invalid tree snapshot " << snapshot_path << std::endl;
+                }
+            }
+        }
+        auto read_change = [&log, &rules](size_t i, Change& buffer) -> const Change* {
+            log[i].copy_to(buffer);
+            return rules.ignored(buffer.file) ? nullptr : &buffer;
+        };
+        if(!tree) {
+            // The whole log is replayed, in parallel if it is long
+            DEBUG("No valid tree snapshot. Replaying all " << log.size() << " changes of the change log" << std::endl);
+            replayed_changes = log.size();
+            return construct_tree_from_changes(log.size(), [&log](size_t i) { return log[i].path; }, read_change);
+        }
+
+        // A single change is reused for all records, so replaying them does not allocate for every record
+        replayed_changes = log.size() - position;
+        DEBUG("Replaying " << replayed_changes << " changes after the tree snapshot" << std::endl);
+        Change change{};
+        for(size_t i = position; i < log.size(); i++) {
+            if(read_change(i, change) != nullptr) {
+                apply_change_to_tree(*tree, change);
+            }
+        }
+        return std::move(*tree);
+    }
+
+
+    bool TreeSnapshot::save(const FileTree& tree, size_t position, unsigned long log_ino, unsigned long log_length,
+        const std::vector<Change>& tail, const IgnoreRules& rules) const {
+        // Written to a temporary file first, so that an interrupted run never leaves a truncated snapshot
+        std::string tmp_path = snapshot_path + ".tmp";
+        std::ofstream snapshot_file(tmp_path, std::ios_base::binary | std::ios_base::trunc);
+        if(!snapshot_file) {
+            std::cerr << "[Warning] Failed to write tree snapshot " << tmp_path << std::endl;
+            return false;
+        }
+
+        unsigned int version = htole32(FORMAT_VERSION);
+        unsigned long stored_position = htole64(position);
+        unsigned long stored_log_ino = htole64(log_ino);
+        unsigned long stored_log_length = htole64(log_length);
+        unsigned long checksum = htole64(changes_checksum(tail.begin(), tail.end()));
+        unsigned long fingerprint = htole64(rules.fingerprint());
+        snapshot_file.write(TREE_SNAPSHOT_MAGIC, sizeof(TREE_SNAPSHOT_MAGIC));
+        snapshot_file.write(reinterpret_cast<const char*>(&version), sizeof(version));
+        snapshot_file.write(reinterpret_cast<const char*>(&stored_position), sizeof(stored_position));
+        snapshot_file.write(reinterpret_cast<const char*>(&stored_log_ino), sizeof(stored_log_ino));
+        snapshot_file.write(reinterpret_cast<const char*>(&stored_log_length), sizeof(stored_log_length));
+        snapshot_file.write(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+        snapshot_file.write(reinterpret_cast<const char*>(&fingerprint), sizeof(fingerprint));
+        tree.serialize(snapshot_file);
+
+        snapshot_file.close();
+        if(!snapshot_file) {
+            std::cerr << "[Warning] Failed to write tree snapshot " << tmp_path << std::endl;
+            return false;
+        }
+        if(rename(tmp_path.c_str(), snapshot_path.c_str()) == -1) {
+            print_clib_error("rename");
+            return false;
+        }
+        return true;
+    }
+
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "ChangeLog.h"
+#include "FileTree.h"
+#include "IgnoreRules.h"
+
+#include <string>
+#include <vector>
+
+
+namespace fmerge {
+
+    // Snapshot of the tree described by the change log, stored in .fmerge/treesnapshot.db.
+    //
+    // Rebuilding the previous tree by replaying the whole change history gets slower with every
+    // run. The snapshot stores the tree after the first `position` changes of the log, so only
+    // the changes after that position have to be replayed. Like the index of the log (see
+    // ChangeIndex), the snapshot names the log file it was saved for by inode and length. Records
+    // are only ever appended to a log file, and a rewrite replaces the file, so the snapshot is
+    // trusted if the log file is the same and the record at the position starts at the stored
+    // length. The last few changes before the position are also compared by a checksum, in case
+    // an inode number was reused. The ignore rules must not have changed either, since ignored
+    // changes are not part of the tree.
+    class TreeSnapshot {
+    public:
+        TreeSnapshot() = delete;
+        TreeSnapshot(std::string _snapshot_path);
+
+        // Returns the tree described by the changes of the log that are not ignored. A missing or
+        // invalid snapshot file is treated like an empty snapshot at position 0.
+        FileTree load(const MappedChangeLog& log, const IgnoreRules& rules);
+        // Number of changes that had to be replayed by the last load
+        size_t replayed() const { return replayed_changes; }
+
+        // Stores the tree after the first position changes of the log, which end at log_length
+        // bytes of the log file with the inode log_ino. tail holds the last changes before position
+        // (at least CHECKSUM_CHANGES of them, if the log is that long).
+        bool save(const FileTree& tree, size_t position, unsigned long log_ino, unsigned long log_length,
+            const std::vector<Change>& tail, const IgnoreRules& rules) const;
+
+        // Version 2 adds content hashes, version 3 the inode and length of the log
+        static constexpr unsigned int FORMAT_VERSION = 3;
+        // Number of changes before the position that are covered by the checksum
+        static constexpr size_t CHECKSUM_CHANGES = 16;
+    private:
+        std::string snapshot_path;
+        size_t replayed_changes{0};
+    };
+
+}
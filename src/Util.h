@@ -8,6 +8,7 @@
 #include <mutex>
 #include <condition_variable>
 #include <signal.h>
+#include <string_view>
 
 namespace fmerge {
 
@@ -15,6 +16,17 @@ namespace fmerge {
 
     void register_trivial_sigint();
     std::string make_centered(const std::string& contents, int width, char padding_char = ' ');
+
+    constexpr unsigned long FNV_OFFSET_BASIS = 0xcbf29ce484222325ul;
+    // 64 bit FNV-1a. Not cryptographic, only used to detect accidental changes of persisted data.
+    // Pass the previous result as hash to continue a running hash.
+    inline unsigned long fnv1a_hash(std::string_view data, unsigned long hash = FNV_OFFSET_BASIS) {
+        for(unsigned char c : data) {
+            hash ^= c;
+            hash *= 0x100000001b3ul;
+        }
+        return hash;
+    }
     
     template<typename T>
     class SyncBarrier {
@@ -0,0 +1,391 @@
+#include "Watcher.h"
+
+#include "ChangeLog.h"
+#include "DirWalker.h"
+#include "FileTree.h"
+#include "Errors.h"
+#include "Globals.h"
+#include "Terminal.h"
+
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <thread>
+
+
+namespace fmerge {
+
+    // Events are written to the change log once nothing happened for this long
+    constexpr std::chrono::milliseconds COALESCE_DELAY{500};
+    // Upper bound for the delay of an event during a continuous burst
+    constexpr std::chrono::milliseconds MAX_FLUSH_DELAY{5000};
+    // Retry interval if the change log is in use by a sync session
+    constexpr std::chrono::milliseconds LOCKED_RETRY_DELAY{1000};
+    // How long a session waits for the watcher to answer a flush request, and how often it checks
+    constexpr std::chrono::milliseconds FLUSH_REQUEST_TIMEOUT{30000};
+    constexpr std::chrono::milliseconds FLUSH_REQUEST_POLL_INTERVAL{20};
+
+    // Flush requests are files in .fmerge whose name is this prefix followed by the pid of the session
+    constexpr const char* FLUSH_REQUEST_PREFIX = "watcher.flush.";
+
+    constexpr uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+        IN_MOVED_FROM | IN_MOVED_TO | IN_DONT_FOLLOW | IN_ONLYDIR | IN_EXCL_UNLINK;
+
+
+    static volatile sig_atomic_t stop_requested{0};
+
+    static void _handle_stop(int) {
+        stop_requested = 1;
+    }
+
+
+    static std::string watcher_lock_path(const std::string& base_path) {
+        return join_path(base_path, ".fmerge/watcher.lock");
+    }
+
+
+    static std::string changes_lock_path(const std::string& base_path) {
+        return join_path(base_path, ".fmerge/filechanges.lock");
+    }
+
+
+    static std::string config_dir_path(const std::string& base_path) {
+        return join_path(base_path, ".fmerge");
+    }
+
+
+    static std::string child_path(const std::string& dir, const char* name) {
+        return dir.empty() ? std::string(name) : dir + "/" + name;
+    }
+
+
+    Watcher::Watcher(std::string _base_path) : base_path(_base_path), ignore_rules(IgnoreRules::load(_base_path)) {}
+
+
+    Watcher::~Watcher() {
+        if(inotify_fd != -1) {
+            close(inotify_fd);
+        }
+    }
+
+
+    bool Watcher::run() {
+        FileLock watcher_lock(watcher_lock_path(base_path));
+        if(!watcher_lock.lock(false)) {
+            std::cerr << "[Error] Another watcher is already running for " << base_path << std::endl;
+            return false;
+        }
+
+        // Interrupts the poll below. The pending events are written before exiting.
+        struct sigaction stop_handler;
+        sigemptyset(&stop_handler.sa_mask);
+        stop_handler.sa_flags = 0;
+        stop_handler.sa_handler = _handle_stop;
+        if(sigaction(SIGINT, &stop_handler, 0) || sigaction(SIGTERM, &stop_handler, 0)) {
+            print_clib_error("sigaction");
+        }
+
+        // The watches are in place before the initial scan, so nothing can be missed in between
+        if(!init_inotify()) {
+            return false;
+        }
+        find_flush_requests();
+        {
+            FileLock changes_lock(changes_lock_path(base_path));
+            changes_lock.lock();
+            if(!repair_change_log(base_path)) {
+                return false;
+            }
+            record_tree_changes(base_path);
+        }
+        answer_flush_requests();
+        LOG("Watching " << watches.size() << " directories for changes..." << std::endl);
+
+        while(!stop_requested) {
+            int timeout_ms = -1;
+            if(!dirty_paths.empty() || overflowed) {
+                auto now = std::chrono::steady_clock::now();
+                auto deadline = std::min(last_event_time + COALESCE_DELAY, first_dirty_time + MAX_FLUSH_DELAY);
+                timeout_ms = static_cast<int>(std::max<long>(0,
+                    std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count()));
+            }
+
+            struct pollfd pfd{.fd = inotify_fd, .events = POLLIN, .revents = 0};
+            int ret = poll(&pfd, 1, timeout_ms);
+            if(ret == -1) {
+                if(errno == EINTR) {
+                    // Only our stop signals (and SIGINT) interrupt us
+                    break;
+                }
+                print_clib_error("poll");
+                return false;
+            }
+
+            if(ret > 0) {
+                handle_events();
+            } else if(overflowed) {
+                // Timed out, so the burst is over
+                full_rescan();
+            } else if(!flush()) {
+                // Try again later
+                last_event_time = std::chrono::steady_clock::now() + LOCKED_RETRY_DELAY - COALESCE_DELAY;
+                first_dirty_time = last_event_time;
+            }
+
+            if(!flush_requests.empty()) {
+                answer_flush_requests();
+            }
+        }
+
+        LOG("Stopping watcher" << std::endl);
+        answer_flush_requests();
+        return true;
+    }
+
+
+    bool Watcher::init_inotify() {
+        if(inotify_fd != -1) {
+            close(inotify_fd);
+        }
+        watches.clear();
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if(inotify_fd == -1) {
+            print_clib_error("inotify_init1");
+            return false;
+        }
+        if(!add_watches("")) {
+            return false;
+        }
+        // .fmerge itself is ignored, so it gets a watch of its own for the flush requests
+        requests_wd = inotify_add_watch(inotify_fd, config_dir_path(base_path).c_str(), IN_CREATE | IN_ONLYDIR);
+        if(requests_wd == -1) {
+            print_clib_error("inotify_add_watch");
+            return false;
+        }
+        return true;
+    }
+
+
+    bool Watcher::add_watches(const std::string& relative_path) {
+        if(ignore_rules.ignored(relative_path, true)) {
+            return true;
+        }
+        // Ignored directories are not even visited by the walker
+        std::vector<std::string> dirs{relative_path};
+        DirWalker walker(join_path(base_path, relative_path), g_scan_threads);
+        walker.set_ignore_rules(&ignore_rules, ignore_rules.state_for(relative_path));
+        walker.walk([&dirs, &relative_path](File file, const FileStats&) {
+            if(file.is_dir()) {
+                dirs.push_back(relative_path.empty() ? file.path : relative_path + "/" + file.path);
+            }
+        });
+
+        for(const auto& dir : dirs) {
+            int wd = inotify_add_watch(inotify_fd, join_path(base_path, dir).c_str(), WATCH_MASK);
+            if(wd == -1) {
+                if(errno == ENOENT || errno == ENOTDIR) {
+                    // Already gone again
+                    continue;
+                }
+                print_clib_error("inotify_add_watch");
+                if(errno == ENOSPC) {
+                    std::cerr << "[Error] inotify watch limit reached. Increase fs.inotify.max_user_watches." << std::endl;
+                }
+                return false;
+            }
+            watches[wd] = dir;
+        }
+        return true;
+    }
+
+
+    void Watcher::remove_watches(const std::string& relative_path) {
+        std::string prefix = relative_path + "/";
+        for(auto it = watches.begin(); it != watches.end();) {
+            if(it->second == relative_path || it->second.rfind(prefix, 0) == 0) {
+                inotify_rm_watch(inotify_fd, it->first);
+                it = watches.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+
+
+    void Watcher::handle_events() {
+        alignas(struct inotify_event) char buffer[64 * 1024];
+
+        while(true) {
+            ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+            if(len == -1) {
+                if(errno != EAGAIN && errno != EINTR) {
+                    print_clib_error("read");
+                }
+                return;
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            for(char* ptr = buffer; ptr < buffer + len;) {
+                auto* event = reinterpret_cast<struct inotify_event*>(ptr);
+                ptr += sizeof(struct inotify_event) + event->len;
+
+                if(event->mask & IN_Q_OVERFLOW) {
+                    if(dirty_paths.empty() && !overflowed) {
+                        first_dirty_time = now;
+                    }
+                    overflowed = true;
+                    last_event_time = now;
+                    continue;
+                }
+                if(event->mask & IN_IGNORED) {
+                    watches.erase(event->wd);
+                    continue;
+                }
+                if(event->wd == requests_wd) {
+                    // Answered once all events up to here have been handled
+                    if(event->len > 0 && strncmp(event->name, FLUSH_REQUEST_PREFIX, strlen(FLUSH_REQUEST_PREFIX)) == 0
+                            && std::find(flush_requests.begin(), flush_requests.end(), event->name) == flush_requests.end()) {
+                        flush_requests.push_back(event->name);
+                    }
+                    continue;
+                }
+                auto watch = watches.find(event->wd);
+                if(watch == watches.end() || event->len == 0) {
+                    continue;
+                }
+
+                std::string path = child_path(watch->second, event->name);
+                bool is_dir = event->mask & IN_ISDIR;
+                if(ignore_rules.ignored(path, is_dir)) {
+                    continue;
+                }
+                if(is_dir && (event->mask & IN_MOVED_FROM)) {
+                    remove_watches(path);
+                }
+                if(is_dir && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                    // Everything below a new directory is picked up by the subtree scan during the flush
+                    if(!add_watches(path)) {
+                        overflowed = true;
+                    }
+                }
+
+                if(dirty_paths.empty() && !overflowed) {
+                    first_dirty_time = now;
+                }
+                dirty_paths.insert(path);
+                last_event_time = now;
+            }
+        }
+    }
+
+
+    bool Watcher::flush(bool wait) {
+        FileLock changes_lock(changes_lock_path(base_path));
+        if(!changes_lock.lock(wait)) {
+            return false;
+        }
+        // An earlier append may have been interrupted
+        if(!repair_change_log(base_path)) {
+            return false;
+        }
+        auto recorded = record_path_changes(base_path, {dirty_paths.begin(), dirty_paths.end()});
+        if(!recorded.has_value()) {
+            // Kept for the next flush
+            return false;
+        }
+        dirty_paths.clear();
+        if(*recorded > 0) {
+            LOG("Recorded " << *recorded << " changes" << std::endl);
+        }
+        return true;
+    }
+
+
+    void Watcher::full_rescan() {
+        LOG("[Warning] inotify event queue overflowed. Rescanning the whole tree." << std::endl);
+        overflowed = false;
+        dirty_paths.clear();
+        if(!init_inotify()) {
+            std::cerr << "[Error] Failed to rebuild the inotify watches" << std::endl;
+            exit(1);
+        }
+        // Requests may have been created while there was no watch on .fmerge
+        find_flush_requests();
+        FileLock changes_lock(changes_lock_path(base_path));
+        changes_lock.lock();
+        if(repair_change_log(base_path)) {
+            record_tree_changes(base_path);
+        }
+    }
+
+
+    void Watcher::answer_flush_requests() {
+        if(overflowed) {
+            full_rescan();
+        } else if(!dirty_paths.empty()) {
+            flush(true);
+        }
+        for(const auto& name : flush_requests) {
+            // The session may have given up waiting already
+            if(unlink(join_path(config_dir_path(base_path), name).c_str()) == -1 && errno != ENOENT) {
+                print_clib_error("unlink");
+            }
+        }
+        flush_requests.clear();
+    }
+
+
+    void Watcher::find_flush_requests() {
+        int dir_fd = open(config_dir_path(base_path).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(dir_fd == -1) {
+            print_clib_error("open");
+            return;
+        }
+        std::vector<DirEntry> entries;
+        read_dir_entries(dir_fd, entries);
+        close(dir_fd);
+        for(const auto& entry : entries) {
+            if(entry.name.rfind(FLUSH_REQUEST_PREFIX, 0) == 0
+                    && std::find(flush_requests.begin(), flush_requests.end(), entry.name) == flush_requests.end()) {
+                flush_requests.push_back(entry.name);
+            }
+        }
+    }
+
+
+    bool watcher_running(std::string base_path) {
+        if(!exists(watcher_lock_path(base_path))) {
+            return false;
+        }
+        FileLock watcher_lock(watcher_lock_path(base_path));
+        return !watcher_lock.lock(false);
+    }
+
+
+    bool request_watcher_flush(std::string base_path) {
+        std::string request_path = join_path(config_dir_path(base_path), FLUSH_REQUEST_PREFIX + std::to_string(getpid()));
+        // A leftover of a session that had the same pid would not cause a new inotify event
+        unlink(request_path.c_str());
+        int fd = open(request_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if(fd == -1) {
+            print_clib_error("open");
+            return false;
+        }
+        close(fd);
+
+        auto deadline = std::chrono::steady_clock::now() + FLUSH_REQUEST_TIMEOUT;
+        while(exists(request_path)) {
+            if(!watcher_running(base_path) || std::chrono::steady_clock::now() >= deadline) {
+                // Withdraw the request. If it is gone already, the watcher answered in the meantime.
+                return unlink(request_path.c_str()) == -1 && errno == ENOENT;
+            }
+            std::this_thread::sleep_for(FLUSH_REQUEST_POLL_INTERVAL);
+        }
+        return true;
+    }
+
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "Filesystem.h"
+#include "IgnoreRules.h"
+
+#include <chrono>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+namespace fmerge {
+
+    // Long-running change journal for a folder (fmerge --watch).
+    //
+    // Registers inotify watches on every directory of the tree and appends the changes to the
+    // change log as the events arrive. Bursts of events are coalesced: the affected paths are
+    // collected until the tree has been quiet for a moment, and then compared against the change
+    // log in one go. If the kernel event queue overflows, the watches are rebuilt and the whole
+    // tree is rescanned.
+    //
+    // While the watcher runs it holds the lock .fmerge/watcher.lock, which tells the sync
+    // sessions that the change log is kept up to date and the startup scan can be skipped. The
+    // change log itself is protected by .fmerge/filechanges.lock. Since events are held back for
+    // a moment, a session first asks the watcher to write them (see request_watcher_flush): it
+    // creates a request file in .fmerge, and the watcher deletes it once the events that were
+    // queued before it are in the change log.
+    class Watcher {
+    public:
+        Watcher() = delete;
+        Watcher(std::string _base_path);
+        ~Watcher();
+
+        // Runs until SIGINT or SIGTERM is received. Returns false if the watcher could not be started.
+        bool run();
+    private:
+        bool init_inotify();
+        // Adds watches for the directory and all directories below it
+        bool add_watches(const std::string& relative_path);
+        void remove_watches(const std::string& relative_path);
+        void handle_events();
+        // Writes the changes of the collected paths to the change log. Returns false if they could
+        // not be written, or if the change log is in use by a sync session and wait is not set. The
+        // paths are kept for later in that case.
+        bool flush(bool wait = false);
+        void full_rescan();
+        // Writes all pending changes and deletes the request files of the waiting sessions
+        void answer_flush_requests();
+        // Collects the request files that already exist, which were created before the watch on
+        // .fmerge was in place
+        void find_flush_requests();
+
+        std::string base_path;
+        // Read once at startup
+        IgnoreRules ignore_rules;
+        int inotify_fd{-1};
+        // Watch descriptor to path relative to base_path
+        std::unordered_map<int, std::string> watches;
+        // Watch descriptor of .fmerge, where the flush requests are created
+        int requests_wd{-1};
+        // Names of the request files in .fmerge that are waiting for an answer
+        std::vector<std::string> flush_requests;
+
+        // Paths (relative to base_path) that changed since the last flush
+        std::set<std::string> dirty_paths;
+        std::chrono::steady_clock::time_point first_dirty_time;
+        std::chrono::steady_clock::time_point last_event_time;
+        bool overflowed{false};
+    };
+
+    // True if a watcher maintains the change log of the folder
+    bool watcher_running(std::string base_path);
+
+    // Asks the watcher of the folder to write the changes it still holds back, and waits until it
+    // did. Must not be called while holding .fmerge/filechanges.lock. Returns false if the watcher
+    // did not answer, in which case the change log may be out of date.
+    bool request_watcher_flush(std::string base_path);
+
+}
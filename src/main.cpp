@@ -1,11 +1,16 @@
+#include "ChangeLog.h"
 #include "Filesystem.h"
 #include "FileTree.h"
+#include "MergeAlgorithms.h"
 #include "Connection.h"
 #include "Config.h"
 #include "StateController.h"
 #include "Terminal.h"
 #include "Version.h"
+#include "Watcher.h"
 
+#include <charconv>
+#include <cstring>
 #include <unistd.h>
 #include <getopt.h>
 #include <csignal>
@@ -15,7 +20,6 @@
 
 // TODOs:
 //
-// * Also use nsec component of mtime
 // * 
 //
 
@@ -25,10 +29,29 @@ using namespace fmerge;
 namespace fmerge {
     bool g_debug_protocol{false};
     bool g_ask_confirmation{true};
+    int g_scan_threads{0};
+    bool g_scan_io_uring{false};
+    bool g_content_hash{false};
     int g_exit_code{0};
 }
 
 
+void update_change_log(std::string path) {
+    // A watcher holds back the latest events for a moment. It has to write them before the lock is taken.
+    bool flushed = watcher_running(path) && request_watcher_flush(path);
+    FileLock changes_lock(join_path(path, ".fmerge/filechanges.lock"));
+    changes_lock.lock();
+    if(!repair_change_log(path)) {
+        exit(1);
+    }
+    if(flushed) {
+        LOG("Change log is kept up to date by a watcher. Skipping scan." << std::endl);
+        return;
+    }
+    record_tree_changes(path);
+}
+
+
 int server_mode(std::string path) {
     LOG("Starting in server mode for \"" << path << "\"" << std::endl);
 
@@ -46,7 +69,7 @@ int server_mode(std::string path) {
     save_config(config_file, config);
 
     // Build file tree
-    append_changes(path, get_new_tree_changes(path));
+    update_change_log(path);
 
     LOG("Waiting for peer connections..." << std::endl);
 
@@ -54,6 +77,16 @@ int server_mode(std::string path) {
     listen_for_peers(4512, [=, &config](auto conn) {
         LOG("Accepted connection from " << conn->get_address() << std::endl);
 
+        // The log was brought up to date at startup, but a watcher may have seen changes since
+        if(watcher_running(path)) {
+            request_watcher_flush(path);
+        }
+        // The change log must not be touched by a watcher during the session
+        FileLock changes_lock(join_path(path, ".fmerge/filechanges.lock"));
+        changes_lock.lock();
+        if(!repair_change_log(path)) {
+            exit(1);
+        }
         StateController controller(std::move(conn), path, config);
         controller.run();
     });
@@ -79,12 +112,18 @@ int client_mode(std::string path, std::string target_address) {
     save_config(config_file, config);
 
     // Build file tree
-    append_changes(path, get_new_tree_changes(path));
+    update_change_log(path);
 
     // Connect to server
     connect_to_server(4512, target_address, [=, &config](auto conn) {
         LOG("Connected to " << conn->get_address() << std::endl);
         
+        // The change log must not be touched by a watcher during the session
+        FileLock changes_lock(join_path(path, ".fmerge/filechanges.lock"));
+        changes_lock.lock();
+        if(!repair_change_log(path)) {
+            exit(1);
+        }
         StateController controller(std::move(conn), path, config);
         controller.run();
     });
@@ -103,12 +142,18 @@ static struct option long_options[] {
     {"client" , required_argument, 0, 'c'},
     {"help"   , no_argument      , 0, 'h'},
     {"version", no_argument      , 0, 'v'},
+    {"threads", required_argument, 0, 'j'},
+    {"io-uring", no_argument     , 0, 'u'},
+    {"watch"  , no_argument      , 0, 'w'},
+    {"hash"   , no_argument      , 0, 'H'},
+    {"compact", no_argument      , 0, 'C'},
+    {"history", required_argument, 0, 'L'},
     {0        , 0                , 0,  0 },
 };
 
 
 void print_usage() {
-    std::cout << "Usage: fmerge [OPTION] (-s|-c server_ip) [PATH]" << std::endl;
+    std::cout << "Usage: fmerge [OPTION] (-s|-c server_ip|--watch|--compact|--history file) [PATH]" << std::endl;
 }
 
 
@@ -121,6 +166,12 @@ void print_help() {
     std::cout << " -v, --version                Output version" << std::endl;
     std::cout << " -c, --client [server addr.]  Start in client mode and connect to server addr." << std::endl;
     std::cout << " -s, --server                 Start in server mode" << std::endl;
+    std::cout << "     --watch                  Keep the change log of the folder up to date until interrupted" << std::endl;
+    std::cout << "     --compact                Shorten the change histories that all remotes have synced" << std::endl;
+    std::cout << "     --history [file]         Show the recorded changes of a file (relative to PATH)" << std::endl;
+    std::cout << " -j, --threads [count]        Number of threads used to scan and compare the folder (default: one per core)" << std::endl;
+    std::cout << "     --io-uring               Batch the metadata requests of the scan with io_uring (for cold caches)" << std::endl;
+    std::cout << "     --hash                   Hash changed files, so that identical contents are neither transferred nor in conflict" << std::endl;
     std::cout << " -y                           Do not prompt the user for confirmation (be careful!)" << std::endl;
     std::cout << " -d                           Put into debug mode" << std::endl;
     std::cout << std::endl;
@@ -130,6 +181,84 @@ void print_help() {
 }
 
 
+int watch_mode(std::string path) {
+    LOG("Starting watcher for \"" << path << "\"" << std::endl);
+
+    if(!exists(path)) {
+        std::cerr << "Illegal starting folder" << std::endl;
+        return 1;
+    }
+
+    std::string config_dir = join_path(path, ".fmerge");
+    std::string config_file = join_path(config_dir, "config.json");
+    ensure_dir(config_dir);
+
+    // Load config
+    auto config = load_config(config_file);
+    save_config(config_file, config);
+
+    if(!Watcher(path).run()) {
+        return 1;
+    }
+    return 0;
+}
+
+
+int compact_mode(std::string path) {
+    LOG("Compacting the change log of \"" << path << "\"" << std::endl);
+
+    if(!exists(path)) {
+        std::cerr << "Illegal starting folder" << std::endl;
+        return 1;
+    }
+
+    // Only changes that every remote has acknowledged are compacted, so that all of them can still
+    // compare their histories with ours
+    auto checkpoint_ns = get_compaction_checkpoint(load_config(join_path(path, ".fmerge/config.json")));
+    if(!checkpoint_ns.has_value()) {
+        LOG("Not every remote has completed a sync yet. Nothing to compact." << std::endl);
+        return 0;
+    }
+
+    FileLock changes_lock(join_path(path, ".fmerge/filechanges.lock"));
+    changes_lock.lock();
+    auto sorted_changes = read_sorted_changes(path);
+    size_t removed_changes{0};
+    for(auto& file_changes : sorted_changes) {
+        removed_changes += compact_history(file_changes.second, *checkpoint_ns);
+    }
+    if(removed_changes == 0) {
+        LOG("The change log is already compact" << std::endl);
+        return 0;
+    }
+    if(!write_changes(path, recombine_changes_by_file(std::move(sorted_changes)))) {
+        return 1;
+    }
+    LOG("Removed " << removed_changes << " changes from the change log" << std::endl);
+    return 0;
+}
+
+
+int history_mode(std::string path, std::string file_path) {
+    if(!exists(path)) {
+        std::cerr << "Illegal starting folder" << std::endl;
+        return 1;
+    }
+
+    FileLock changes_lock(join_path(path, ".fmerge/filechanges.lock"));
+    changes_lock.lock();
+    auto history = read_file_history(path, file_path);
+    if(history.empty()) {
+        LOG("No changes recorded for \"" << file_path << "\"" << std::endl);
+        return 1;
+    }
+    for(const auto& change : history) {
+        LOG(change << std::endl);
+    }
+    return 0;
+}
+
+
 int main(int argc, char* argv[]) {
     // Register exit handlers
     if(std::atexit(atexit_handler)) {
@@ -142,11 +271,12 @@ int main(int argc, char* argv[]) {
     int opt{};
 
     // Collection of flags to populate
-    int mode = -1; // 0: server, 1: client
+    int mode = -1; // 0: server, 1: client, 2: watch, 3: compact, 4: history
     std::string target_address{};
+    std::string history_file{};
     std::string path_opt{};
 
-    while((opt = getopt_long(argc, argv, "hvsc:yd", long_options, &long_option_index)) != -1) {
+    while((opt = getopt_long(argc, argv, "hvsc:j:yd", long_options, &long_option_index)) != -1) {
         if(opt == 'h') {
             print_help();
             return 0;
@@ -166,13 +296,44 @@ int main(int argc, char* argv[]) {
         } else if(opt == 'v') {
             std::cout << "Version " << g_fmerge_version << std::endl;
             return 0;
+        } else if(opt == 'j') {
+            // The whole argument has to be a number, so that "4x" is not taken as 4
+            const char* end = optarg + strlen(optarg);
+            auto [number_end, error] = std::from_chars(optarg, end, g_scan_threads);
+            if(error != std::errc() || number_end != end || g_scan_threads < 0) {
+                std::cerr << "Invalid thread count " << optarg << std::endl;
+                return 1;
+            }
+        } else if(opt == 'w') {
+            if(mode != -1) {
+                std::cerr << "Cannot set multiple server and/or client flags." << std::endl;
+                return 1;
+            }
+            mode = 2;
+        } else if(opt == 'C') {
+            if(mode != -1) {
+                std::cerr << "Cannot set multiple server and/or client flags." << std::endl;
+                return 1;
+            }
+            mode = 3;
+        } else if(opt == 'L') {
+            if(mode != -1) {
+                std::cerr << "Cannot set multiple server and/or client flags." << std::endl;
+                return 1;
+            }
+            mode = 4;
+            history_file = optarg;
+        } else if(opt == 'u') {
+            g_scan_io_uring = true;
+        } else if(opt == 'H') {
+            g_content_hash = true;
         } else if(opt == 'y') {
             g_ask_confirmation = false;
         } else if(opt == 'd') {
             g_debug_protocol = true;
         } else if(opt == '?') {
             // We got an invalid option
-            if(optopt == 'c') {
+            if(optopt == 'c' || optopt == 'j') {
                 print_usage();
                 return 1;
             }
@@ -184,7 +345,7 @@ int main(int argc, char* argv[]) {
     
 
     // Check number of path options supplied
-    if(mode == 0 || mode == 1) {
+    if(mode >= 0) {
         if(optind == (argc - 1)) {
             path_opt = argv[optind];
         } else if(optind == argc) {
@@ -205,6 +366,12 @@ int main(int argc, char* argv[]) {
     } else if(mode == 1) {
         client_mode(path_opt, target_address);
         return g_exit_code;
+    } else if(mode == 2) {
+        return watch_mode(path_opt);
+    } else if(mode == 3) {
+        return compact_mode(path_opt);
+    } else if(mode == 4) {
+        return history_mode(path_opt, history_file);
     }
 
     // Not using termbuf prevents an extra newline from being inserted
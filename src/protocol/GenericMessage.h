@@ -21,6 +21,7 @@ namespace fmerge::protocol {
         FileRequest,
         ExitingState,
         ConflictResolutions,
+        TreeHashes,
     };
 
 
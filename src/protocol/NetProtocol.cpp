@@ -16,17 +16,21 @@ namespace fmerge::protocol {
 
 
     std::unique_ptr<ChangesPayload> ChangesPayload::deserialize(ReadFunc receive, unsigned long length) {
-        char *change_buffer = new char[length];
-        receive(change_buffer, length);
-
-        std::stringstream change_stream(change_buffer);
-        auto changes = deserialize_changes(change_stream);
+        std::string change_buffer(length, '\0');
+        receive(change_buffer.data(), length);
+
+        bool complete{};
+        auto changes = deserialize_changes(std::string_view(change_buffer), &complete);
+        if(!complete) {
+            LOG("[Error] Received a change list that could not be parsed after " << changes.size() << " changes" << std::endl);
+            exit(1);
+        }
         return std::make_unique<ChangesPayload>(changes.begin(), changes.end());
     }
 
 
     void FileTransferPayload::serialize(WriteFunc write) const {
-        long mtime_le = htole64(mod_time);
+        long mtime_le = htole64(mod_time_ns);
         write(&mtime_le, sizeof(mtime_le));
 
         long atime_le = htole64(access_time);
@@ -131,4 +135,49 @@ namespace fmerge::protocol {
         return std::unique_ptr<StatePayload>(new StatePayload(static_cast<State>(state)));
     }
 
+
+
+    void TreeHashesPayload::serialize(WriteFunc write) const {
+        unsigned int round_le = htole32(round);
+        write(&round_le, sizeof(round_le));
+        for(const auto& node : nodes) {
+            unsigned short path_length = htole16(static_cast<unsigned short>(node.path.length()));
+            write(&path_length, sizeof(path_length));
+            write(node.path.c_str(), node.path.length());
+            unsigned long hash_le = htole64(node.hash);
+            write(&hash_le, sizeof(hash_le));
+            unsigned long own_hash_le = htole64(node.own_hash);
+            write(&own_hash_le, sizeof(own_hash_le));
+            unsigned int children_le = htole32(node.children);
+            write(&children_le, sizeof(children_le));
+        }
+    }
+
+
+    std::unique_ptr<TreeHashesPayload> TreeHashesPayload::deserialize(ReadFunc receive, unsigned long length) {
+        unsigned int round{};
+        receive(&round, sizeof(round));
+        auto payload = std::make_unique<TreeHashesPayload>(le32toh(round), std::vector<NodeHash>{});
+
+        unsigned long bytes_read{sizeof(round)};
+        while(bytes_read < length) {
+            NodeHash node{};
+            unsigned short path_length{};
+            receive(&path_length, sizeof(path_length));
+            path_length = le16toh(path_length);
+            node.path.resize(path_length);
+            receive(node.path.data(), path_length);
+            receive(&node.hash, sizeof(node.hash));
+            node.hash = le64toh(node.hash);
+            receive(&node.own_hash, sizeof(node.own_hash));
+            node.own_hash = le64toh(node.own_hash);
+            receive(&node.children, sizeof(node.children));
+            node.children = le32toh(node.children);
+
+            bytes_read += sizeof(path_length) + path_length + sizeof(node.hash) + sizeof(node.own_hash) + sizeof(node.children);
+            payload->nodes.push_back(std::move(node));
+        }
+        return payload;
+    }
+
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include "GenericMessage.h"
 #include "../FileTree.h"
+#include "../HashTree.h"
 #include "../MergeAlgorithms.h"
 #include "../ApplicationState.h"
 
@@ -27,14 +28,14 @@ namespace fmerge::protocol {
 
 
     struct FileTransferPayload {
-        FileTransferPayload(std::string _path, std::shared_ptr<unsigned char> file_contents, unsigned long file_len, FileType type, long mtime, long atime)
-            : path(_path), payload(file_contents), payload_len(file_len), ftype(type), mod_time(mtime), access_time(atime) {}
+        FileTransferPayload(std::string _path, std::shared_ptr<unsigned char> file_contents, unsigned long file_len, FileType type, long mtime_ns, long atime)
+            : path(_path), payload(file_contents), payload_len(file_len), ftype(type), mod_time_ns(mtime_ns), access_time(atime) {}
         // Constructor used to create empty packets indicating an error.
         FileTransferPayload(std::string _path) :
-            path(_path), payload(nullptr), payload_len(0), ftype(FileType::Unknown), mod_time(0), access_time(0) {}
+            path(_path), payload(nullptr), payload_len(0), ftype(FileType::Unknown), mod_time_ns(0), access_time(0) {}
         // Constructor for fstat object 
         FileTransferPayload(std::string _path, std::shared_ptr<unsigned char> file_contents, const FileStats& stats)
-            : path(_path), payload(file_contents), payload_len(0), ftype(stats.type), mod_time(stats.mtime), access_time(stats.atime) {
+            : path(_path), payload(file_contents), payload_len(0), ftype(stats.type), mod_time_ns(stats.mtime_ns), access_time(stats.atime) {
             if(stats.type != FileType::Directory) {
                 payload_len = stats.fsize;
             }
@@ -44,7 +45,7 @@ namespace fmerge::protocol {
         std::shared_ptr<unsigned char> payload;
         unsigned long payload_len;
         FileType ftype;
-        long mod_time;
+        long mod_time_ns; // Nanoseconds, so the receiver can reproduce the exact file version
         long access_time;
 
         void serialize(WriteFunc write) const;
@@ -81,6 +82,18 @@ namespace fmerge::protocol {
     };
 
 
+    struct TreeHashesPayload {
+        TreeHashesPayload(unsigned int _round, std::vector<NodeHash> _nodes) : round(_round), nodes(std::move(_nodes)) {}
+
+        // Messages of different rounds may be handled out of order
+        unsigned int round;
+        std::vector<NodeHash> nodes;
+
+        void serialize(WriteFunc write) const;
+        static std::unique_ptr<TreeHashesPayload> deserialize(ReadFunc receive, unsigned long length);
+    };
+
+
     // --------------------------------------------------------------------------------
     // ---------------------------- Message Definitions -------------------------------
     // --------------------------------------------------------------------------------
@@ -138,4 +151,13 @@ namespace fmerge::protocol {
         MsgType type() const override { return MsgType::ConflictResolutions; }
     };
 
+
+
+    class TreeHashesMessage : public Message<TreeHashesPayload> {
+    public:
+        using Message<TreeHashesPayload>::Message;
+        TreeHashesMessage() = delete;
+        MsgType type() const override { return MsgType::TreeHashes; }
+    };
+
 }
\ No newline at end of file
@@ -25,6 +25,7 @@ namespace fmerge::protocol {
         {MsgType::FileRequest,         "FILE_REQUEST"       , deserialize<FileRequestMessage>        },
         {MsgType::ExitingState,        "EXITING_STATE"      , deserialize<ExitingStateMessage>       },
         {MsgType::ConflictResolutions, "CONFLICT_RESOLUTION", deserialize<ConflictResolutionsMessage>},
+        {MsgType::TreeHashes,          "TREE_HASHES"        , deserialize<TreeHashesMessage>         },
     };
 
     
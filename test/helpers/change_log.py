@@ -0,0 +1,85 @@
+import stat
+import struct
+from dataclasses import dataclass
+
+# Values of ChangeType and FileType in FileTree.h
+MODIFICATION = 1
+CREATION = 2
+DELETION = 3
+MOVE = 6
+TERMINATE_LIST = 5
+
+DIRECTORY = 1
+FILE = 2
+
+
+@dataclass
+class Change:
+    type: int
+    file_type: int
+    path: str
+    earliest_change_time: int
+    latest_change_time: int = 0
+    mtime_ns: int = 0
+    size: int = 0
+    ino: int = 0
+    dev: int = 0
+    content_hash: int = 0
+    moved_from: str = ''
+    log_time_ns: int = 0
+
+    @staticmethod
+    def from_stat(type, path, stats):
+        """
+        Change that matches the current state of a file, so that a scan does not record it again.
+        """
+        file_type = DIRECTORY if stat.S_ISDIR(stats.st_mode) else FILE
+        return Change(type, file_type, path, stats.st_mtime_ns // 10**9, mtime_ns=stats.st_mtime_ns,
+            size=stats.st_size if file_type == FILE else 0, ino=stats.st_ino, dev=stats.st_dev, log_time_ns=stats.st_mtime_ns)
+
+
+def write_csv_log(path, changes):
+    """
+    Write a change log in the CSV format of the first releases, which later versions convert when they open it.
+    """
+    with open(path, 'w') as log:
+        for change in changes:
+            log.write(f'{change.type},{change.earliest_change_time},{change.latest_change_time},{change.file_type},{change.path}\n')
+        log.write(f'{TERMINATE_LIST},0,0,0,\n')
+
+
+def _record_checksum(record):
+    # FNV-1a, folded to 32 bits
+    hash = 0xcbf29ce484222325
+    for byte in record:
+        hash = ((hash ^ byte) * 0x100000001b3) & 0xFFFFFFFFFFFFFFFF
+    return (hash ^ (hash >> 32)) & 0xFFFFFFFF
+
+
+def write_binary_log(path, changes, version):
+    """
+    Write a change log in version 2 or 3 of the binary format, before paths were front-coded.
+    """
+    with open(path, 'wb') as log:
+        log.write(b'FMCL' + struct.pack('<I', version))
+        for change in changes:
+            path_bytes = change.path.encode('utf-8')
+            moved_from_bytes = change.moved_from.encode('utf-8')
+            record = struct.pack('<BBHHHqqqQQQQ', change.type, change.file_type, len(path_bytes), len(moved_from_bytes), 0,
+                change.earliest_change_time, change.latest_change_time, change.mtime_ns, change.size, change.ino, change.dev,
+                change.content_hash)
+            record += path_bytes + moved_from_bytes
+            if version >= 3:
+                record += struct.pack('<q', change.log_time_ns)
+            log.write(struct.pack('<II', len(record), _record_checksum(record)) + record)
+
+
+def read_log_version(path):
+    """
+    Return the version of a binary change log, or None if it is in the CSV format.
+    """
+    with open(path, 'rb') as log:
+        header = log.read(8)
+    if len(header) < 8 or header[:4] != b'FMCL':
+        return None
+    return int.from_bytes(header[4:], 'little')
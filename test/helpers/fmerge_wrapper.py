@@ -10,10 +10,10 @@ def save_thread_log(log_prefix, pid_a, pid_b):
         log2.write(get_process_threads(pid_b))
 
 
-def fmerge(fmerge_path, test_path, log_prefix, server_readiness_wait=5, timeout=60, probe_interval=0.1):
+def fmerge(fmerge_path, test_path, log_prefix, server_readiness_wait=5, timeout=60, probe_interval=0.1, args=()):
     """
     Return without any exceptions if execution was successfull (according to the fmerge exit code and timeout limits).
-    Writes logs to file.
+    Writes logs to file. args are passed to both the server and the client.
     """
 
     def check_exit_code(r1, r2):
@@ -27,14 +27,14 @@ def fmerge(fmerge_path, test_path, log_prefix, server_readiness_wait=5, timeout=
     with open(f'{log_prefix}_a.log', 'w') as log1, open(f'{log_prefix}_b.log', 'w') as log2:
         # Start the processes
         p1 = subprocess.Popen(
-            [fmerge_path, '-y', '-d', '-s', (test_path / 'peer_a').as_posix()],
+            [fmerge_path, *args, '-y', '-d', '-s', (test_path / 'peer_a').as_posix()],
             stdout=log1,
             stderr=log1
         )
         # Wait for p1 to start listening for clients
         time.sleep(server_readiness_wait)
         p2 = subprocess.Popen(
-            [fmerge_path, '-y', '-d', '-c', 'localhost', (test_path / 'peer_b').as_posix()],
+            [fmerge_path, *args, '-y', '-d', '-c', 'localhost', (test_path / 'peer_b').as_posix()],
             stdout=log2,
             stderr=log2
         )
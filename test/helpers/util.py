@@ -1,6 +1,37 @@
 import subprocess
+from helpers import TestException
 
 
 def get_process_threads(pid):
     res = subprocess.run(['ps', '-T', '-p', str(pid)], capture_output=True)
-    return res.stdout.decode('utf-8')
\ No newline at end of file
+    return res.stdout.decode('utf-8')
+
+def read_tree(path):
+    """
+    Return the contents of all files below path by their relative path, without the .fmerge folder.
+    Directories map to None.
+    """
+    tree = {}
+    for entry in path.rglob('*'):
+        relative_path = entry.relative_to(path)
+        if relative_path.parts[0] == '.fmerge':
+            continue
+        if entry.is_dir():
+            tree[relative_path.as_posix()] = None
+        else:
+            tree[relative_path.as_posix()] = entry.read_bytes()
+    return tree
+
+
+def compare_trees(path_a, path_b):
+    """
+    Raise a TestException if the files below both paths differ.
+    """
+    tree_a = read_tree(path_a)
+    tree_b = read_tree(path_b)
+    if tree_a == tree_b:
+        return
+    only_a = sorted(tree_a.keys() - tree_b.keys())
+    only_b = sorted(tree_b.keys() - tree_a.keys())
+    differing = sorted(p for p in tree_a.keys() & tree_b.keys() if tree_a[p] != tree_b[p])
+    raise TestException(f'Peers differ. Only in {path_a.name}: {only_a}, only in {path_b.name}: {only_b}, different contents: {differing}')
@@ -17,6 +17,8 @@ import time
 from helpers import TEST_NG, TEST_OK, TestException
 from helpers.file_gen import bidir_conflictless, bidir_conflictless_subdirs, simplex_conflictless_subdirs
 import helpers.fmerge_wrapper as fmerge_wrapper
+from helpers.util import compare_trees
+import helpers.change_log as change_log
 
 SUPRESS_STDOUT = False
 
@@ -30,6 +32,20 @@ LOG_DIR = Path('/tmp/fmerge_logs')
 ###########################   Test Definitions   ##############################
 ###############################################################################
 
+def run_fmerge(*args):
+    # Runs one of the modes that do not need a peer
+    return subprocess.run([FMERGE_BINARY, *args], stdin=subprocess.DEVNULL, capture_output=True, timeout=30)
+
+
+def create_peers(files_a={}, files_b={}):
+    # Creates both peers with the given files. Parent folders are created as needed
+    for peer, files in (('peer_a', files_a), ('peer_b', files_b)):
+        (TEST_PATH / peer).mkdir()
+        for path, contents in files.items():
+            (TEST_PATH / peer / path).parent.mkdir(parents=True, exist_ok=True)
+            (TEST_PATH / peer / path).write_bytes(contents)
+
+
 def test_check_version():
     res = subprocess.run([FMERGE_BINARY, '-v'], capture_output=True)
     if res.returncode != 0:
@@ -152,6 +168,412 @@ def test_tree_deletion():
 
     return (TEST_OK, '')
 
+
+def start_watcher(log_name):
+    # Starts a watcher for peer_a and waits until its initial scan is done
+    with open(LOG_DIR / log_name, 'w') as log:
+        watcher = subprocess.Popen([FMERGE_BINARY, '-d', '--watch', (TEST_PATH / 'peer_a').as_posix()], stdout=log, stderr=log)
+    start_time = time.time()
+    while b'Watching' not in (LOG_DIR / log_name).read_bytes():
+        if watcher.poll() is not None or time.time() > start_time + 10:
+            watcher.kill()
+            raise TestException('The watcher did not start')
+        time.sleep(0.1)
+    return watcher
+
+
+def test_watcher_flush():
+    # A sync right after a change must see it, even though the change log is kept by a watcher.
+    # The sync asks the watcher to record its pending events instead of scanning the folder.
+    create_peers({'old.txt': b'old'})
+    try:
+        watcher = start_watcher('watcher_flush_watcher.log')
+    except TestException as e:
+        return (TEST_NG, str(e))
+    try:
+        # Not waiting for the watcher to record the change
+        (TEST_PATH / 'peer_a' / 'new.txt').write_bytes(b'new')
+        try:
+            fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'watcher_flush', server_readiness_wait=1, timeout=10)
+        except TestException as e:
+            return (TEST_NG, str(e))
+    finally:
+        watcher.terminate()
+        watcher.wait(timeout=10)
+
+    if b'kept up to date by a watcher' not in (LOG_DIR / 'watcher_flush_a.log').read_bytes():
+        return (TEST_NG, 'The server scanned the folder instead of asking the watcher')
+    if watcher.returncode != 0:
+        return (TEST_NG, f'The watcher failed with error code {watcher.returncode}')
+    try:
+        compare_trees(TEST_PATH / 'peer_a', TEST_PATH / 'peer_b')
+    except TestException as e:
+        return (TEST_NG, str(e))
+
+    return (TEST_OK, '')
+
+
+def test_ignore_rules():
+    # Entries matched by .fmergeignore are neither recorded nor synced. Everything below an ignored
+    # directory is pruned, so a later ! pattern cannot re-include it.
+    create_peers({
+        '.fmergeignore': b'# Build output\nbuild/\n*.log\n!important.log\n!build/keep.txt\n',
+        'build/out.o': b'a',
+        'build/keep.txt': b'a',
+        'debug.log': b'a',
+        'important.log': b'a',
+        'src/main.log': b'a',
+        'src/main.c': b'a',
+    })
+    try:
+        fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'ignore_rules_part1', server_readiness_wait=1, timeout=10)
+    except TestException as e:
+        return (TEST_NG, str(e))
+
+    # peer_b received the ignore file, so it applies to its own files from now on
+    for path in ('docs/build/index.html', 'docs/readme.txt', 'docs/notes.log'):
+        (TEST_PATH / 'peer_b' / path).parent.mkdir(parents=True, exist_ok=True)
+        (TEST_PATH / 'peer_b' / path).write_bytes(b'b')
+    try:
+        fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'ignore_rules_part2', server_readiness_wait=1, timeout=10)
+    except TestException as e:
+        return (TEST_NG, str(e))
+
+    expected = {
+        'build/out.o': (True, False),
+        'build/keep.txt': (True, False),
+        'debug.log': (True, False),
+        'important.log': (True, True),
+        'src/main.log': (True, False),
+        'src/main.c': (True, True),
+        'docs/build/index.html': (False, True),
+        'docs/readme.txt': (True, True),
+        'docs/notes.log': (False, True),
+    }
+    for path, (in_a, in_b) in expected.items():
+        if (TEST_PATH / 'peer_a' / path).exists() != in_a or (TEST_PATH / 'peer_b' / path).exists() != in_b:
+            return (TEST_NG, f'{path} should {"" if in_a else "not "}be in peer_a and {"" if in_b else "not "}in peer_b')
+
+    # Ignored files are not part of the history either
+    if run_fmerge('--history', 'build/keep.txt', (TEST_PATH / 'peer_a').as_posix()).returncode == 0:
+        return (TEST_NG, 'Changes of an ignored file were recorded')
+
+    return (TEST_OK, '')
+
+
+def test_tree_snapshot_validation():
+    # The tree snapshot is only used for the change log it was saved for. A snapshot for a log that was
+    # replaced, or one that is damaged, is not trusted, and the tree is rebuilt from the whole log.
+    # Every sync rewrites the log, so the scans of consecutive watcher runs are compared instead.
+    create_peers({'a.txt': b'a', 'dir/b.txt': b'b'})
+    config_dir = TEST_PATH / 'peer_a' / '.fmerge'
+
+    def scan(log_name, expect_snapshot):
+        watcher = start_watcher(log_name)
+        watcher.terminate()
+        if watcher.wait(timeout=10) != 0:
+            raise TestException(f'{log_name}: The watcher failed with error code {watcher.returncode}')
+        log = (LOG_DIR / log_name).read_bytes()
+        if expect_snapshot and b'after the tree snapshot' not in log:
+            raise TestException(f'{log_name}: The tree snapshot was not used')
+        if not expect_snapshot and b'No valid tree snapshot' not in log:
+            raise TestException(f'{log_name}: An invalid tree snapshot was used')
+
+    try:
+        scan('tree_snapshot_part1.log', expect_snapshot=False)
+        (TEST_PATH / 'peer_a' / 'c.txt').write_bytes(b'c')
+        scan('tree_snapshot_part2.log', expect_snapshot=True)
+
+        # A copy of the log with the same contents is a different log
+        shutil.copyfile(config_dir / 'filechanges.db', config_dir / 'filechanges.copy')
+        os.replace(config_dir / 'filechanges.copy', config_dir / 'filechanges.db')
+        (TEST_PATH / 'peer_a' / 'd.txt').write_bytes(b'd')
+        scan('tree_snapshot_part3.log', expect_snapshot=False)
+
+        # Ignored changes are not part of the tree, so it depends on the ignore rules
+        (TEST_PATH / 'peer_a' / '.fmergeignore').write_bytes(b'*.tmp\n')
+        scan('tree_snapshot_part4.log', expect_snapshot=False)
+
+        snapshot = (config_dir / 'treesnapshot.db').read_bytes()
+        (config_dir / 'treesnapshot.db').write_bytes(snapshot[:len(snapshot) // 2])
+        (TEST_PATH / 'peer_a' / 'dir' / 'b.txt').unlink()
+        scan('tree_snapshot_part5.log', expect_snapshot=False)
+
+        # The snapshot was replaced, and the log it describes still holds every change
+        scan('tree_snapshot_part6.log', expect_snapshot=True)
+        fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'tree_snapshot', server_readiness_wait=1, timeout=10)
+        compare_trees(TEST_PATH / 'peer_a', TEST_PATH / 'peer_b')
+    except TestException as e:
+        return (TEST_NG, str(e))
+
+    return (TEST_OK, '')
+
+
+def test_move():
+    # A renamed file is recorded as a move and renamed on the peer as well, instead of being transferred again
+    create_peers({'dir/moved.bin': os.urandom(256*1024), 'dir/kept.txt': b'kept'})
+    try:
+        fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'move_part1', server_readiness_wait=1, timeout=10)
+        (TEST_PATH / 'peer_a' / 'new_dir').mkdir()
+        os.rename(TEST_PATH / 'peer_a' / 'dir' / 'moved.bin', TEST_PATH / 'peer_a' / 'new_dir' / 'moved.bin')
+        fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'move_part2', server_readiness_wait=1, timeout=10)
+        compare_trees(TEST_PATH / 'peer_a', TEST_PATH / 'peer_b')
+    except TestException as e:
+        return (TEST_NG, str(e))
+
+    log = (LOG_DIR / 'move_part2_b.log').read_bytes()
+    if b'Moving' not in log or b'Requesting file new_dir/moved.bin' in log:
+        return (TEST_NG, 'The file was transferred instead of moved')
+
+    return (TEST_OK, '')
+
+
+def test_move_fallback():
+    # A move that cannot be performed on the peer, here because it crosses file systems, falls back to a
+    # transfer. The old path must still be deleted.
+    if os.geteuid() != 0:
+        print('(skipped, mounting requires root) ', end='')
+        return (TEST_OK, '')
+
+    create_peers({'dir/moved.bin': os.urandom(256*1024), 'other/kept.txt': b'kept'})
+    mount_point = TEST_PATH / 'peer_b' / 'other'
+    try:
+        fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'move_fallback_part1', server_readiness_wait=1, timeout=10)
+    except TestException as e:
+        return (TEST_NG, str(e))
+
+    # The mount hides the synced contents of the folder, so they are copied onto it
+    shutil.copytree(mount_point, TEST_PATH / 'other')
+    if subprocess.run(['mount', '-t', 'tmpfs', 'none', mount_point.as_posix()], capture_output=True).returncode != 0:
+        print('(skipped, could not mount a tmpfs) ', end='')
+        return (TEST_OK, '')
+    try:
+        shutil.copytree(TEST_PATH / 'other', mount_point, dirs_exist_ok=True, copy_function=shutil.copy2)
+        os.rename(TEST_PATH / 'peer_a' / 'dir' / 'moved.bin', TEST_PATH / 'peer_a' / 'other' / 'moved.bin')
+        fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'move_fallback_part2', server_readiness_wait=1, timeout=10)
+        compare_trees(TEST_PATH / 'peer_a', TEST_PATH / 'peer_b')
+    except TestException as e:
+        return (TEST_NG, str(e))
+    finally:
+        subprocess.run(['umount', mount_point.as_posix()])
+
+    if b'Transferring it instead' not in (LOG_DIR / 'move_fallback_part2_b.log').read_bytes():
+        return (TEST_NG, 'The move did not fall back to a transfer')
+
+    return (TEST_OK, '')
+
+
+def test_content_hash():
+    # With --hash, a file that was created on both peers with the same contents is neither a conflict
+    # nor transferred. Only its modification time is aligned.
+    contents = os.urandom(256*1024)
+    create_peers({'same.bin': contents}, {'same.bin': contents})
+    os.utime(TEST_PATH / 'peer_b' / 'same.bin', (time.time() - 60, time.time() - 60))
+    try:
+        fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'content_hash', server_readiness_wait=1, timeout=10, args=('--hash',))
+        compare_trees(TEST_PATH / 'peer_a', TEST_PATH / 'peer_b')
+    except TestException as e:
+        return (TEST_NG, str(e))
+
+    log = (LOG_DIR / 'content_hash_a.log').read_bytes() + (LOG_DIR / 'content_hash_b.log').read_bytes()
+    if b'Requesting file same.bin' in log or b'Touching same.bin' not in log:
+        return (TEST_NG, 'The file was transferred although both peers have the same contents')
+    if (TEST_PATH / 'peer_a' / 'same.bin').stat().st_mtime_ns != (TEST_PATH / 'peer_b' / 'same.bin').stat().st_mtime_ns:
+        return (TEST_NG, 'The modification times were not aligned')
+
+    return (TEST_OK, '')
+
+
+def history(path):
+    # Types of the recorded changes of a file in peer_a
+    res = run_fmerge('--history', path, (TEST_PATH / 'peer_a').as_posix())
+    if res.returncode != 0:
+        return []
+    # With stdin closed, the terminal warns about it without a line break
+    output = res.stdout.decode('utf-8').replace('[Warning] Unexpected EOF reached for stdin', '')
+    return [line.split()[0] for line in output.splitlines() if line.strip()]
+
+
+def test_csv_log_upgrade():
+    # A change log in the CSV format of the first releases is read as is, and converted to the binary
+    # format once the log is written. The history it holds is kept.
+    create_peers({'a.txt': b'a', 'dir/b.txt': b'b'})
+    now = int(time.time())
+    for path in ('a.txt', 'dir/b.txt', 'dir'):
+        os.utime(TEST_PATH / 'peer_a' / path, ns=(now * 10**9, now * 10**9))
+    (TEST_PATH / 'peer_a' / '.fmerge').mkdir()
+    log_path = TEST_PATH / 'peer_a' / '.fmerge' / 'filechanges.db'
+    change_log.write_csv_log(log_path, [
+        change_log.Change(change_log.CREATION, change_log.FILE, 'a.txt', now - 100),
+        change_log.Change(change_log.CREATION, change_log.DIRECTORY, 'dir', now),
+        change_log.Change(change_log.CREATION, change_log.FILE, 'dir/b.txt', now),
+        change_log.Change(change_log.CREATION, change_log.FILE, 'gone.txt', now - 100),
+        change_log.Change(change_log.MODIFICATION, change_log.FILE, 'a.txt', now),
+    ])
+    csv_log = log_path.read_bytes()
+
+    # Reading the log does not change it
+    if history('a.txt') != ['Creation', 'Modification'] or log_path.read_bytes() != csv_log:
+        return (TEST_NG, 'The CSV log could not be read')
+
+    try:
+        fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'csv_log_upgrade', server_readiness_wait=1, timeout=10)
+        compare_trees(TEST_PATH / 'peer_a', TEST_PATH / 'peer_b')
+    except TestException as e:
+        return (TEST_NG, str(e))
+
+    if change_log.read_log_version(log_path) is None:
+        return (TEST_NG, 'The log was not converted')
+    if history('a.txt') != ['Creation', 'Modification'] or history('gone.txt') != ['Creation', 'Deletion']:
+        return (TEST_NG, f'The history was not kept: {history("a.txt")}, {history("gone.txt")}')
+
+    return (TEST_OK, '')
+
+
+def test_torn_log_tail():
+    # A crash during an append leaves a partial record at the end of the change log. The next run drops
+    # it with a warning and appends after the intact records.
+    create_peers({'a.txt': b'a'})
+    log_path = TEST_PATH / 'peer_a' / '.fmerge' / 'filechanges.db'
+    try:
+        fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'torn_log_tail_part1', server_readiness_wait=1, timeout=10)
+
+        # The first half of the first record, after the 8 byte header
+        log = log_path.read_bytes()
+        with open(log_path, 'ab') as log_file:
+            log_file.write(log[8:8 + 40])
+        (TEST_PATH / 'peer_a' / 'b.txt').write_bytes(b'b')
+        fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'torn_log_tail_part2', server_readiness_wait=1, timeout=10)
+        compare_trees(TEST_PATH / 'peer_a', TEST_PATH / 'peer_b')
+        if b'damaged entry' not in (LOG_DIR / 'torn_log_tail_part2_a.log').read_bytes():
+            return (TEST_NG, 'The damaged record was not reported')
+
+        fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'torn_log_tail_part3', server_readiness_wait=1, timeout=10)
+        if b'damaged entry' in (LOG_DIR / 'torn_log_tail_part3_a.log').read_bytes():
+            return (TEST_NG, 'The damaged record was not removed')
+    except TestException as e:
+        return (TEST_NG, str(e))
+
+    if history('a.txt') != ['Creation'] or history('b.txt') != ['Creation']:
+        return (TEST_NG, f'The history was not kept: {history("a.txt")}, {history("b.txt")}')
+
+    return (TEST_OK, '')
+
+
+def test_compaction():
+    # Compacting the histories that both peers have synced must not change the result of later syncs
+    create_peers({'a.txt': b'a1', 'dir/b.txt': b'b'})
+    try:
+        fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'compaction_part1', server_readiness_wait=1, timeout=10)
+        (TEST_PATH / 'peer_a' / 'a.txt').write_bytes(b'a2')
+        fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'compaction_part2', server_readiness_wait=1, timeout=10)
+        (TEST_PATH / 'peer_b' / 'a.txt').write_bytes(b'a3')
+        fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'compaction_part3', server_readiness_wait=1, timeout=10)
+    except TestException as e:
+        return (TEST_NG, str(e))
+
+    full_history = history('a.txt')
+    for peer in ('peer_a', 'peer_b'):
+        res = run_fmerge('--compact', (TEST_PATH / peer).as_posix())
+        if res.returncode != 0 or b'Removed' not in res.stdout:
+            return (TEST_NG, f'The change log of {peer} was not compacted')
+    if len(history('a.txt')) >= len(full_history):
+        return (TEST_NG, f'The history was not shortened: {history("a.txt")}')
+
+    # Changes on both sides after the compaction
+    (TEST_PATH / 'peer_a' / 'a.txt').write_bytes(b'a4')
+    (TEST_PATH / 'peer_a' / 'dir' / 'b.txt').unlink()
+    (TEST_PATH / 'peer_b' / 'c.txt').write_bytes(b'c')
+    try:
+        fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'compaction_part4', server_readiness_wait=1, timeout=10)
+        compare_trees(TEST_PATH / 'peer_a', TEST_PATH / 'peer_b')
+    except TestException as e:
+        return (TEST_NG, str(e))
+
+    if (TEST_PATH / 'peer_b' / 'a.txt').read_bytes() != b'a4' or (TEST_PATH / 'peer_b' / 'dir' / 'b.txt').exists():
+        return (TEST_NG, 'The changes after the compaction were not synced')
+
+    return (TEST_OK, '')
+
+
+def test_change_index_validation():
+    # The index of the change log is only used for the log it was built for. An index for an older
+    # version of the log, or for the log of another folder, is rebuilt before it is used.
+    files = {f'dir/file_{i:02}': b'x' for i in range(40)}
+    files['a.txt'] = b'a1'
+    create_peers(files)
+    index_path = TEST_PATH / 'peer_a' / '.fmerge' / 'filechanges.idx'
+    try:
+        fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'change_index_part1', server_readiness_wait=1, timeout=10)
+        old_index = index_path.read_bytes()
+        (TEST_PATH / 'peer_a' / 'a.txt').write_bytes(b'a2')
+        (TEST_PATH / 'peer_a' / 'dir' / 'file_05').unlink()
+        fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'change_index_part2', server_readiness_wait=1, timeout=10)
+    except TestException as e:
+        return (TEST_NG, str(e))
+
+    for stale_index in (old_index, (TEST_PATH / 'peer_b' / '.fmerge' / 'filechanges.idx').read_bytes()):
+        index_path.write_bytes(stale_index)
+        if history('a.txt') != ['Creation', 'Modification'] or history('dir/file_05') != ['Creation', 'Deletion']:
+            return (TEST_NG, f'A stale index was used: {history("a.txt")}, {history("dir/file_05")}')
+        if index_path.read_bytes() == stale_index:
+            return (TEST_NG, 'The stale index was not rebuilt')
+
+    # The sync reads the histories through the rebuilt index
+    index_path.write_bytes(old_index)
+    (TEST_PATH / 'peer_b' / 'dir' / 'file_10').write_bytes(b'y')
+    try:
+        fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'change_index_part3', server_readiness_wait=1, timeout=10)
+        compare_trees(TEST_PATH / 'peer_a', TEST_PATH / 'peer_b')
+    except TestException as e:
+        return (TEST_NG, str(e))
+    if b'index is damaged' in (LOG_DIR / 'change_index_part3_a.log').read_bytes():
+        return (TEST_NG, 'The stale index was used in the sync')
+
+    return (TEST_OK, '')
+
+
+def test_v3_log_upgrade():
+    # A log in version 3 of the binary format is read as is, and rewritten with front-coded paths once
+    # the log is written. The history it holds is kept.
+    files = {f'dir/file_{i:02}': b'x' for i in range(40)}
+    files['new.txt'] = b'moved'
+    create_peers(files)
+    (TEST_PATH / 'peer_a' / '.fmerge').mkdir()
+    log_path = TEST_PATH / 'peer_a' / '.fmerge' / 'filechanges.db'
+
+    def created(path):
+        return change_log.Change.from_stat(change_log.CREATION, path, (TEST_PATH / 'peer_a' / path).stat())
+    changes = [created('dir')] + [created(path) for path in sorted(files) if path != 'new.txt']
+    changes.append(change_log.Change(change_log.CREATION, change_log.FILE, 'gone.txt', int(time.time()) - 100))
+    changes.append(change_log.Change(change_log.CREATION, change_log.FILE, 'old.txt', int(time.time()) - 100))
+    moved = created('new.txt')
+    moved.type = change_log.MOVE
+    moved.moved_from = 'old.txt'
+    changes.append(moved)
+    change_log.write_binary_log(log_path, changes, version=3)
+    v3_log = log_path.read_bytes()
+
+    # Reading the log does not change it
+    if history('dir/file_07') != ['Creation'] or log_path.read_bytes() != v3_log:
+        return (TEST_NG, 'The version 3 log could not be read')
+
+    try:
+        fmerge_wrapper.fmerge(FMERGE_BINARY, TEST_PATH, LOG_DIR / 'v3_log_upgrade', server_readiness_wait=1, timeout=10)
+        compare_trees(TEST_PATH / 'peer_a', TEST_PATH / 'peer_b')
+    except TestException as e:
+        return (TEST_NG, str(e))
+
+    if change_log.read_log_version(log_path) != 4:
+        return (TEST_NG, f'The log was not upgraded, it has version {change_log.read_log_version(log_path)}')
+    for path in files:
+        if path != 'new.txt' and history(path) != ['Creation']:
+            return (TEST_NG, f'The history of {path} was not kept: {history(path)}')
+    if history('new.txt') != ['Move'] or history('gone.txt') != ['Creation', 'Deletion']:
+        return (TEST_NG, f'The history was not kept: {history("new.txt")}, {history("gone.txt")}')
+
+    return (TEST_OK, '')
+
 ###############################################################################
 ########################   Start of Test Harness   ############################
 ###############################################################################
@@ -164,6 +586,17 @@ system_tests = [
     test_simplex_medium_file,
     test_simplex_simple_subdirs,
     test_tree_deletion,
+    test_watcher_flush,
+    test_ignore_rules,
+    test_tree_snapshot_validation,
+    test_move,
+    test_move_fallback,
+    test_content_hash,
+    test_csv_log_upgrade,
+    test_torn_log_tail,
+    test_compaction,
+    test_change_index_validation,
+    test_v3_log_upgrade,
 ]
 
 